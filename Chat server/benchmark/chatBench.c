@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+// Multi threaded client for benchmarking the chat server.
+// Senders write timestamped lines at a fixed rate, and every other connection counts the lines
+// it gets back and how long they took. The results of the run are printed as a single line of JSON.
+// Build: gcc -O2 -Wall -pthread -o chatBench benchmark/chatBench.c
+
+#define RECEIVER_THREADS 4
+#define LINE_BUFFER_SIZE 4096
+#define READ_BUFFER_SIZE (64*1024)
+#define MAX_EVENTS 256
+#define HISTOGRAM_STEP_US 10     // width of a latency bucket
+#define HISTOGRAM_BUCKETS 100000 // latencies up to a second, longer ones are counted in the last bucket
+#define DRAIN_MS 1000           // how long the receivers wait for lines still queued at the end
+
+// A connection that is read by a receiver thread
+typedef struct {
+    int fd;
+    bool warm;                  // got a line, so the server accepted it
+    int partial_len;
+    char partial[LINE_BUFFER_SIZE];
+} ChatConn;
+
+// What every receiver thread measured
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    ChatConn *conns;
+    long num_conns;
+    long lines;
+    long bytes;
+    long *histogram;
+} Receiver;
+
+// What every sender thread sent
+typedef struct {
+    pthread_t thread;
+    int fd;
+    long sent;
+    long errors;
+} Sender;
+
+static struct sockaddr_in server_address;
+static long message_size = 64;
+static long rate_per_sender = 1000;
+static long num_conns = 0;
+
+// Set by the main thread, read by all the others
+static atomic_int measuring = 0;
+static atomic_int receivers_done = 0;
+static atomic_long warm_conns = 0;
+static atomic_long end_time_us = 0;
+
+void print_usage_error_and_quit();
+int connect_to_server();
+void* run_receiver(void *arg);
+void* run_sender(void *arg);
+void read_lines(Receiver *receiver, ChatConn *conn);
+bool send_all(int fd, const char *data, size_t len);
+long now_us();
+long percentile(const long *histogram, long count, double fraction);
+
+int main(int argc, char *argv[]) {
+    if (argc < 5 || argc > 7)
+        print_usage_error_and_quit();
+
+    char *endptr;
+    long port = strtol(argv[1], &endptr, 10);
+    if (*endptr != '\0' || port <= 0 || port > 65535)
+        print_usage_error_and_quit();
+
+    long num_receivers = strtol(argv[2], &endptr, 10);
+    if (*endptr != '\0' || num_receivers < 0)
+        print_usage_error_and_quit();
+
+    long num_senders = strtol(argv[3], &endptr, 10);
+    if (*endptr != '\0' || num_senders <= 0)
+        print_usage_error_and_quit();
+
+    long duration_s = strtol(argv[4], &endptr, 10);
+    if (*endptr != '\0' || duration_s <= 0)
+        print_usage_error_and_quit();
+
+    if (argc > 5) {
+        rate_per_sender = strtol(argv[5], &endptr, 10);
+        if (*endptr != '\0' || rate_per_sender <= 0)
+            print_usage_error_and_quit();
+    }
+    if (argc > 6) {
+        message_size = strtol(argv[6], &endptr, 10);
+        if (*endptr != '\0' || message_size < 24 || message_size > LINE_BUFFER_SIZE)
+            print_usage_error_and_quit();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection is a descriptor, allow as many as the hard limit
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_address.sin_port = htons(port);
+
+    // The senders are read too, they get the lines of the other senders
+    num_conns = num_receivers + num_senders;
+    Receiver receivers[RECEIVER_THREADS];
+    Sender *senders = calloc(num_senders, sizeof(Sender));
+    if (senders == NULL) {
+        perror("error: malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(receivers, 0, sizeof(receivers));
+    for (int i = 0; i < RECEIVER_THREADS; i++) {
+        receivers[i].conns = calloc(num_conns / RECEIVER_THREADS + 1, sizeof(ChatConn));
+        receivers[i].histogram = calloc(HISTOGRAM_BUCKETS, sizeof(long));
+        receivers[i].epoll_fd = epoll_create1(0);
+        if (receivers[i].conns == NULL || receivers[i].histogram == NULL || receivers[i].epoll_fd < 0) {
+            perror("error: receiver\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Connect everyone, the connections are dealt to the receiver threads in turn
+    for (long i = 0; i < num_conns; i++) {
+        int fd = connect_to_server();
+        if (fd < 0)
+            exit(EXIT_FAILURE);
+        if (i >= num_receivers)
+            senders[i - num_receivers].fd = fd;
+
+        Receiver *receiver = &receivers[i % RECEIVER_THREADS];
+        ChatConn *conn = &receiver->conns[receiver->num_conns++];
+        conn->fd = fd;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(receiver->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("error: epoll_ctl\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < RECEIVER_THREADS; i++) {
+        if (pthread_create(&receivers[i].thread, NULL, run_receiver, &receivers[i]) != 0) {
+            perror("error: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The server accepts in its own time, warm up lines go out until every connection got one.
+    // The first sender's own connection never gets its lines back, so another one warms it.
+    long warm_deadline_us = now_us() + 10 * 1000000L;
+    while (atomic_load(&warm_conns) < num_conns) {
+        if (now_us() > warm_deadline_us) {
+            fprintf(stderr, "error: only %ld of %ld connections were accepted\n", atomic_load(&warm_conns), num_conns);
+            exit(EXIT_FAILURE);
+        }
+        send_all(senders[0].fd, "0\n", 2);
+        if (num_senders > 1)
+            send_all(senders[1].fd, "0\n", 2);
+        else if (num_receivers > 0)
+            send_all(receivers[0].conns[0].fd, "0\n", 2);
+        usleep(10000);
+    }
+
+    long start_us = now_us();
+    atomic_store(&end_time_us, start_us + duration_s * 1000000L);
+    atomic_store(&measuring, 1);
+
+    for (long i = 0; i < num_senders; i++) {
+        if (pthread_create(&senders[i].thread, NULL, run_sender, &senders[i]) != 0) {
+            perror("error: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long sent = 0, send_errors = 0;
+    for (long i = 0; i < num_senders; i++) {
+        pthread_join(senders[i].thread, NULL);
+        sent += senders[i].sent;
+        send_errors += senders[i].errors;
+    }
+    double elapsed_s = (double) (now_us() - start_us) / 1e6;
+
+    // Give the server time to write what it still has queued
+    usleep(DRAIN_MS * 1000);
+    atomic_store(&receivers_done, 1);
+
+    // Collect the results of all the receivers
+    long lines = 0, bytes = 0, count = 0;
+    long *histogram = calloc(HISTOGRAM_BUCKETS, sizeof(long));
+    if (histogram == NULL) {
+        perror("error: malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < RECEIVER_THREADS; i++) {
+        pthread_join(receivers[i].thread, NULL);
+        lines += receivers[i].lines;
+        bytes += receivers[i].bytes;
+        for (long b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            histogram[b] += receivers[i].histogram[b];
+            count += receivers[i].histogram[b];
+        }
+        for (long c = 0; c < receivers[i].num_conns; c++)
+            close(receivers[i].conns[c].fd);
+        close(receivers[i].epoll_fd);
+        free(receivers[i].conns);
+        free(receivers[i].histogram);
+    }
+
+    // Every line goes to all the connections but its sender
+    long expected = sent * (num_conns - 1);
+    long max_us = 0;
+    for (long b = HISTOGRAM_BUCKETS - 1; b >= 0; b--) {
+        if (histogram[b] > 0) {
+            max_us = b * HISTOGRAM_STEP_US;
+            break;
+        }
+    }
+
+    printf("{\"receivers\": %ld, \"senders\": %ld, \"rate_per_sender\": %ld, \"message_size\": %ld, "
+           "\"duration_s\": %.2f, \"sent\": %ld, \"send_errors\": %ld, \"expected\": %ld, \"delivered\": %ld, "
+           "\"delivered_per_s\": %.1f, \"throughput_mb_s\": %.2f, "
+           "\"p50_us\": %ld, \"p99_us\": %ld, \"p999_us\": %ld, \"max_us\": %ld}\n",
+           num_receivers, num_senders, rate_per_sender, message_size,
+           elapsed_s, sent, send_errors, expected, lines,
+           (double) lines / elapsed_s, (double) bytes / elapsed_s / (1024.0 * 1024.0),
+           percentile(histogram, count, 0.5), percentile(histogram, count, 0.99),
+           percentile(histogram, count, 0.999), max_us);
+
+    free(histogram);
+    free(senders);
+    return send_errors == 0 && lines == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int connect_to_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+        perror("error: connect\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read the connections of the thread until the run and the drain after it are over
+void* run_receiver(void *arg) {
+    Receiver *receiver = (Receiver *) arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&receivers_done)) {
+        int ready = epoll_wait(receiver->epoll_fd, events, MAX_EVENTS, 50);
+        if (ready < 0 && errno != EINTR) {
+            perror("error: epoll_wait\n");
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+            read_lines(receiver, (ChatConn *) events[i].data.ptr);
+    }
+    return NULL;
+}
+
+// Count the complete lines of a connection, every line starts with the time it was sent
+void read_lines(Receiver *receiver, ChatConn *conn) {
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t n = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            fprintf(stderr, "error: the server closed a connection\n");
+            epoll_ctl(receiver->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        return;
+    }
+
+    long received_us = now_us();
+    bool measure = atomic_load(&measuring);
+    for (ssize_t start = 0; start < n;) {
+        char *newline = memchr(buffer + start, '\n', n - start);
+        size_t part = newline != NULL ? (size_t) (newline - (buffer + start)) : (size_t) (n - start);
+        if (conn->partial_len + part >= LINE_BUFFER_SIZE) {
+            fprintf(stderr, "error: line longer than %d bytes\n", LINE_BUFFER_SIZE);
+            conn->partial_len = 0;
+        } else {
+            memcpy(conn->partial + conn->partial_len, buffer + start, part);
+            conn->partial_len += part;
+        }
+        if (newline == NULL)
+            break;
+        start += part + 1;
+
+        conn->partial[conn->partial_len] = '\0';
+        long sent_us = strtol(conn->partial, NULL, 10);
+        conn->partial_len = 0;
+
+        if (!conn->warm) {
+            conn->warm = true;
+            atomic_fetch_add(&warm_conns, 1);
+        }
+        // Warm up lines are sent as 0
+        if (!measure || sent_us == 0)
+            continue;
+
+        long bucket = (received_us - sent_us) / HISTOGRAM_STEP_US;
+        receiver->lines++;
+        receiver->bytes += (long) part + 1;
+        receiver->histogram[bucket < HISTOGRAM_BUCKETS ? (bucket > 0 ? bucket : 0) : HISTOGRAM_BUCKETS - 1]++;
+    }
+}
+
+// Send lines at the rate until the run is over
+void* run_sender(void *arg) {
+    Sender *sender = (Sender *) arg;
+    char line[LINE_BUFFER_SIZE];
+    long interval_us = 1000000L / rate_per_sender;
+    long next_us = now_us();
+    long end_us = atomic_load(&end_time_us);
+
+    while (next_us < end_us) {
+        long now = now_us();
+        if (now < next_us) {
+            usleep(next_us - now);
+            now = next_us;
+        }
+
+        // The time it was sent, padded to the message size
+        int len = snprintf(line, sizeof(line), "%ld ", now_us());
+        memset(line + len, 'x', message_size - len - 1);
+        line[message_size - 1] = '\n';
+        if (!send_all(sender->fd, line, message_size)) {
+            sender->errors++;
+            break;
+        }
+        sender->sent++;
+        next_us += interval_us;
+    }
+    return NULL;
+}
+
+bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+long percentile(const long *histogram, long count, double fraction) {
+    if (count == 0)
+        return 0;
+    long index = (long) (fraction * (double) count);
+    long seen = 0;
+    for (long b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > index)
+            return b * HISTOGRAM_STEP_US;
+    }
+    return (HISTOGRAM_BUCKETS - 1) * HISTOGRAM_STEP_US;
+}
+
+void print_usage_error_and_quit() {
+    printf("Usage: chatBench <server-port> <receivers> <senders> <duration-seconds> [lines/s per sender] [line size]\n");
+    exit(EXIT_FAILURE);
+}
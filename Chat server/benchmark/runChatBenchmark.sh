@@ -0,0 +1,73 @@
+#!/bin/bash
+# End to end benchmark of the chat server, runs without network access.
+# For every number of reactor threads starts the server with --threads and runs the
+# benchmark client at every number of receivers.
+# Every run prints one line of JSON with its threads, delivered lines/s and latencies.
+#
+# Settings (environment variables):
+#   SHARDS            reactor threads of the server          (default "1 2 4 8")
+#   RECEIVERS         connections that only read             (default "100 1000")
+#   SENDERS           connections that write                 (default 8)
+#   RATE              lines/s of every sender                (default 200)
+#   MESSAGE_SIZE      bytes in every line with its newline   (default 64)
+#   DURATION          seconds per run                        (default 5)
+#   SERVER_OPTIONS    extra options passed to the server     (default none)
+#   SERVER_PORT                                              (default 18090)
+
+set -u
+
+SHARDS=${SHARDS:-"1 2 4 8"}
+RECEIVERS=${RECEIVERS:-"100 1000"}
+SENDERS=${SENDERS:-8}
+RATE=${RATE:-200}
+MESSAGE_SIZE=${MESSAGE_SIZE:-64}
+DURATION=${DURATION:-5}
+SERVER_OPTIONS=${SERVER_OPTIONS:-}
+SERVER_PORT=${SERVER_PORT:-18090}
+
+BENCHMARK_DIR=$(cd "$(dirname "$0")" && pwd)
+SERVER_DIR=$(dirname "$BENCHMARK_DIR")
+BUILD_DIR=$(mktemp -d)
+SERVER_PID=""
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$BUILD_DIR"
+}
+trap cleanup EXIT
+
+# Wait until something listens on a local port, without connecting to it
+wait_for_port() {
+    local port_hex
+    port_hex=$(printf ":%04X " "$1")
+    for _ in $(seq 1 100); do
+        grep -q "$port_hex[0-9A-F:]* 0A " /proc/net/tcp && return 0
+        sleep 0.05
+    done
+    echo "error: nothing listens on port $1" >&2
+    return 1
+}
+
+# Build everything with the same flags
+CFLAGS="-O2 -Wall -pthread"
+gcc $CFLAGS -o "$BUILD_DIR/chatServer" "$SERVER_DIR/chatServer.c" "$SERVER_DIR/transform.c" || exit 1
+gcc $CFLAGS -o "$BUILD_DIR/chatBench" "$BENCHMARK_DIR/chatBench.c" || exit 1
+
+for shards in $SHARDS; do
+    # The server serves until it is killed, its log of every read and of the
+    # connections reset when the client exits is not needed
+    # shellcheck disable=SC2086
+    "$BUILD_DIR/chatServer" "$SERVER_PORT" --threads="$shards" $SERVER_OPTIONS > /dev/null 2>&1 &
+    SERVER_PID=$!
+    wait_for_port "$SERVER_PORT" || exit 1
+
+    for receivers in $RECEIVERS; do
+        "$BUILD_DIR/chatBench" "$SERVER_PORT" "$receivers" "$SENDERS" "$DURATION" "$RATE" "$MESSAGE_SIZE" \
+            | sed "s/^{/{\"threads\": $shards, /"
+    done
+
+    kill -INT "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=""
+done
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "../transform.h"
+
+// Microbenchmark of the transform kernels of the chat server against the old read path,
+// a toupper loop and then memchr for the newlines. Every kernel is checked against the
+// old path first, on chunks of every length with all byte values.
+// Build: gcc -O2 -Wall -o transformBench benchmark/transformBench.c transform.c
+// Every kernel prints one line of JSON with its ns per chunk and GB/s.
+
+#define MAX_CHUNK 4096
+#define CHECK_ROUNDS 20
+#define DEFAULT_MIN_TIME_MS 200
+
+// Something the compiler can't optimize away
+static volatile long sink;
+
+void print_usage_error_and_quit();
+int reference_upper(char *data, int len, int *newlines);
+int reference_none(char *data, int len, int *newlines);
+void fill_chunk(char *data, int len, int line_len);
+int check_kernel(const char *name, transform_fn kernel, transform_fn reference);
+double time_kernel(transform_fn kernel, const char *chunk, int len, long min_time_ns);
+long now_ns();
+
+int main(int argc, char *argv[]) {
+    if (argc > 3)
+        print_usage_error_and_quit();
+
+    char *endptr;
+    int chunk_len = MAX_CHUNK;
+    if (argc > 1) {
+        chunk_len = (int) strtol(argv[1], &endptr, 10);
+        if (*endptr != '\0' || chunk_len <= 0 || chunk_len > MAX_CHUNK)
+            print_usage_error_and_quit();
+    }
+    long min_time_ns = DEFAULT_MIN_TIME_MS * 1000000L;
+    if (argc > 2) {
+        min_time_ns = strtol(argv[2], &endptr, 10) * 1000000L;
+        if (*endptr != '\0' || min_time_ns <= 0)
+            print_usage_error_and_quit();
+    }
+
+    static const char *names[] = { "upper", "none" };
+    static const transform_fn references[] = { reference_upper, reference_none };
+    static const char *instructions[] = { "scalar", "sse2", "avx2" };
+
+    // Chat lines of about 60 bytes
+    char chunk[MAX_CHUNK];
+    srand(1);
+    fill_chunk(chunk, chunk_len, 60);
+
+    int failed = 0;
+    for (size_t t = 0; t < sizeof(names) / sizeof(names[0]); t++) {
+        double ns = time_kernel(references[t], chunk, chunk_len, min_time_ns);
+        printf("{\"transform\": \"%s\", \"kernel\": \"reference\", \"chunk\": %d, \"ns_per_chunk\": %.1f, \"gb_s\": %.2f}\n",
+               names[t], chunk_len, ns, chunk_len / ns);
+
+        for (size_t i = 0; i < sizeof(instructions) / sizeof(instructions[0]); i++) {
+            transform_fn kernel = findTransform(names[t], instructions[i]);
+            if (kernel == NULL)
+                continue;
+            if (check_kernel(names[t], kernel, references[t]) != 0) {
+                fprintf(stderr, "error: the %s kernel of %s differs from the reference\n", instructions[i], names[t]);
+                failed = 1;
+                continue;
+            }
+            ns = time_kernel(kernel, chunk, chunk_len, min_time_ns);
+            printf("{\"transform\": \"%s\", \"kernel\": \"%s\", \"chunk\": %d, \"ns_per_chunk\": %.1f, \"gb_s\": %.2f}\n",
+                   names[t], instructions[i], chunk_len, ns, chunk_len / ns);
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// The read path before the kernels, two passes over the bytes
+int reference_upper(char *data, int len, int *newlines) {
+    for (int i = 0; i < len; i++)
+        data[i] = (char) toupper((unsigned char) data[i]);
+    return reference_none(data, len, newlines);
+}
+
+int reference_none(char *data, int len, int *newlines) {
+    int count = 0;
+    char *newline = memchr(data, '\n', len);
+    while (newline != NULL) {
+        newlines[count++] = (int) (newline - data);
+        newline = memchr(newline + 1, '\n', len - (newline + 1 - data));
+    }
+    return count;
+}
+
+// Random bytes of every value, with a newline after about line_len of them
+void fill_chunk(char *data, int len, int line_len) {
+    for (int i = 0; i < len; i++)
+        data[i] = rand() % line_len == 0 ? '\n' : (char) (rand() % 256);
+}
+
+// Compare a kernel with the reference on every length, and on every offset of the buffer
+int check_kernel(const char *name, transform_fn kernel, transform_fn reference) {
+    (void) name;
+    char original[MAX_CHUNK + 64], expected[MAX_CHUNK + 64], actual[MAX_CHUNK + 64];
+    int expected_newlines[MAX_CHUNK], actual_newlines[MAX_CHUNK];
+
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        fill_chunk(original, sizeof(original), round % 2 ? 3 : 40);
+        for (int len = 0; len <= MAX_CHUNK; len += len < 100 ? 1 : 37) {
+            int offset = round % 32;
+            memcpy(expected, original, sizeof(original));
+            memcpy(actual, original, sizeof(original));
+            int expected_count = reference(expected + offset, len, expected_newlines);
+            int actual_count = kernel(actual + offset, len, actual_newlines);
+            if (expected_count != actual_count || memcmp(expected, actual, sizeof(actual)) != 0 ||
+                memcmp(expected_newlines, actual_newlines, expected_count * sizeof(int)) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Average ns of a kernel on a fresh copy of the chunk, the copy is timed too
+double time_kernel(transform_fn kernel, const char *chunk, int len, long min_time_ns) {
+    char data[MAX_CHUNK];
+    int newlines[MAX_CHUNK];
+    long iterations = 0;
+    long start = now_ns();
+    long elapsed;
+    do {
+        for (int i = 0; i < 1000; i++) {
+            memcpy(data, chunk, len);
+            sink += kernel(data, len, newlines);
+        }
+        iterations += 1000;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+    return (double) elapsed / (double) iterations;
+}
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void print_usage_error_and_quit() {
+    printf("Usage: transformBench [chunk-bytes] [min-time-ms]\n");
+    exit(EXIT_FAILURE);
+}
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
 #include <malloc.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "chatServer.h"
 #include <stdlib.h>
 #include <netinet/in.h>
@@ -10,33 +15,104 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
-#define connection_queue_size 32 // chosen arbitrary queue size
+#define connection_queue_size SOMAXCONN // a burst of connecting clients waits in the backlog
 
-static int end_server = 0;
+static atomic_int end_server = 0;
 
-static int server_socket = 3;
+static volatile sig_atomic_t report_queues = 0;
+
+// Incremented for every SIGUSR1, every shard prints its queues when it sees a new one
+static atomic_uint report_generation = 0;
+
+// Reactor threads, every one with its own pool
+static int num_shards = 1;
 
 void intHandler();
 
+void usr1Handler();
+
+int parseOptions(int argc, char *argv[], conn_pool_t* pool);
+
+int initShard(int shard, conn_pool_t** shards, int port);
+
+int openListeningSocket(int port);
+
+void* runShard(void* arg);
+
+void freePool(conn_pool_t* pool);
+
+int fanOut(int sd, room_t* room, char* buffer, int len, payload_t* payload, conn_pool_t* pool);
+
+payload_t* publishMsg(room_t* room, char* buffer, int len, conn_pool_t* pool);
+
+void drainInbox(conn_pool_t* pool);
+
+void releasePayload(payload_t* payload);
+
+void wakeShard(conn_pool_t* shard);
+
+void freeSharedMsg(shared_msg_t* shared, conn_pool_t* pool);
+
+int handleCommand(conn_t* conn, char* line, int len, char* pending, int pending_len, conn_pool_t* pool);
+
+room_t* findRoom(const char* name, int len, bool create, conn_pool_t* pool);
+
+int joinRoom(conn_t* conn, room_t* room);
+
+void leaveRoom(conn_t* conn, conn_pool_t* pool);
+
+void freeRoom(room_t* room, conn_pool_t* pool);
+
+int allocHistory(room_t* room, conn_pool_t* pool);
+
+void addToHistory(room_t* room, shared_msg_t* shared, conn_pool_t* pool);
+
+void dropHistory(room_t* room, conn_pool_t* pool);
+
+void clearHistory(room_t* room, conn_pool_t* pool);
+
+void replayHistory(conn_t* conn, room_t* room, conn_pool_t* pool);
+
+void trimHistory(size_t needed, conn_pool_t* pool);
+
+unsigned int hashRoom(const char* name, int len);
+
 int is_number(const char *s);
 
 void printUsageError();
 
-int addMsgToConn(int sd, char* buffer, int len, conn_pool_t* pool);
+int addMsgToConn(int sd, shared_msg_t* shared, conn_pool_t* pool);
 
-char* popMsg(int sd, conn_pool_t* pool);
+int popMsg(int sd, conn_pool_t* pool);
 
 int freeMessagesInConnection(int sd, conn_pool_t* pool);
 
+void releaseMsg(msg_t* msg, conn_pool_t* pool);
+
+void unlinkMsg(conn_t* conn, msg_t* msg, conn_pool_t* pool);
+
+bool makeRoom(conn_t* conn, int len, conn_pool_t* pool);
+
+bool enforceMemoryLimit(int sd, size_t needed, conn_pool_t* pool);
+
+void printQueues(conn_pool_t* pool);
+
 int freeConn(int sd, conn_pool_t* pool);
 
-void convertToUpper(char *str);
+conn_t* findConn(int sd, conn_pool_t* pool);
+
+int growTables(int sd, conn_pool_t* pool);
+
+void acceptConnections(conn_pool_t* pool);
+
+int watchWrite(conn_t* conn, bool watch, conn_pool_t* pool);
 
 int main (int argc, char *argv[])
 {
     // Get Argument
-    if (argc != 2)
+    if (argc < 2)
         printUsageError();
 
     // Check if the argument is a number
@@ -61,11 +137,130 @@ int main (int argc, char *argv[])
     // Mask SIGINT signal
     signal(SIGINT, intHandler);
 
-    // Allocate memory for pool metadata
-    conn_pool_t* pool = malloc(sizeof(conn_pool_t));
-    memset(pool, 0, sizeof(conn_pool_t));
-    initPool(pool);
+    // SIGUSR1 prints the queues of the connections
+    signal(SIGUSR1, usr1Handler);
+
+    // Mask SIGPIPE, a client that went away fails the write instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every client is a descriptor, allow as many as the hard limit
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    /*************************************************************/
+    /* Allocate a pool for every shard, the options set the     */
+    /* number of shards and the limits of every pool             */
+    /*************************************************************/
+    conn_pool_t* shards[MAX_SHARDS];
+    // num_shards is set by --threads while the options of the first pool are parsed
+    for (int i = 0; i < num_shards; i++) {
+        // Allocate memory for pool metadata
+        conn_pool_t* pool = malloc(sizeof(conn_pool_t));
+        if (pool == NULL) {
+            perror("error: malloc\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(pool, 0, sizeof(conn_pool_t));
+        if (initPool(pool) < 0)
+            exit(EXIT_FAILURE);
+        if (parseOptions(argc, argv, pool) < 0)
+            printUsageError();
+        shards[i] = pool;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        if (initShard(i, shards, port) < 0)
+            exit(EXIT_FAILURE);
+    }
 
+    /*************************************************************/
+    /* Start the other shards, the signals are handled by the    */
+    /* first one that runs in this thread                        */
+    /*************************************************************/
+    sigset_t signals, old_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&shards[i]->thread, NULL, runShard, shards[i]) != 0) {
+            perror("error: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    runShard(shards[0]);
+
+    /*************************************************************/
+    /* If we are here, Control-C was typed, stop the other       */
+    /* shards and clean up all open connections                  */
+    /*************************************************************/
+    for (int i = 1; i < num_shards; i++) {
+        wakeShard(shards[i]);
+        pthread_join(shards[i]->thread, NULL);
+    }
+    for (int i = 0; i < num_shards; i++)
+        freePool(shards[i]);
+
+    return EXIT_SUCCESS;
+}
+
+// Open the listening socket, the eventfd and the receive buffer of a shard and watch them
+int initShard(int shard, conn_pool_t** shards, int port) {
+    conn_pool_t* pool = shards[shard];
+    pool->shard = shard;
+    pool->nr_shards = num_shards;
+    pool->shards = shards;
+
+    // The memory limit is shared by the shards
+    pool->memory_limit /= num_shards;
+
+    // One receive buffer for all connections, a partial line of the last read is copied before the new bytes
+    pool->read_buffer = malloc(pool->max_line + BUFFER_SIZE);
+    pool->newlines = malloc(BUFFER_SIZE * sizeof(int));
+    if (pool->read_buffer == NULL || pool->newlines == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+
+    // The other rooms get their history when they are created
+    if (allocHistory(pool->lobby, pool) < 0)
+        return -1;
+
+    pool->listen_fd = openListeningSocket(port);
+    if (pool->listen_fd < 0)
+        return -1;
+
+    // The other shards and the signals wake the shard through the eventfd
+    pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->wake_fd < 0) {
+        perror("error: eventfd\n");
+        return -1;
+    }
+
+    /*************************************************************/
+    /* Watch the listening socket and the eventfd                */
+    /*************************************************************/
+
+    // The listening socket is level triggered, every wakeup accepts until the backlog is empty
+    int watched[] = { pool->listen_fd, pool->wake_fd };
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = watched[i];
+        if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, watched[i], &event) < 0) {
+            perror("error: epoll_ctl\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int openListeningSocket(int port) {
     /*************************************************************/
     /* Create an AF_INET stream socket to receive incoming      */
     /* connections on                                            */
@@ -73,10 +268,10 @@ int main (int argc, char *argv[])
     struct sockaddr_in server_address;
 
     // Create a socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         perror("error: socket\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // allow reusing the address
@@ -84,19 +279,26 @@ int main (int argc, char *argv[])
     if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
         perror("error: setsockopt\n");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    // Every shard listens on the port, the kernel spreads the new connections between them
+    if (num_shards > 1 && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("error: setsockopt\n");
+        close(server_socket);
+        return -1;
     }
 
     // Initialize server_address struct
+    memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
     server_address.sin_port = htons(port);
 
 
     /*************************************************************/
-    /* Set socket to be nonblocking. All of the sockets for      */
-    /* the incoming connections will also be nonblocking since   */
-    /* they will inherit that state from the listening socket.   */
+    /* Set socket to be nonblocking. The sockets of the incoming */
+    /* connections are made nonblocking by accept4.              */
     /*************************************************************/
 
     // Set socket to be non-blocking
@@ -104,7 +306,7 @@ int main (int argc, char *argv[])
     if (ioctl(server_socket, FIONBIO, &enable) < 0) {
         perror("error: ioctl\n");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     /*************************************************************/
@@ -115,28 +317,24 @@ int main (int argc, char *argv[])
     if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
         perror("error: bind\n");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     /*************************************************************/
     /* Set the listen back log                                   */
     /*************************************************************/
     // Listen for incoming connections
-    if (listen(server_socket, connection_queue_size) < 0) {  // 5 is the maximum length of the queue for pending connections
+    if (listen(server_socket, connection_queue_size) < 0) {
         perror("error: listen\n");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return server_socket;
+}
 
-    /*************************************************************/
-    /* Initialize fd_sets  			                             */
-    /*************************************************************/
-
-    // Add the listening socket to the master_read_set
-    FD_SET(server_socket, &pool->ready_read_set);
-    FD_CLR(0,&pool->ready_read_set); FD_CLR(1,&pool->ready_read_set); FD_CLR(2,&pool->ready_read_set);
-    FD_CLR(0,&pool->ready_write_set); FD_CLR(1,&pool->ready_write_set); FD_CLR(2,&pool->ready_write_set);
-    pool->maxfd = server_socket;
+// The event loop of a shard, until Control-C
+void* runShard(void* arg) {
+    conn_pool_t* pool = (conn_pool_t*)arg;
 
     /*************************************************************/
     /* Loop waiting for incoming connects, for incoming data or  */
@@ -145,171 +343,193 @@ int main (int argc, char *argv[])
     do
     {
         /**********************************************************/
-        /* Copy the master fd_set over to the working fd_set.     */
+        /* Call epoll_wait(), only the ready descriptors return   */
         /**********************************************************/
-        pool->read_set = pool->ready_read_set;
-        pool->write_set = pool->ready_write_set;
-
-        /**********************************************************/
-        /* Call select() 										  */
-        /**********************************************************/
-        printf("Waiting on select()...\nMaxFd %d\n", pool->maxfd);
-        pool->nready = select(pool->maxfd + 1, &pool->read_set, NULL, NULL, NULL);
+        printf("Waiting on epoll_wait()...\nConnections %u\n", pool->nr_conns);
+        pool->nready = epoll_wait(pool->epoll_fd, pool->events, MAX_EVENTS, -1);
+
+        // The first shard takes the signals and passes the report on to the others
+        if (pool->shard == 0 && report_queues) {
+            report_queues = 0;
+            atomic_fetch_add(&report_generation, 1);
+            for (int i = 0; i < pool->nr_shards; i++)
+                wakeShard(pool->shards[i]);
+        }
         if (pool->nready < 0) {
-            perror("error: select\n");
-            /*  Clean memory:
-             * */
-            if (end_server == 1)
-                break;
+            if (errno != EINTR)
+                perror("error: epoll_wait\n");
+            continue;
         }
 
         /**********************************************************/
         /* One or more descriptors are readable or writable.      */
-        /* Need to determine which ones they are.                 */
         /**********************************************************/
 
-        for (int fd = server_socket; fd < pool->maxfd +1 ; fd++)
+        for (int i = 0; i < pool->nready; i++)
         {
-            /* Each time a ready descriptor is found, one less has  */
-            /* to be looked for.  This is being done so that we     */
-            /* can stop looking at the working set once we have     */
-            /* found all of the descriptors that were ready         */
-
-            /*******************************************************/
-            /* Check to see if this descriptor is ready for read   */
-            /*******************************************************/
-            if (FD_ISSET(fd, &pool->read_set))
-            {
-                /****************************************************/
-                /* A descriptor was found that was readable		    */
-                /* if this is the listening socket, accept one      */
-                /* incoming connection that is queued up on the     */
-                /*  listening socket before we loop back and call   */
-                /* select again. 						            */
-                /****************************************************/
-                // If activity on welcome socket, accept new connection
-                if (fd == server_socket) {
-                    printf("New incoming connection on sd %d\n", fd);
-                    // Accept the connection
-                    int addrlen = sizeof(server_address);
-                    int new_socket = accept(server_socket, (struct sockaddr *)&server_address, (socklen_t*)&addrlen);
-                    bool succesfullAccept = true;
-                    if (new_socket < 0) {
-                        perror("error: accept\n");
-                        succesfullAccept = false;
-                    }
-
-                    // do nothing and continue if accept was unsuccessful
-                    if (succesfullAccept) {
-
-                        if (addConn(new_socket, pool) > -1) {
-                            // Set the bit map
-                            FD_SET(new_socket, &pool->ready_read_set);
-                            FD_SET(new_socket, &pool->ready_write_set);
-                        }
-                    }
+            int fd = pool->events[i].data.fd;
+            uint32_t events = pool->events[i].events;
+
+            /****************************************************/
+            /* If this is the listening socket, accept every    */
+            /* connection that is queued up on it               */
+            /****************************************************/
+            if (fd == pool->listen_fd) {
+                acceptConnections(pool);
+                continue;
+            }
 
+            /****************************************************/
+            /* Broadcasts of the other shards, a report or the  */
+            /* end of the server                                */
+            /****************************************************/
+            if (fd == pool->wake_fd) {
+                uint64_t wakeups;
+                if (read(pool->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                    perror("error: read\n");
+                drainInbox(pool);
+                unsigned int generation = atomic_load(&report_generation);
+                if (generation != pool->report_seen) {
+                    pool->report_seen = generation;
+                    printQueues(pool);
                 }
-                /****************************************************/
-                /* If this is not the listening socket, an 			*/
-                /* existing connection must be readable				*/
-                /* Receive incoming data his socket                 */
-                /****************************************************/
-
-                else if (FD_ISSET(fd,&pool->read_set)){
-                    char buffer[BUFFER_SIZE];
-                    memset(buffer, 0, BUFFER_SIZE);
-                    long bytes_read = read(fd, buffer, sizeof(buffer));
-                    printf("Descriptor %d is readable\n", fd);
-                    if (bytes_read <= 0) {
-                        // Client disconnected or error occurred, remove the connection
-                        removeConn(fd, pool);
-                        if (bytes_read == 0)
-                            printf("Connection closed for sd %d\n",fd);
-                    }
-                    else
-                    {
-                        // Null-terminate the received data
-                        buffer[bytes_read] = '\0';
-                        // Handle the received data (e.g., broadcast it to other clients)
-                        printf("%d bytes received from sd %d\n", (int)bytes_read, fd);
-
-                        /**********************************************/
-                        /* Data was received, add msg to all other    */
-                        /* connections					  			  */
-                        /**********************************************/
-
-                        convertToUpper(buffer);
-
-                        addMsg(fd, buffer, (int)strlen(buffer),  pool);
-                        // ==============================================================
-                    }
-                }
+                continue;
+            }
 
+            // The connection was closed by an earlier event of this batch
+            if (findConn(fd, pool) == NULL)
+                continue;
 
-            } /* End of if (FD_ISSET()) */
+            /*******************************************************/
+            /* An existing connection is readable, or hung up      */
+            /*******************************************************/
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                /**********************************************/
+                /* Complete lines are added to all other      */
+                /* connections, a partial line waits for the  */
+                /* rest of it                                 */
+                /**********************************************/
+                if (readFromClient(fd, pool) < 0) {
+                    // Client disconnected or error occurred, remove the connection
+                    removeConn(fd, pool);
+                    continue;
+                }
+            }
 
             /*******************************************************/
-            /* Check to see if this descriptor is ready for write  */
+            /* Only connections with queued messages wait for      */
+            /* EPOLLOUT                                            */
             /*******************************************************/
-            if (FD_ISSET(fd, &pool->write_set)) {
+            if (events & EPOLLOUT) {
                 /* try to write all msgs in queue to sd */
-                //writeToClient(...);
                 writeToClient(fd,pool);
             }
             /*******************************************************/
 
 
-        } /* End of loop through selectable descriptors */
+        } /* End of loop through ready descriptors */
 
-    } while (end_server == 0);
+    } while (atomic_load(&end_server) == 0);
 
-    /*************************************************************/
-    /* If we are here, Control-C was typed,						 */
-    /* clean up all open connections					         */
-    /*************************************************************/
-    for (int fd = server_socket + 1; fd < pool->maxfd + 1 ; fd++) {
-        if (FD_ISSET(fd, &pool->ready_read_set)) {
-            freeConn(fd, pool);
-        }
+    // The first shard stops the others
+    if (pool->shard == 0) {
+        for (int i = 1; i < pool->nr_shards; i++)
+            wakeShard(pool->shards[i]);
     }
+    return NULL;
+}
 
-    close(server_socket);
+// Close the connections and sockets of a shard and free its pool
+void freePool(conn_pool_t* pool) {
+    while (pool->nr_conns > 0)
+        freeConn(pool->conns[pool->nr_conns - 1]->fd, pool);
+
+    // Broadcasts that were not taken from the inbox
+    inbox_node_t* node = atomic_exchange(&pool->inbox, NULL);
+    while (node != NULL) {
+        inbox_node_t* next_node = node->next;
+        releasePayload(node->payload);
+        node = next_node;
+    }
 
-    free(pool->conn_head);
+    close(pool->epoll_fd);
+    close(pool->listen_fd);
+    close(pool->wake_fd);
+
+    // Rooms are freed with their last member, only the lobby is left
+    clearHistory(pool->lobby, pool);
+    free(pool->lobby->members);
+    free(pool->lobby);
+    free(pool->rooms);
+
+    free(pool->conn_by_fd);
+    free(pool->conns);
+    free(pool->read_buffer);
+    free(pool->newlines);
+    while (pool->free_msgs != NULL) {
+        msg_t* next_msg = pool->free_msgs->next;
+        free(pool->free_msgs);
+        pool->free_msgs = next_msg;
+    }
 
     free(pool);
-
-    return EXIT_SUCCESS;
 }
 
 
 int initPool(conn_pool_t* pool) {
-    // Initialize maxfd
-    pool->maxfd = -1;
-
     // Initialize nready
     pool->nready = 0;
 
-    // Clear the read_set, ready_read_set, write_set, and ready_write_set
-    FD_ZERO(&pool->read_set);
-    FD_ZERO(&pool->ready_read_set);
-    FD_ZERO(&pool->write_set);
-    FD_ZERO(&pool->ready_write_set);
-
-    // Initialize the dummy head of the connection list
-    pool->conn_head = malloc(sizeof(conn_t));
-    if (pool->conn_head == NULL) {
-        perror("error: malloc\n");
+    // Create the epoll instance
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epoll_fd < 0) {
+        perror("error: epoll_create1\n");
         return -1;
     }
-    pool->conn_head->prev = pool->conn_head->next = pool->conn_head;
-    pool->conn_head->fd = -1;
-    pool->conn_head->write_msg_head = pool->conn_head->write_msg_tail = NULL;
+
+    // The tables grow when the first connections are added
+    pool->conn_by_fd = NULL;
+    pool->conn_by_fd_size = 0;
+    pool->conns = NULL;
+    pool->conns_size = 0;
 
     // Initialize nr_conns
     pool->nr_conns = 0;
 
+    // No message objects to reuse yet
+    pool->free_msgs = NULL;
+    pool->nr_free_msgs = 0;
+
+    // Limits of the queues, the options may change them
+    pool->queue_limit = DEFAULT_QUEUE_LIMIT;
+    pool->memory_limit = DEFAULT_MEMORY_LIMIT;
+    pool->overflow = OVERFLOW_DISCONNECT;
+    pool->memory_bytes = 0;
+    pool->dropped_msgs = 0;
+    pool->slow_disconnects = 0;
+
+    // Every connection starts in the lobby, the other rooms are created when they are joined
+    pool->rooms = calloc(ROOM_TABLE_SIZE, sizeof(room_t*));
+    pool->lobby = calloc(1, sizeof(room_t));
+    if (pool->rooms == NULL || pool->lobby == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+    pool->nr_rooms = 0;
+    pool->fanout_room = NULL;
+
+    // No history unless the options ask for it
+    pool->history_msgs = 0;
+    pool->history_bytes_limit = DEFAULT_HISTORY_BYTES;
+
+    // Lines are limited to one buffer by default
+    pool->max_line = BUFFER_SIZE;
+    pool->read_buffer = NULL;
+    pool->newlines = NULL;
+
+    // Received text is upper cased by default, with the widest instructions of the CPU
+    pool->transform = findTransform("upper", NULL);
+
     return 0;
 }
 
@@ -320,6 +540,10 @@ int addConn(int sd, conn_pool_t* pool) {
      * 2. add connection to pool
      * */
 
+    // Make room in the tables, they double so adding connections is O(1) on average
+    if (growTables(sd, pool) < 0)
+        return -1;
+
     // Allocate memory for the new connection
     conn_t* new_conn = (conn_t*)malloc(sizeof(conn_t));
     if (new_conn == NULL) {
@@ -331,20 +555,41 @@ int addConn(int sd, conn_pool_t* pool) {
     new_conn->fd = sd;
     new_conn->write_msg_head = NULL;
     new_conn->write_msg_tail = NULL;
+    new_conn->watch_write = false;
+    new_conn->queued_bytes = 0;
+    new_conn->queued_msgs = 0;
+    new_conn->partial = NULL;
+    new_conn->partial_len = 0;
+    new_conn->room = NULL;
+
+    // Watch the connection for reading, writing is watched only when messages are queued
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = sd;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, sd, &event) < 0) {
+        perror("error: epoll_ctl\n");
+        free(new_conn);
+        return -1;
+    }
 
-    // Add the new connection to the connection pool's linked list
-    new_conn->prev = pool->conn_head->prev;
-    new_conn->next = pool->conn_head;
-    pool->conn_head->prev->next = new_conn;
-    pool->conn_head->prev = new_conn;
+    // New connections talk in the lobby
+    if (joinRoom(new_conn, pool->lobby) < 0) {
+        free(new_conn);
+        return -1;
+    }
 
-    // Update the maximum file descriptor if needed
-    if (sd > pool->maxfd)
-        pool->maxfd = sd;
+    // Add the new connection to the end of the active connections and index it by its fd
+    new_conn->index = pool->nr_conns;
+    pool->conns[pool->nr_conns] = new_conn;
+    pool->conn_by_fd[sd] = new_conn;
 
     // Increment the number of active client connections
     pool->nr_conns++;
 
+    // What was said in the lobby before the connection came
+    replayHistory(new_conn, pool->lobby, pool);
+
     return 0;
 }
 
@@ -352,257 +597,928 @@ int addConn(int sd, conn_pool_t* pool) {
 int removeConn(int sd, conn_pool_t* pool) {
     /*
     * 1. remove connection from pool
-    * 2. deallocate connection
-    * 3. remove from sets
-    * 4. update max_fd if needed
+    * 2. deallocate connection, closing it removes it from epoll
     */
 
     printf("removing connection with sd %d \n", sd);
 
-    freeConn(sd, pool);
+    return freeConn(sd, pool);
+}
 
-    FD_CLR(sd, &pool->ready_read_set);
-    FD_CLR(sd, &pool->ready_write_set);
+int addMsgToConn(int sd, shared_msg_t* shared, conn_pool_t* pool) {
+    // Find the connection with the given socket descriptor
+    conn_t* current = findConn(sd, pool);
+    if (current == NULL)
+        return -1;
+
+    // Take a message object from the free list, or allocate one
+    msg_t* new_msg = pool->free_msgs;
+    if (new_msg != NULL) {
+        pool->free_msgs = new_msg->next;
+        pool->nr_free_msgs--;
+    } else {
+        new_msg = (msg_t*)malloc(sizeof(msg_t));
+        if (new_msg == NULL) {
+            perror("error: malloc\n");
+            return -1;
+        }
+    }
+
+    // The message object only refers to the shared bytes
+    new_msg->shared = shared;
+    new_msg->offset = 0;
+    shared->refs++;
+    current->queued_bytes += shared->size;
+    current->queued_msgs++;
+    pool->memory_bytes += sizeof(msg_t);
+
+    // Add the new message to the connection's message queue
+    new_msg->prev = current->write_msg_tail;
+    new_msg->next = NULL;
+    if (current->write_msg_tail != NULL) {
+        current->write_msg_tail->next = new_msg;
+    }
+    current->write_msg_tail = new_msg;
+    if (current->write_msg_head == NULL) {
+        current->write_msg_head = new_msg;
+    }
 
     return 0;
 }
 
-int addMsgToConn(int sd, char* buffer, int len, conn_pool_t* pool) {
-    // Traverse the connection pool's linked list to find the connection with the given socket descriptor
-    conn_t* current = pool->conn_head->next;
-    while (current != pool->conn_head) {
-        if (current->fd == sd) {
-            // Found the connection
+int addMsg(int sd,char* buffer,int len,conn_pool_t* pool) {
 
-            // Allocate memory for the new message
-            msg_t* new_msg = (msg_t*)malloc(sizeof(msg_t));
-            if (new_msg == NULL) {
-                perror("error: malloc\n");
-                return -1;
-            }
+    /*
+     * 1. publish the msg to the other shards, they add it to their own members of the room
+     * 2. make room for the msg within the memory limit
+     * 3. store the msg once, shared by all other members of the room
+     * 4. add a reference to it to the write queue of all other members whose queue has room
+     * 5. watch each fd for writing
+     */
 
-            // Copy the message content into the new message
-            new_msg->message = (char*)malloc(len + 1); // +1 for null terminator
-            if (new_msg->message == NULL) {
-                perror("error: malloc\n");
-                free(new_msg);
-                return -1;
-            }
-            strncpy(new_msg->message, buffer, len);
-            new_msg->message[len] = '\0'; // Null-terminate the string
-            new_msg->size = len;
-
-            // Add the new message to the connection's message queue
-            new_msg->prev = current->write_msg_tail;
-            new_msg->next = NULL;
-            if (current->write_msg_tail != NULL) {
-                current->write_msg_tail->next = new_msg;
-            }
-            current->write_msg_tail = new_msg;
-            if (current->write_msg_head == NULL) {
-                current->write_msg_head = new_msg;
-            }
+    conn_t* conn = findConn(sd, pool);
+    room_t* room = conn != NULL ? conn->room : pool->lobby;
 
-            return 0;
-        }
-        current = current->next;
+    payload_t* payload = NULL;
+    if (pool->nr_shards > 1) {
+        payload = publishMsg(room, buffer, len, pool);
+        if (payload == NULL)
+            return -1;
+        buffer = payload->data;
     }
-    return -1;
+
+    return fanOut(sd, room, buffer, len, payload, pool);
 }
 
-int addMsg(int sd,char* buffer,int len,conn_pool_t* pool) {
+// Add a message to the queues of the members of a room on this shard, except sd.
+// The reference of the shard to the payload, if there is one, passes to the queued messages.
+int fanOut(int sd, room_t* room, char* buffer, int len, payload_t* payload, conn_pool_t* pool) {
+    // The policy may close the last members, the room stays until the message is added
+    pool->fanout_room = room;
+
+    // The message and a msg object for every other member
+    size_t needed = sizeof(shared_msg_t) + len + room->nr_members * sizeof(msg_t);
+    if (!enforceMemoryLimit(sd, needed, pool)) {
+        if (payload != NULL)
+            releasePayload(payload);
+        pool->fanout_room = NULL;
+        if (room->nr_members == 0 && room != pool->lobby)
+            freeRoom(room, pool);
+        return -1;
+    }
 
-    /*
-     * 1. add msg_t to write queue of all other connections
-     * 2. set each fd to check if ready to write
-     */
+    // With a payload only the structure is allocated, the bytes stay where they are
+    shared_msg_t* shared = (shared_msg_t*)malloc(sizeof(shared_msg_t) + (payload == NULL ? len : 0));
+    if (shared == NULL) {
+        perror("error: malloc\n");
+        if (payload != NULL)
+            releasePayload(payload);
+        pool->fanout_room = NULL;
+        if (room->nr_members == 0 && room != pool->lobby)
+            freeRoom(room, pool);
+        return -1;
+    }
+    shared->data = payload != NULL ? payload->data : shared->inline_data;
+    if (payload == NULL)
+        memcpy(shared->inline_data, buffer, len);
+    shared->size = len;
+    shared->refs = 0;
+    shared->payload = payload;
+    pool->memory_bytes += sizeof(shared_msg_t) + len;
+
+    // The history of the room holds a reference too
+    addToHistory(room, shared, pool);
+
+    // Iterate over the members, from the last one since the policy may remove the current one
+    int result = 0;
+    for (unsigned int i = room->nr_members; i-- > 0; ) {
+        conn_t* current_conn = room->members[i];
 
-    // Iterate over each connection in the connection pool
-    conn_t* current_conn = pool->conn_head->next;
-    while (current_conn != pool->conn_head) {
         // Check if the connection's socket descriptor is different from the given socket descriptor
         if (current_conn->fd != sd) {
+            // A connection that lags too much gets the overflow policy
+            if (!makeRoom(current_conn, len, pool))
+                continue;
+
             // Add the message to the connection's write queue
-            int result = addMsgToConn(current_conn->fd, buffer, len, pool);
-            if (result != 0) {
+            if (addMsgToConn(current_conn->fd, shared, pool) != 0) {
                 // Error adding message to connection
-                return -1;
+                result = -1;
+                break;
             }
 
-            // Set the file descriptor to check if ready to write
-            FD_SET(current_conn->fd, &pool->ready_write_set);
+            // Watch the connection for writing while it has messages
+            watchWrite(current_conn, true, pool);
+        }
+    }
 
-            // Update the maximum file descriptor if needed
-            if (current_conn->fd > pool->maxfd) {
-                pool->maxfd = current_conn->fd;
-            }
+    // Nobody else is in the room, and the history does not keep it
+    if (shared->refs == 0)
+        freeSharedMsg(shared, pool);
+
+    pool->fanout_room = NULL;
+    if (room->nr_members == 0 && room != pool->lobby)
+        freeRoom(room, pool);
+
+    return result;
+}
+
+// Copy a message into a payload and push it to the inboxes of the other shards.
+// The payload has a reference for every shard, the caller has the one of its own shard.
+payload_t* publishMsg(room_t* room, char* buffer, int len, conn_pool_t* pool) {
+    payload_t* payload = (payload_t*)malloc(sizeof(payload_t) + pool->nr_shards * sizeof(inbox_node_t) + len);
+    if (payload == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    memcpy(payload->room, room->name, room->name_len);
+    payload->room_len = room->name_len;
+    payload->size = len;
+    payload->data = (char*)&payload->nodes[pool->nr_shards];
+    memcpy(payload->data, buffer, len);
+    atomic_init(&payload->refs, pool->nr_shards);
+
+    for (int i = 0; i < pool->nr_shards; i++) {
+        conn_pool_t* shard = pool->shards[i];
+        if (shard == pool)
+            continue;
+
+        // Push on the stack of the shard, it is only woken when the stack was empty
+        inbox_node_t* node = &payload->nodes[i];
+        node->payload = payload;
+        // Once the node is pushed the shard may take it, so only the head seen by the push is used after it
+        inbox_node_t* expected = atomic_load_explicit(&shard->inbox, memory_order_relaxed);
+        do {
+            node->next = expected;
+        } while (!atomic_compare_exchange_weak_explicit(&shard->inbox, &expected, node,
+                                                        memory_order_release, memory_order_relaxed));
+        if (expected == NULL)
+            wakeShard(shard);
+    }
+    return payload;
+}
+
+// Fan out the broadcasts that the other shards pushed, in the order they were pushed
+void drainInbox(conn_pool_t* pool) {
+    inbox_node_t* node = atomic_exchange_explicit(&pool->inbox, NULL, memory_order_acquire);
+
+    // The stack has the newest first
+    inbox_node_t* oldest = NULL;
+    while (node != NULL) {
+        inbox_node_t* next_node = node->next;
+        node->next = oldest;
+        oldest = node;
+        node = next_node;
+    }
+
+    while (oldest != NULL) {
+        // The node is part of the payload, it can't be used after its reference is passed on
+        inbox_node_t* next_node = oldest->next;
+        payload_t* payload = oldest->payload;
+
+        // Only a room with members on this shard gets the message
+        room_t* room = findRoom(payload->room, payload->room_len, false, pool);
+        if (room != NULL)
+            fanOut(-1, room, payload->data, payload->size, payload, pool);
+        else
+            releasePayload(payload);
+        oldest = next_node;
+    }
+}
+
+// Drop the reference of a shard to a payload, the last one frees it
+void releasePayload(payload_t* payload) {
+    if (atomic_fetch_sub_explicit(&payload->refs, 1, memory_order_acq_rel) == 1)
+        free(payload);
+}
+
+// Wake a shard from epoll_wait
+void wakeShard(conn_pool_t* shard) {
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("error: write\n");
+}
+
+int readFromClient(int sd, conn_pool_t* pool) {
+
+    /*
+     * 1. read after the partial line left by the last read
+     * 2. find the complete lines, every one must fit in max_line
+     * 3. add all of them to the other members of the room as one msg, a command
+     *    line sends the lines before it and changes the room
+     * 4. keep the partial line at the end for the next read */
+
+    conn_t* conn = findConn(sd, pool);
+    if (conn == NULL)
+        return -1;
+
+    // The receive buffer is not cleared, only the bytes that were read are used
+    char* buffer = pool->read_buffer;
+    int len = conn->partial_len;
+    if (len > 0)
+        memcpy(buffer, conn->partial, len);
+
+    ssize_t bytes_read = read(sd, buffer + len, BUFFER_SIZE);
+    printf("Descriptor %d is readable\n", sd);
+    if (bytes_read < 0) {
+        // Nothing to read after all
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("error: read\n");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed for sd %d\n", sd);
+        return -1;
+    }
+    printf("%d bytes received from sd %d\n", (int)bytes_read, sd);
+
+    // Transform the new bytes and find their newlines in one pass, the partial line has no newline
+    int nr_newlines = pool->transform(buffer + len, (int)bytes_read, pool->newlines);
+
+    int total = len + (int)bytes_read;
+    int line_start = 0;
+    int msg_start = 0;
+    for (int i = 0; i < nr_newlines; i++) {
+        int line_end = len + pool->newlines[i] + 1;
+        if (line_end - line_start > pool->max_line) {
+            printf("line of sd %d is longer than %d bytes\n", sd, pool->max_line);
+            return -1;
         }
-        current_conn = current_conn->next;
+
+        // A command is not sent, the lines before it go to the room it leaves
+        if (buffer[line_start] == '/') {
+            int command = handleCommand(conn, buffer + line_start, line_end - line_start,
+                                        buffer + msg_start, line_start - msg_start, pool);
+            if (command < 0)
+                return -1;
+            if (command > 0)
+                msg_start = line_end;
+        }
+        line_start = line_end;
     }
 
+    // Keep the start of the next line
+    int rest = total - line_start;
+    if (rest >= pool->max_line) {
+        printf("line of sd %d is longer than %d bytes\n", sd, pool->max_line);
+        return -1;
+    }
+    if (rest > 0 && conn->partial == NULL) {
+        conn->partial = malloc(pool->max_line);
+        if (conn->partial == NULL) {
+            perror("error: malloc\n");
+            return -1;
+        }
+    }
+    if (rest > 0)
+        memcpy(conn->partial, buffer + line_start, rest);
+    conn->partial_len = rest;
+
+    // The lines of one read go out together
+    if (line_start > msg_start)
+        addMsg(sd, buffer + msg_start, line_start - msg_start, pool);
     return 0;
 }
 
+// Run a /JOIN <room> or /LEAVE line in any case, the line ends with its newline.
+// The pending lines read before it are sent to the current room first.
+// Returns 0 if it is not a command, the line is then sent like any other, 1 if it
+// was run and -1 if the connection is in no room and must be closed.
+int handleCommand(conn_t* conn, char* line, int len, char* pending, int pending_len, conn_pool_t* pool) {
+    // Without the newline, and the carriage return of telnet
+    len--;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    bool leave = len >= 6 && strncasecmp(line, "/LEAVE", 6) == 0 && (len == 6 || line[6] == ' ');
+    bool join = len >= 5 && strncasecmp(line, "/JOIN", 5) == 0 && (len == 5 || line[5] == ' ');
+    if (!leave && !join)
+        return 0;
+
+    // The lines before the command are sent even when the command fails
+    if (pending_len > 0)
+        addMsg(conn->fd, pending, pending_len, pool);
+
+    room_t* room = pool->lobby;
+    if (join) {
+        // The name is the first word after the command
+        int name_start = 5;
+        while (name_start < len && line[name_start] == ' ')
+            name_start++;
+        int name_end = name_start;
+        while (name_end < len && line[name_end] != ' ')
+            name_end++;
+        int name_len = name_end - name_start;
+        if (name_len == 0 || name_len > MAX_ROOM_NAME) {
+            printf("sd %d: room name must have 1 to %d characters\n", conn->fd, MAX_ROOM_NAME);
+            return 1;
+        }
+        room = findRoom(line + name_start, name_len, true, pool);
+        if (room == NULL)
+            return 1;
+    }
+
+    if (room == conn->room)
+        return 1;
+    leaveRoom(conn, pool);
+    if (joinRoom(conn, room) < 0) {
+        // Back to the lobby, a connection that can't be in any room is closed
+        if (room->nr_members == 0 && room != pool->lobby)
+            freeRoom(room, pool);
+        if (joinRoom(conn, pool->lobby) < 0)
+            return -1;
+    }
+    replayHistory(conn, conn->room, pool);
+    if (conn->room == pool->lobby)
+        printf("sd %d is in the lobby\n", conn->fd);
+    else
+        printf("sd %d is in room %.*s\n", conn->fd, conn->room->name_len, conn->room->name);
+    return 1;
+}
+
+// The room of a name in any case, creating it if asked, the empty name is the lobby
+room_t* findRoom(const char* name, int len, bool create, conn_pool_t* pool) {
+    if (len == 0)
+        return pool->lobby;
+
+    unsigned int hash = hashRoom(name, len);
+    room_t** bucket = &pool->rooms[hash & (ROOM_TABLE_SIZE - 1)];
+    for (room_t* room = *bucket; room != NULL; room = room->next) {
+        if (room->hash == hash && room->name_len == len && strncasecmp(room->name, name, len) == 0)
+            return room;
+    }
+    if (!create)
+        return NULL;
+
+    room_t* room = calloc(1, sizeof(room_t));
+    if (room == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    if (allocHistory(room, pool) < 0) {
+        free(room);
+        return NULL;
+    }
+    memcpy(room->name, name, len);
+    room->name_len = len;
+    room->hash = hash;
+    room->next = *bucket;
+    *bucket = room;
+    pool->nr_rooms++;
+    return room;
+}
+
+// Add a connection to the members of a room, the array doubles when it is full
+int joinRoom(conn_t* conn, room_t* room) {
+    if (room->nr_members == room->members_size) {
+        unsigned int new_size = room->members_size > 0 ? room->members_size * 2 : 8;
+        conn_t** members = realloc(room->members, new_size * sizeof(conn_t*));
+        if (members == NULL) {
+            perror("error: realloc\n");
+            return -1;
+        }
+        room->members = members;
+        room->members_size = new_size;
+    }
+    conn->room = room;
+    conn->room_index = room->nr_members;
+    room->members[room->nr_members++] = conn;
+    return 0;
+}
+
+// Take a connection out of its room, the last member takes its place and an empty room is freed
+void leaveRoom(conn_t* conn, conn_pool_t* pool) {
+    room_t* room = conn->room;
+    if (room == NULL)
+        return;
+
+    conn_t* last = room->members[room->nr_members - 1];
+    room->members[conn->room_index] = last;
+    last->room_index = conn->room_index;
+    room->nr_members--;
+    conn->room = NULL;
+
+    if (room->nr_members == 0 && room != pool->lobby && room != pool->fanout_room)
+        freeRoom(room, pool);
+}
+
+// Remove an empty room from the table and free it
+void freeRoom(room_t* room, conn_pool_t* pool) {
+    room_t** link = &pool->rooms[room->hash & (ROOM_TABLE_SIZE - 1)];
+    while (*link != room)
+        link = &(*link)->next;
+    *link = room->next;
+    pool->nr_rooms--;
+    clearHistory(room, pool);
+    free(room->members);
+    free(room);
+}
+
+// Allocate the ring of the history of a room, if the history is on
+int allocHistory(room_t* room, conn_pool_t* pool) {
+    if (pool->history_msgs == 0)
+        return 0;
+    room->history = malloc(pool->history_msgs * sizeof(shared_msg_t*));
+    if (room->history == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Keep a message in the history of its room, the oldest messages make way for it.
+// A message longer than the byte limit of the history is not kept.
+void addToHistory(room_t* room, shared_msg_t* shared, conn_pool_t* pool) {
+    if (room->history == NULL)
+        return;
+    if (pool->history_bytes_limit > 0 && (size_t)shared->size > pool->history_bytes_limit)
+        return;
+
+    if (room->history_len == pool->history_msgs)
+        dropHistory(room, pool);
+    room->history[(room->history_start + room->history_len) % pool->history_msgs] = shared;
+    room->history_len++;
+    room->history_bytes += shared->size;
+    shared->refs++;
+
+    // The new message fits alone, so it is never the one dropped
+    while (pool->history_bytes_limit > 0 && room->history_bytes > pool->history_bytes_limit)
+        dropHistory(room, pool);
+}
+
+// Release the oldest message of the history of a room
+void dropHistory(room_t* room, conn_pool_t* pool) {
+    shared_msg_t* oldest = room->history[room->history_start];
+    room->history_start = (room->history_start + 1) % pool->history_msgs;
+    room->history_len--;
+    room->history_bytes -= oldest->size;
+    if (--oldest->refs == 0)
+        freeSharedMsg(oldest, pool);
+}
+
+// Release all the history of a room and its ring
+void clearHistory(room_t* room, conn_pool_t* pool) {
+    while (room->history_len > 0)
+        dropHistory(room, pool);
+    free(room->history);
+    room->history = NULL;
+}
+
+// Queue the history of a room to a connection that joined it, as references to the kept messages.
+// Only the newest messages that fit in the queue limit of the connection and in the memory limit are queued.
+void replayHistory(conn_t* conn, room_t* room, conn_pool_t* pool) {
+    unsigned int first = room->history_len;
+    size_t bytes = conn->queued_bytes;
+    while (first > 0) {
+        shared_msg_t* shared = room->history[(room->history_start + first - 1) % pool->history_msgs];
+        if (pool->queue_limit > 0 && bytes + shared->size > pool->queue_limit)
+            break;
+        bytes += shared->size;
+        first--;
+    }
+    unsigned int count = room->history_len - first;
+    if (count == 0)
+        return;
+
+    // A msg object for every replayed message, the policy may trim this history first
+    if (!enforceMemoryLimit(conn->fd, count * sizeof(msg_t), pool)) {
+        // Only the newest messages that still fit in the memory left
+        size_t left = pool->memory_bytes < pool->memory_limit ? pool->memory_limit - pool->memory_bytes : 0;
+        if (count > left / sizeof(msg_t))
+            count = left / sizeof(msg_t);
+    }
+    if (count > room->history_len)
+        count = room->history_len;
+    first = room->history_len - count;
+
+    for (unsigned int i = first; i < room->history_len; i++) {
+        if (addMsgToConn(conn->fd, room->history[(room->history_start + i) % pool->history_msgs], pool) != 0)
+            break;
+    }
+    if (conn->write_msg_head != NULL)
+        watchWrite(conn, true, pool);
+}
+
+// Drop the oldest messages of the largest histories until a message of needed bytes fits in the
+// memory limit or no room has history left. A message still queued somewhere is freed when it is written.
+void trimHistory(size_t needed, conn_pool_t* pool) {
+    if (pool->history_msgs == 0)
+        return;
+    while (pool->memory_limit > 0 && pool->memory_bytes + needed > pool->memory_limit) {
+        room_t* largest = pool->lobby->history_len > 0 ? pool->lobby : NULL;
+        for (unsigned int i = 0; i < ROOM_TABLE_SIZE; i++) {
+            for (room_t* room = pool->rooms[i]; room != NULL; room = room->next) {
+                if (room->history_len > 0 && (largest == NULL || room->history_bytes > largest->history_bytes))
+                    largest = room;
+            }
+        }
+        if (largest == NULL)
+            return;
+        while (largest->history_len > 0 && pool->memory_bytes + needed > pool->memory_limit)
+            dropHistory(largest, pool);
+    }
+}
+
+unsigned int hashRoom(const char* name, int len) {
+    // FNV-1a of the lower case name, names differing only in case are the same room
+    unsigned int hash = 2166136261U;
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619U;
+    return hash;
+}
+
 int writeToClient(int sd,conn_pool_t* pool) {
 
     /*
-     * 1. write all msgs in queue
-     * 2. deallocate each writen msg
+     * 1. gather up to IOV_MAX queued msgs and write them with one writev, a partly
+     *    written msg continues from its offset
+     * 2. release each writen msg
      * 3. if all msgs were writen successfully, there is nothing else to write to this fd... */
 
     // Find the connection with the given socket descriptor
-    conn_t* current = pool->conn_head->next;
-    while (current != pool->conn_head) {
-        if (current->fd == sd) {
-            // Found the connection
-
-            // Write all messages in the connection's message queue
-            char* message;
-            while ((message = popMsg(sd, pool)) != NULL) {
-                ssize_t bytes_written = write(sd, message, strlen(message));
-                if (bytes_written < 0) {
-                    // Error writing to client socket
-                    perror("error: write\n");
-                    return -1;
-                } else if (bytes_written == 0) {
-                    // Connection closed by client
-                    return -1;
-                }
+    conn_t* current = findConn(sd, pool);
+    if (current == NULL)
+        return -1;
+
+    struct iovec iov[IOV_MAX];
+    while (current->write_msg_head != NULL) {
+        // Gather the queued messages
+        int iovcnt = 0;
+        size_t gathered = 0;
+        for (msg_t* msg = current->write_msg_head; msg != NULL && iovcnt < IOV_MAX; msg = msg->next) {
+            iov[iovcnt].iov_base = msg->shared->data + msg->offset;
+            iov[iovcnt].iov_len = msg->shared->size - msg->offset;
+            gathered += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+
+        ssize_t bytes_written = writev(sd, iov, iovcnt);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // The socket is full, EPOLLOUT says when to continue
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
 
-                // Deallocate the memory associated with the message
-                free(message);
+            // Error writing to client socket
+            perror("error: writev\n");
+            return -1;
+        }
+
+        // Release the messages that were written out, the first one left keeps its offset
+        size_t remaining = (size_t)bytes_written;
+        while (remaining > 0) {
+            msg_t* msg = current->write_msg_head;
+            size_t left = msg->shared->size - msg->offset;
+            if (remaining < left) {
+                msg->offset += (int)remaining;
+                current->queued_bytes -= remaining;
+                break;
             }
+            remaining -= left;
+            popMsg(sd, pool);
+        }
 
-            // All messages were successfully written
+        // A short write means the socket is full
+        if ((size_t)bytes_written < gathered)
             return 0;
-        }
-        current = current->next;
     }
 
-    FD_CLR(sd, &pool->ready_write_set);
+    // All messages were successfully written, stop watching for writing until the next one
+    watchWrite(current, false, pool);
+    return 0;
+}
+
+// Pop first message from the list that matches to socket descriptor sd, and release its reference.
+int popMsg(int sd, conn_pool_t* pool) {
+    // Find the connection with the given socket descriptor
+    conn_t* current = findConn(sd, pool);
+
+    // Check if there are messages in the connection's message queue
+    if (current == NULL || current->write_msg_head == NULL) {
+        // No messages in the queue
+        return -1;
+    }
+
+    unlinkMsg(current, current->write_msg_head, pool);
 
-    // If the socket descriptor was not found, return -1
-    return -1;
+    return 0;
 }
 
-// Pop first message from the list that matches to socket descriptor sd.
-char* popMsg(int sd, conn_pool_t* pool) {
-    // Traverse the connection pool's linked list to find the connection with the given socket descriptor
-    conn_t* current = pool->conn_head->next;
-    while (current != pool->conn_head) {
-        if (current->fd == sd) {
-            // Found the connection
+int freeMessagesInConnection(int sd, conn_pool_t* pool) {
+    // Find the connection with the given socket descriptor
+    conn_t* current = findConn(sd, pool);
+    if (current == NULL)
+        return -1;
+
+    // Release all messages in the connection's message queue
+    msg_t* current_msg = current->write_msg_head;
+    while (current_msg != NULL) {
+        msg_t* next_msg = current_msg->next;
 
-            // Check if there are messages in the connection's message queue
-            if (current->write_msg_head == NULL) {
-                // No messages in the queue
-                return NULL;
-            }
+        releaseMsg(current_msg, pool);
+        current_msg = next_msg;
+    }
 
-            // Retrieve the first message from the connection's message queue
-            msg_t* first_msg = current->write_msg_head;
-            char* message_content = first_msg->message;
-
-            // Adjust the pointers of the message queue
-            current->write_msg_head = first_msg->next;
-            if (current->write_msg_head != NULL) {
-                current->write_msg_head->prev = NULL;
-            } else {
-                // No more messages in the queue, update the tail pointer
-                current->write_msg_tail = NULL;
-            }
+    // Reset the message queue pointers
+    current->write_msg_head = NULL;
+    current->write_msg_tail = NULL;
+    current->queued_bytes = 0;
+    current->queued_msgs = 0;
 
-            // Free the memory associated with the message object
-            free(first_msg);
+    return 0;
+}
 
-            return message_content;
-        }
-        current = current->next;
+// Drop the reference of a message object, the last reference frees the shared message.
+// The object goes back to the free list of the pool.
+void releaseMsg(msg_t* msg, conn_pool_t* pool) {
+    pool->memory_bytes -= sizeof(msg_t);
+    if (--msg->shared->refs == 0)
+        freeSharedMsg(msg->shared, pool);
+
+    if (pool->nr_free_msgs < MAX_FREE_MSGS) {
+        msg->next = pool->free_msgs;
+        pool->free_msgs = msg;
+        pool->nr_free_msgs++;
+    } else {
+        free(msg);
     }
+}
 
-    // If the socket descriptor was not found, return NULL
-    return NULL;
+// Free a shared message that has no references left, and release its payload.
+void freeSharedMsg(shared_msg_t* shared, conn_pool_t* pool) {
+    pool->memory_bytes -= sizeof(shared_msg_t) + shared->size;
+    if (shared->payload != NULL)
+        releasePayload(shared->payload);
+    free(shared);
 }
 
-int freeMessagesInConnection(int sd, conn_pool_t* pool) {
-    // Traverse the connection pool's linked list to find the connection with the given socket descriptor
-    conn_t* current = pool->conn_head->next;
-    while (current != pool->conn_head) {
-        if (current->fd == sd) {
-            // Found the connection
-
-            // Free all messages in the connection's message queue
-            msg_t* current_msg = current->write_msg_head;
-            while (current_msg != NULL) {
-                msg_t* next_msg = current_msg->next;
-
-                free(current_msg->message);
-                free(current_msg);
-                current_msg = next_msg;
+// Take a message out of the queue of a connection, wherever it is, and release it.
+void unlinkMsg(conn_t* conn, msg_t* msg, conn_pool_t* pool) {
+    if (msg->prev != NULL)
+        msg->prev->next = msg->next;
+    else
+        conn->write_msg_head = msg->next;
+    if (msg->next != NULL)
+        msg->next->prev = msg->prev;
+    else
+        conn->write_msg_tail = msg->prev;
+
+    conn->queued_bytes -= msg->shared->size - msg->offset;
+    conn->queued_msgs--;
+    releaseMsg(msg, pool);
+}
+
+// Apply the overflow policy to a connection whose queue can't take len more bytes.
+// Returns true if the message may be queued, false if it was dropped or the connection was closed.
+bool makeRoom(conn_t* conn, int len, conn_pool_t* pool) {
+    if (pool->queue_limit == 0 || conn->queued_bytes + len <= pool->queue_limit)
+        return true;
+
+    switch (pool->overflow) {
+        case OVERFLOW_DISCONNECT:
+            printf("queue of sd %d is full (%zu bytes), disconnecting\n", conn->fd, conn->queued_bytes);
+            pool->slow_disconnects++;
+            removeConn(conn->fd, pool);
+            return false;
+
+        case OVERFLOW_DROP_OLDEST: {
+            // A message that was partly written must be finished, the ones after it can go
+            msg_t* msg = conn->write_msg_head;
+            if (msg != NULL && msg->offset > 0)
+                msg = msg->next;
+            while (msg != NULL && conn->queued_bytes + len > pool->queue_limit) {
+                msg_t* next_msg = msg->next;
+                unlinkMsg(conn, msg, pool);
+                pool->dropped_msgs++;
+                msg = next_msg;
             }
+            if (conn->queued_bytes + len <= pool->queue_limit)
+                return true;
+            // The message alone is longer than the limit
+            pool->dropped_msgs++;
+            return false;
+        }
+
+        case OVERFLOW_DROP_NEWEST:
+        default:
+            pool->dropped_msgs++;
+            return false;
+    }
+}
 
-            // Reset the message queue pointers
-            current->write_msg_head = NULL;
-            current->write_msg_tail = NULL;
+// Keep the memory of the queued messages under the limit before a new message of needed bytes,
+// by dropping the oldest history and then applying the overflow policy to the connections with the longest queues (never to sd).
+// Returns true if the message may be stored.
+bool enforceMemoryLimit(int sd, size_t needed, conn_pool_t* pool) {
+    // The history is kept only while there is memory for it, it goes before any queued message
+    trimHistory(needed, pool);
+
+    while (pool->memory_limit > 0 && pool->memory_bytes + needed > pool->memory_limit) {
+        if (pool->overflow == OVERFLOW_DROP_NEWEST) {
+            pool->dropped_msgs++;
+            return false;
+        }
 
-            return 0;
+        // The connection that lags the most
+        conn_t* longest = NULL;
+        for (unsigned int i = 0; i < pool->nr_conns; i++) {
+            conn_t* conn = pool->conns[i];
+            if (conn->fd != sd && conn->queued_msgs > 0 && (longest == NULL || conn->queued_bytes > longest->queued_bytes))
+                longest = conn;
+        }
+
+        // Nothing queued can make room, the message alone is over the limit
+        if (longest == NULL) {
+            pool->dropped_msgs++;
+            return false;
+        }
+
+        if (pool->overflow == OVERFLOW_DISCONNECT) {
+            printf("memory limit reached, disconnecting sd %d with %zu queued bytes\n", longest->fd, longest->queued_bytes);
+            pool->slow_disconnects++;
+            removeConn(longest->fd, pool);
+            continue;
+        }
+
+        // Drop the oldest messages of the longest queue that were not started
+        msg_t* msg = longest->write_msg_head;
+        if (msg != NULL && msg->offset > 0)
+            msg = msg->next;
+        if (msg == NULL) {
+            pool->dropped_msgs++;
+            return false;
+        }
+        while (msg != NULL && pool->memory_bytes + needed > pool->memory_limit) {
+            msg_t* next_msg = msg->next;
+            unlinkMsg(longest, msg, pool);
+            pool->dropped_msgs++;
+            msg = next_msg;
         }
-        current = current->next;
     }
-    return -1;
+    return true;
+}
+
+// Print the memory of the queues and the connections that lag the most, on SIGUSR1.
+void printQueues(conn_pool_t* pool) {
+    printf("shard %d queues: %u connections in %u rooms and the lobby, %zu bytes of messages (limit %zu), %lu messages dropped, %lu slow connections closed\n",
+           pool->shard, pool->nr_conns, pool->nr_rooms, pool->memory_bytes, pool->memory_limit, pool->dropped_msgs, pool->slow_disconnects);
+
+    // Pick the longest queues, one pass per listed connection keeps it simple for an occasional report
+    conn_t* listed[REPORT_CONNS];
+    int nr_listed = 0;
+    size_t below = (size_t)-1;
+    while (nr_listed < REPORT_CONNS) {
+        conn_t* longest = NULL;
+        for (unsigned int i = 0; i < pool->nr_conns; i++) {
+            conn_t* conn = pool->conns[i];
+            if (conn->queued_bytes > 0 && conn->queued_bytes <= below &&
+                (longest == NULL || conn->queued_bytes > longest->queued_bytes)) {
+                bool seen = false;
+                for (int j = 0; j < nr_listed; j++)
+                    seen = seen || listed[j] == conn;
+                if (!seen)
+                    longest = conn;
+            }
+        }
+        if (longest == NULL)
+            break;
+        listed[nr_listed++] = longest;
+        below = longest->queued_bytes;
+    }
+
+    for (int i = 0; i < nr_listed; i++)
+        printf("  sd %d: %u messages, %zu bytes queued\n", listed[i]->fd, listed[i]->queued_msgs, listed[i]->queued_bytes);
+    fflush(stdout);
 }
 
 
 int freeConn(int sd, conn_pool_t* pool) {
-    // Traverse the connection pool's linked list to find the connection with the given socket descriptor
-    conn_t* current = pool->conn_head->next;
-    while (current != pool->conn_head) {
-        if (current->fd == sd) {
-            // Found the connection to be removed
-
-            // Free the messages in the connection
-            freeMessagesInConnection(sd, pool);
-
-            // Adjust the pointers of neighboring connections
-            current->prev->next = current->next;
-            current->next->prev = current->prev;
-
-            // Update the maximum file descriptor if needed
-            if (sd == pool->maxfd) {
-                // Traverse the connection pool's linked list to find the new maximum file descriptor
-                int new_maxfd = server_socket;
-                conn_t* temp = pool->conn_head->next;
-                while (temp != pool->conn_head) {
-                    if (temp->fd > new_maxfd)
-                        new_maxfd = temp->fd;
-                    temp = temp->next;
-                }
-                pool->maxfd = new_maxfd;
-            }
+    // Find the connection to be removed
+    conn_t* current = findConn(sd, pool);
+    if (current == NULL)
+        return -1;
 
-            // Close socket
-            close(current->fd);
+    // Free the messages in the connection
+    freeMessagesInConnection(sd, pool);
 
-            // Free the memory associated with the connection
-            free(current);
+    // Leave the room, the members that follow must not see it anymore
+    leaveRoom(current, pool);
 
-            // Decrement the number of active client connections
-            pool->nr_conns--;
+    // The last active connection takes the place of the removed one
+    conn_t* last = pool->conns[pool->nr_conns - 1];
+    pool->conns[current->index] = last;
+    last->index = current->index;
+    pool->conn_by_fd[sd] = NULL;
 
-            return 0;
+    // Close socket
+    close(current->fd);
+
+    // Free the partial line
+    free(current->partial);
+
+    // Free the memory associated with the connection
+    free(current);
+
+    // Decrement the number of active client connections
+    pool->nr_conns--;
+
+    return 0;
+}
+
+// The connection of a socket descriptor, NULL if it is not a client connection
+conn_t* findConn(int sd, conn_pool_t* pool) {
+    if (sd < 0 || sd >= pool->conn_by_fd_size)
+        return NULL;
+    return pool->conn_by_fd[sd];
+}
+
+// Make room for one more connection, and in the fd table for sd
+int growTables(int sd, conn_pool_t* pool) {
+    if (sd >= pool->conn_by_fd_size) {
+        int new_size = pool->conn_by_fd_size > 0 ? pool->conn_by_fd_size : 64;
+        while (new_size <= sd)
+            new_size *= 2;
+        conn_t** table = realloc(pool->conn_by_fd, new_size * sizeof(conn_t*));
+        if (table == NULL) {
+            perror("error: realloc\n");
+            return -1;
         }
-        current = current->next;
+        memset(table + pool->conn_by_fd_size, 0, (new_size - pool->conn_by_fd_size) * sizeof(conn_t*));
+        pool->conn_by_fd = table;
+        pool->conn_by_fd_size = new_size;
     }
-    return -1;
+
+    if (pool->nr_conns == pool->conns_size) {
+        unsigned int new_size = pool->conns_size > 0 ? pool->conns_size * 2 : 64;
+        conn_t** conns = realloc(pool->conns, new_size * sizeof(conn_t*));
+        if (conns == NULL) {
+            perror("error: realloc\n");
+            return -1;
+        }
+        pool->conns = conns;
+        pool->conns_size = new_size;
+    }
+    return 0;
 }
 
-void convertToUpper(char *str) {
-    while (*str) {
-        *str = (char)toupper((unsigned char)*str);
-        str++;
+// Accept every connection waiting on the listening socket, until it would block
+void acceptConnections(conn_pool_t* pool) {
+    while (true) {
+        int new_socket = accept4(pool->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("error: accept\n");
+            return;
+        }
+        printf("New incoming connection on sd %d\n", new_socket);
+
+        if (addConn(new_socket, pool) < 0)
+            close(new_socket);
     }
 }
 
+// Add or remove EPOLLOUT for a connection, nothing is done if it is already so
+int watchWrite(conn_t* conn, bool watch, conn_pool_t* pool) {
+    if (conn->watch_write == watch)
+        return 0;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = watch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.fd = conn->fd;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+        perror("error: epoll_ctl\n");
+        return -1;
+    }
+    conn->watch_write = watch;
+    return 0;
+}
+
 int is_number(const char *s) {
     // Iterate through each character in the string
     while (*s) {
@@ -615,11 +1531,63 @@ int is_number(const char *s) {
     return 1;
 }
 
+// Parse the options after the port, they set the limits of the pool
+int parseOptions(int argc, char *argv[], conn_pool_t* pool) {
+    for (int i = 2; i < argc; i++) {
+        char *value = strchr(argv[i], '=');
+        if (value == NULL)
+            return -1;
+        value++;
+
+        if (strncmp(argv[i], "--queue-limit=", value - argv[i]) == 0 && *value != '\0' && is_number(value))
+            pool->queue_limit = strtoul(value, NULL, 10);
+        else if (strncmp(argv[i], "--memory-limit=", value - argv[i]) == 0 && *value != '\0' && is_number(value))
+            pool->memory_limit = strtoul(value, NULL, 10);
+        else if (strncmp(argv[i], "--max-line=", value - argv[i]) == 0 && *value != '\0' && is_number(value) &&
+                 strtol(value, NULL, 10) >= 2 && strtol(value, NULL, 10) <= INT_MAX - BUFFER_SIZE)
+            pool->max_line = (int)strtol(value, NULL, 10);
+        else if (strncmp(argv[i], "--threads=", value - argv[i]) == 0 && *value != '\0' && is_number(value) &&
+                 strtol(value, NULL, 10) >= 1 && strtol(value, NULL, 10) <= MAX_SHARDS)
+            num_shards = (int)strtol(value, NULL, 10);
+        else if (strncmp(argv[i], "--history=", value - argv[i]) == 0 && *value != '\0' && is_number(value) &&
+                 strtoul(value, NULL, 10) <= UINT_MAX / sizeof(shared_msg_t*))
+            pool->history_msgs = (unsigned int)strtoul(value, NULL, 10);
+        else if (strncmp(argv[i], "--history-bytes=", value - argv[i]) == 0 && *value != '\0' && is_number(value))
+            pool->history_bytes_limit = strtoul(value, NULL, 10);
+        else if (strncmp(argv[i], "--transform=", value - argv[i]) == 0 && findTransform(value, NULL) != NULL)
+            pool->transform = findTransform(value, NULL);
+        else if (strncmp(argv[i], "--overflow=", value - argv[i]) == 0 && strcmp(value, "disconnect") == 0)
+            pool->overflow = OVERFLOW_DISCONNECT;
+        else if (strncmp(argv[i], "--overflow=", value - argv[i]) == 0 && strcmp(value, "drop-oldest") == 0)
+            pool->overflow = OVERFLOW_DROP_OLDEST;
+        else if (strncmp(argv[i], "--overflow=", value - argv[i]) == 0 && strcmp(value, "drop-newest") == 0)
+            pool->overflow = OVERFLOW_DROP_NEWEST;
+        else
+            return -1;
+    }
+    return 0;
+}
+
 void printUsageError() {
-    printf("Usage: server <port>");
+    printf("Usage: server <port> [options]\n"
+           "  --queue-limit=<bytes>    unwritten bytes one connection may have queued, 0 for no limit (default %d)\n"
+           "  --memory-limit=<bytes>   memory of all queued messages, 0 for no limit (default %lu)\n"
+           "  --overflow=<policy>      disconnect, drop-oldest or drop-newest when a limit is reached (default disconnect)\n"
+           "  --max-line=<bytes>       longest line with its newline, a longer one closes the connection (default %d)\n"
+           "  --threads=<n>            reactor threads, each one serves its share of the connections (default 1, at most %d)\n"
+           "  --transform=<name>       upper or none, applied to the received text (default upper, with %s)\n"
+           "  --history=<messages>     last messages of every room replayed to a connection that joins it (default 0)\n"
+           "  --history-bytes=<bytes>  bytes of the history of a room, 0 for no limit (default %d)\n"
+           "A line /JOIN <room> moves the connection to a room, /LEAVE back to the lobby\n"
+           "SIGUSR1 prints the queues that lag the most\n",
+           DEFAULT_QUEUE_LIMIT, DEFAULT_MEMORY_LIMIT, BUFFER_SIZE, MAX_SHARDS, transformInstructions(), DEFAULT_HISTORY_BYTES);
     exit(EXIT_FAILURE);
 }
 
 void intHandler() {
-    end_server = 1;
+    atomic_store(&end_server, 1);
+}
+
+void usr1Handler() {
+    report_queues = 1;
 }
\ No newline at end of file
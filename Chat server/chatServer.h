@@ -1,38 +1,217 @@
 #ifndef CHAT_SERVER_H
 #define CHAT_SERVER_H
 
-#include <sys/select.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "transform.h"
 
 #define BUFFER_SIZE 4096
+
+/* Events returned by one call to epoll_wait. */
+#define MAX_EVENTS 1024
+
+/* Message objects kept for reuse after they are written out, the rest are freed. */
+#define MAX_FREE_MSGS 65536
+
+/* Unwritten bytes a connection may have queued, and memory of all queued messages, 0 for no limit. */
+#define DEFAULT_QUEUE_LIMIT (1024 * 1024)
+#define DEFAULT_MEMORY_LIMIT (256UL * 1024 * 1024)
+
+/* Connections listed by the queue report of SIGUSR1, the most lagging first. */
+#define REPORT_CONNS 20
+
+/* Most reactor threads (shards) of the server. */
+#define MAX_SHARDS 64
+
+/* Buckets of the room table of a shard, must be a power of 2. */
+#define ROOM_TABLE_SIZE 1024
+
+/* Longest room name. */
+#define MAX_ROOM_NAME 64
+
+/* Bytes of the history of a room when only its number of messages is set. */
+#define DEFAULT_HISTORY_BYTES (64 * 1024)
+
+/*
+ * What happens when a message does not fit in the queue of a connection, or in the memory limit.
+ */
+typedef enum overflow_policy {
+        /* Close the connection, for the memory limit the one with the longest queue. */
+        OVERFLOW_DISCONNECT,
+        /* Drop the oldest messages that were not started yet. */
+        OVERFLOW_DROP_OLDEST,
+        /* Drop the new message. */
+        OVERFLOW_DROP_NEWEST
+}overflow_policy_t;
+
+struct payload;
+struct conn;
+struct shared_msg;
+
+/*
+ * A room of a shard and its members on the shard. The lines of a connection go only to the
+ * other members of its room, every connection is in one room, the lobby until it joins another.
+ *
+ * The rooms are found by name in the room table of the pool, the lobby is not in the table and
+ * is never freed. A room is freed when its last member leaves, with its history.
+ */
+typedef struct room {
+        /* The name, not null terminated, empty for the lobby. */
+        char name[MAX_ROOM_NAME];
+        int name_len;
+        unsigned int hash;
+        /* Compact array of the members, removing one moves the last one into its place. */
+        struct conn **members;
+        unsigned int members_size;
+        unsigned int nr_members;
+        /*
+         * Ring of the last messages of the room on this shard, the oldest at history_start.
+         * Every entry holds a reference to the shared message, a connection that joins the
+         * room gets a reference to each of them queued. Allocated with the room, NULL if the
+         * history is off.
+         */
+        struct shared_msg **history;
+        unsigned int history_start;
+        unsigned int history_len;
+        size_t history_bytes;
+        /* Chain of the bucket. */
+        struct room *next;
+}room_t;
+
+/*
+ * Entry of the inbox of a shard, the payload holds one for every shard.
+ */
+typedef struct inbox_node {
+        /* The entry pushed before this one. */
+        struct inbox_node *next;
+        /* The broadcast. */
+        struct payload *payload;
+}inbox_node_t;
+
+/*
+ * Bytes of a broadcast published to the other shards. Every shard holds one reference
+ * until its own connections wrote the message, the last shard frees it.
+ */
+typedef struct payload {
+        /* Number of shards that did not release the payload yet. */
+        atomic_int refs;
+        /* Size of the message. */
+        int size;
+        /* The message, after the nodes. */
+        char *data;
+        /* Room of the sender, every shard sends the message to its own members of the room. */
+        char room[MAX_ROOM_NAME];
+        int room_len;
+        /* One inbox entry for every shard. */
+        inbox_node_t nodes[];
+}payload_t;
+
 /* 
  * Data structure to keep track of active client connections (not the for main socket).
+ *
+ * Every shard of the server has its own pool, listening socket and epoll instance, and
+ * runs it in its own thread. Only the thread of the shard touches the pool, except for
+ * the inbox where the other shards push their broadcasts.
  */
 typedef struct conn_pool { 
-        /* Largest file descriptor in this pool. */
-        int maxfd;                      
-        /* Number of ready descriptors returned by select. */
+        /* The epoll instance that watches the listening socket and every connection. */
+        int epoll_fd;
+        /* Number of ready descriptors returned by epoll_wait. */
         int nready;                     
-        /* Set of all active descriptors for reading. */
-        fd_set read_set;                
-        /* Subset of descriptors ready for reading. */
-        fd_set ready_read_set;  
-        /* Set of all active descriptors for writing. */
-        fd_set write_set;               
-        /* Subset of descriptors ready for writing.  */
-        fd_set ready_write_set; 
-        /* Doubly-linked list of active client connection objects. */
-        struct conn *conn_head;
-        /* Number of active client connections. */
+        /* Descriptors that are ready, filled by epoll_wait. */
+        struct epoll_event events[MAX_EVENTS];
+        /* Connection objects indexed by their file descriptor, NULL for other descriptors. */
+        struct conn **conn_by_fd;
+        /* Entries of conn_by_fd. */
+        int conn_by_fd_size;
+        /* Compact array of the active client connection objects, for iterating over them. */
+        struct conn **conns;
+        /* Entries allocated for conns. */
+        unsigned int conns_size;
+        /* Number of active client connections, the used entries of conns. */
         unsigned int nr_conns;
+        /* Message objects that were written out, reused for the next queued messages. */
+        struct msg *free_msgs;
+        /* Number of message objects in free_msgs. */
+        unsigned int nr_free_msgs;
+        /* Limit of the unwritten bytes in the queue of one connection, 0 for no limit. */
+        size_t queue_limit;
+        /* Limit of the memory of all queued messages and their msg objects, 0 for no limit. */
+        size_t memory_limit;
+        /* Policy when a limit is reached. */
+        overflow_policy_t overflow;
+        /* Memory of the shared messages and the queued msg objects. */
+        size_t memory_bytes;
+        /* Messages dropped from or for a queue, by the policy. */
+        unsigned long dropped_msgs;
+        /* Connections closed by the policy. */
+        unsigned long slow_disconnects;
+        /* Rooms with members, chained per bucket, and the room of new connections. */
+        room_t **rooms;
+        room_t *lobby;
+        unsigned int nr_rooms;
+        /* The room that a message is being added to, it is not freed while it is. */
+        room_t *fanout_room;
+        /* Messages and bytes kept in the history of every room, 0 messages for no history. */
+        unsigned int history_msgs;
+        size_t history_bytes_limit;
+        /* Longest line with its newline. */
+        int max_line;
+        /* Receive buffer of max_line + BUFFER_SIZE bytes shared by all connections. */
+        char *read_buffer;
+        /* Offsets of the newlines of the last read, found by the transform. */
+        int *newlines;
+        /* Kernel that transforms the received bytes and finds their newlines. */
+        transform_fn transform;
+        /* Number of the shard, and all the shards of the server. */
+        int shard;
+        int nr_shards;
+        struct conn_pool **shards;
+        /* Listening socket of the shard, every shard binds the port with SO_REUSEPORT. */
+        int listen_fd;
+        /* eventfd that wakes the shard for its inbox, for a report or to stop. */
+        int wake_fd;
+        /* Lock free stack of broadcasts pushed by the other shards, taken all at once. */
+        _Atomic(inbox_node_t *) inbox;
+        /* Generation of the last SIGUSR1 report that the shard printed. */
+        unsigned int report_seen;
+        /* Thread that runs the shard. */
+        pthread_t thread;
         
 }conn_pool_t;
 
+/*
+ * Data structure holding the bytes of one message, stored once for all its recipients in a shard.
+ *
+ * The bytes never change after the message is created. Every queue that holds the
+ * message counts as a reference, and so does the history of its room. The last
+ * reference that is released frees it.
+ * With a single shard the bytes follow the structure, otherwise they are in the payload
+ * that all shards share.
+ */
+typedef struct shared_msg {
+        /* Number of queued msg objects and history entries that point to this message. */
+        int refs;
+        /* Size of the message. */
+        int size;
+        /* The message, not null terminated. */
+        char *data;
+        /* The payload of the bytes, released when the last reference of the shard is, or NULL. */
+        payload_t *payload;
+        /* The bytes of a message without a payload. */
+        char inline_data[];
+}shared_msg_t;
+
 /*
  * Data structure to keep track of messages. Each message object holds one
  * complete line of message from a client.  
  *
  * The message objects are maintained per connection in a doubly-linked list. 
- * When a message is read from one connection, it is added to the list of all other connections.
+ * When a message is read from one connection, a reference to it is added to the list of
+ * all other connections.
  *
  * A message is added to the list only when a complete line has been read from
  * the client. 
@@ -42,24 +221,22 @@ typedef struct msg {
         struct msg *prev;
         /* Points to the next message object in the doubly-linked list. */
         struct msg *next;
-        /* Points to a dynamically allocated buffer holding the message. */
-        char *message;
-        /* Size of the message. */
-        int size;
+        /* Points to the shared message. */
+        shared_msg_t *shared;
+        /* Bytes of the message already written to this connection. */
+        int offset;
 }msg_t;
 
 
 /*
  * Data structure to keep track of client connection state.
  *
- * The connection objects are also maintained in a global doubly-linked list.
- * There is a dummy connection head at the beginning of the list.
+ * The connection objects are found by their file descriptor in the conn_by_fd table of the
+ * pool, and kept in its compact conns array. Removing one moves the last one into its place.
  */
 typedef struct conn {
-        /* Points to the previous connection object in the doubly-linked list. */
-        struct conn *prev;      
-        /* Points to the next connection object in the doubly-linked list. */
-        struct conn *next;      
+        /* Position of the connection in the conns array of the pool. */
+        unsigned int index;
         /* File descriptor associated with this connection. */
         int fd;                 
         /* 
@@ -68,6 +245,21 @@ typedef struct conn {
          */
         struct msg *write_msg_head;
 		struct msg *write_msg_tail;
+        /* The room of the connection, and its position in the members array of the room. */
+        room_t *room;
+        unsigned int room_index;
+        /* True while the connection is watched for EPOLLOUT, only when its queue is not empty. */
+        bool watch_write;
+        /* Unwritten bytes of the queued messages. */
+        size_t queued_bytes;
+        /* Number of queued messages. */
+        unsigned int queued_msgs;
+        /* 
+         * The start of a line that was not completed by the last read, allocated
+         * with max_line bytes when the first partial line arrives.
+         */
+        char *partial;
+        int partial_len;
 }conn_t;
 
 
@@ -81,7 +273,7 @@ int initPool(conn_pool_t* pool);
 
 
 /*
- * Add connection when new client connects the server. 
+ * Add connection when new client connects the server, the history of the lobby is queued to it. 
  * @ sd - the socket descriptor returned from accept
  * @pool - the pool 
  * @ return value - 0 on success, -1 on failure 
@@ -97,7 +289,7 @@ int addConn(int sd, conn_pool_t* pool);
 int removeConn(int sd, conn_pool_t* pool);
 
 /*
- * Add msg to the queues of all connections (except of the origin). 
+ * Add msg to the queues of all connections in the room of the origin (except of the origin). 
  * @ sd - the socket descriptor of the origin client
  * @ buffer - the msg to add
  * @ len - length of msg
@@ -107,6 +299,15 @@ int removeConn(int sd, conn_pool_t* pool);
 int addMsg(int sd,char* buffer,int len,conn_pool_t* pool);
 
 
+/*
+ * Read from client, complete lines are added to the other connections of its room.
+ * A line /JOIN <room> moves the connection to the room, /LEAVE back to the lobby.
+ * @ sd - the socket descriptor of the connection to read from
+ * @pool - the pool 
+ * @ return value - 0 on success, -1 if the connection was closed, failed or sent a too long line
+ */
+int readFromClient(int sd, conn_pool_t* pool);
+
 /*
  * Write msg to client. 
  * @ sd - the socket descriptor of the connection to write msg to
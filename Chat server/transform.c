@@ -0,0 +1,229 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "transform.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+
+// Every kernel is one of the loops below, inlined with the functions of its transform
+#define KERNEL static inline __attribute__((always_inline))
+
+/*************************************************************/
+/* Functions of the transforms, on one byte and on a block    */
+/*************************************************************/
+
+static inline char upperByte(char c) {
+    return (char)(c - ((unsigned char)(c - 'a') < 26 ? 'a' - 'A' : 0));
+}
+
+static inline char sameByte(char c) {
+    return c;
+}
+
+// Eight bytes in a word, a-z are the ASCII bytes that are at least 'a' and at most 'z'
+#define ONES 0x0101010101010101ULL
+#define HIGH_BITS (0x80 * ONES)
+
+static inline uint64_t upperWord(uint64_t w) {
+    uint64_t low = w & ~HIGH_BITS;
+    uint64_t from_a = low + (0x80 - 'a') * ONES;
+    uint64_t after_z = low + (0x80 - 'z' - 1) * ONES;
+    uint64_t lower = from_a & ~after_z & ~w & HIGH_BITS;
+    return w - (lower >> 2);
+}
+
+static inline uint64_t sameWord(uint64_t w) {
+    return w;
+}
+
+#ifdef HAVE_SSE2
+// a-z are moved to the bottom of the signed range, so one signed compare finds them
+static inline __m128i upperSse2(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'a')));
+    __m128i lower = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + 26)));
+    return _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8('a' - 'A')));
+}
+
+static inline __m128i sameSse2(__m128i v) {
+    return v;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i upperAvx2(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'a')));
+    __m256i lower = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + 26)), shifted);
+    return _mm256_sub_epi8(v, _mm256_and_si256(lower, _mm256_set1_epi8('a' - 'A')));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sameAvx2(__m256i v) {
+    return v;
+}
+#endif
+
+/*************************************************************/
+/* The loops, the newlines are found before the transform     */
+/*************************************************************/
+
+KERNEL int scanScalar(char* data, int start, int len, int* newlines, int count,
+                      char (*byte)(char), bool changes) {
+    // The offset is always written, only a newline keeps it
+    for (int i = start; i < len; i++) {
+        char c = data[i];
+        newlines[count] = i;
+        count += c == '\n';
+        if (changes)
+            data[i] = byte(c);
+    }
+    return count;
+}
+
+// The high bit of every byte of the word that is a newline
+static inline uint64_t newlineBits(uint64_t w) {
+    uint64_t x = w ^ ('\n' * ONES);
+    return ~(((x & ~HIGH_BITS) + ~HIGH_BITS) | x | ~HIGH_BITS);
+}
+
+// Without SIMD the bytes are taken a word at a time, on little endian CPUs
+KERNEL int scanWords(char* data, int len, int* newlines,
+                     uint64_t (*word)(uint64_t), char (*byte)(char), bool changes) {
+    int count = 0;
+    int i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        uint64_t mask = newlineBits(w);
+        if (changes) {
+            w = word(w);
+            memcpy(data + i, &w, 8);
+        }
+        while (mask != 0) {
+            newlines[count++] = i + __builtin_ctzll(mask) / 8;
+            mask &= mask - 1;
+        }
+    }
+#else
+    (void)word;
+#endif
+    return scanScalar(data, i, len, newlines, count, byte, changes);
+}
+
+#ifdef HAVE_SSE2
+KERNEL int scanSse2(char* data, int len, int* newlines,
+                    __m128i (*block)(__m128i), char (*byte)(char), bool changes) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    int count = 0;
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (changes)
+            _mm_storeu_si128((__m128i*)(data + i), block(v));
+        while (mask != 0) {
+            newlines[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return scanScalar(data, i, len, newlines, count, byte, changes);
+}
+
+__attribute__((target("avx2")))
+KERNEL int scanAvx2(char* data, int len, int* newlines,
+                    __m256i (*block)(__m256i), char (*byte)(char), bool changes) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    int count = 0;
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (changes)
+            _mm256_storeu_si256((__m256i*)(data + i), block(v));
+        while (mask != 0) {
+            newlines[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return scanScalar(data, i, len, newlines, count, byte, changes);
+}
+#endif
+
+/*************************************************************/
+/* One kernel for every transform and instructions            */
+/*************************************************************/
+
+static int upperScalarKernel(char* data, int len, int* newlines) {
+    return scanWords(data, len, newlines, upperWord, upperByte, true);
+}
+
+static int noneScalarKernel(char* data, int len, int* newlines) {
+    return scanWords(data, len, newlines, sameWord, sameByte, false);
+}
+
+#ifdef HAVE_SSE2
+static int upperSse2Kernel(char* data, int len, int* newlines) {
+    return scanSse2(data, len, newlines, upperSse2, upperByte, true);
+}
+
+static int noneSse2Kernel(char* data, int len, int* newlines) {
+    return scanSse2(data, len, newlines, sameSse2, sameByte, false);
+}
+
+__attribute__((target("avx2")))
+static int upperAvx2Kernel(char* data, int len, int* newlines) {
+    return scanAvx2(data, len, newlines, upperAvx2, upperByte, true);
+}
+
+__attribute__((target("avx2")))
+static int noneAvx2Kernel(char* data, int len, int* newlines) {
+    return scanAvx2(data, len, newlines, sameAvx2, sameByte, false);
+}
+#else
+#define upperSse2Kernel NULL
+#define noneSse2Kernel NULL
+#define upperAvx2Kernel NULL
+#define noneAvx2Kernel NULL
+#endif
+
+static const struct {
+    const char* name;
+    transform_fn scalar;
+    transform_fn sse2;
+    transform_fn avx2;
+} transforms[] = {
+    { "upper", upperScalarKernel, upperSse2Kernel, upperAvx2Kernel },
+    { "none",  noneScalarKernel,  noneSse2Kernel,  noneAvx2Kernel  },
+};
+
+const char* transformInstructions() {
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+transform_fn findTransform(const char* name, const char* instructions) {
+    const char* supported = transformInstructions();
+    if (instructions == NULL)
+        instructions = supported;
+
+    for (size_t i = 0; i < sizeof(transforms) / sizeof(transforms[0]); i++) {
+        if (strcmp(transforms[i].name, name) != 0)
+            continue;
+        if (strcmp(instructions, "scalar") == 0)
+            return transforms[i].scalar;
+        if (strcmp(instructions, "sse2") == 0 && strcmp(supported, "scalar") != 0)
+            return transforms[i].sse2;
+        if (strcmp(instructions, "avx2") == 0 && strcmp(supported, "avx2") == 0)
+            return transforms[i].avx2;
+        return NULL;
+    }
+    return NULL;
+}
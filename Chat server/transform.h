@@ -0,0 +1,39 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+/*
+ * Transforms of the received bytes, fused with the search for the newlines so every
+ * received chunk is passed over once.
+ *
+ * Every transform has a scalar kernel that takes 8 bytes at a time in a word, and on x86
+ * an SSE2 and an AVX2 one that take 16 and 32 bytes at a time. The newlines are found in
+ * the bytes as they were read, a transform can't add or remove a line.
+ *
+ * A new transform needs a byte, a word, an SSE2 block and an AVX2 block function in
+ * transform.c and a line in its table of transforms.
+ */
+
+/*
+ * Transform len bytes in place and find their newlines.
+ * @ data - the bytes that were read
+ * @ len - number of bytes
+ * @ newlines - gets the offset of every newline, room for len offsets
+ * @ return value - number of newlines
+ */
+typedef int (*transform_fn)(char* data, int len, int* newlines);
+
+/*
+ * Find a transform by name.
+ * @ name - upper or none
+ * @ instructions - avx2, sse2 or scalar, NULL for the widest the CPU supports
+ * @ return value - the kernel, NULL if there is no such transform or the CPU lacks the instructions
+ */
+transform_fn findTransform(const char* name, const char* instructions);
+
+/*
+ * The widest instructions the CPU supports, that findTransform uses by default.
+ * @ return value - avx2, sse2 or scalar
+ */
+const char* transformInstructions();
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "access_log.h"
+
+// size of the buffer the writer formats records into before writing them
+#define WRITE_BATCH_SIZE (64*1024)
+
+// longest formatted record
+#define MAX_LINE_SIZE 1024
+
+/**
+ * Single producer single consumer ring. The worker owning it moves head,
+ * the writer thread moves tail, each on its own cache line.
+ */
+typedef struct log_ring_st {
+    _Alignas(64) atomic_ulong head;   // next slot the owner writes
+    _Alignas(64) atomic_ulong tail;   // next slot the writer reads
+    _Alignas(64) atomic_long dropped; // records dropped because the ring was full
+    access_record_t records[ACCESS_LOG_RING_SIZE];
+} log_ring_t;
+
+static log_ring_t *_Atomic rings[MAX_LOG_RINGS];
+static atomic_int num_rings = 0;
+static atomic_long dropped_no_ring = 0;     // records of threads that did not get a ring
+static __thread log_ring_t *my_ring = NULL;
+
+static int log_fd = -1;
+static atomic_int running = 0;
+static pthread_t writer_thread;
+
+//  Private helpers //------------------------------------------------------------------//
+
+// Give the calling thread a ring the first time it logs
+static log_ring_t* get_my_ring() {
+    if (my_ring != NULL)
+        return my_ring;
+
+    int index = atomic_fetch_add(&num_rings, 1);
+    if (index >= MAX_LOG_RINGS)
+        return NULL;
+
+    log_ring_t *ring = aligned_alloc(64, sizeof(log_ring_t));
+    if (ring == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_store_explicit(&rings[index], ring, memory_order_release);
+    my_ring = ring;
+    return ring;
+}
+
+// Copy a string for the log replacing characters that would break the line
+static void copy_field(char *dest, size_t size, const char *src) {
+    size_t i = 0;
+    for (; i + 1 < size && src[i] != '\0'; i++)
+        dest[i] = (src[i] == '"' || src[i] == '\\' || (unsigned char) src[i] < ' ') ? '?' : src[i];
+    dest[i] = '\0';
+}
+
+static int format_record(char *line, const access_record_t *record) {
+    struct tm tm;
+    char date_string[32];
+    char host[LOG_HOST_SIZE], path[LOG_PATH_SIZE];
+    copy_field(host, sizeof(host), record->host);
+    copy_field(path, sizeof(path), record->path);
+    gmtime_r(&record->time.tv_sec, &tm);
+    strftime(date_string, sizeof(date_string), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    return snprintf(line, MAX_LINE_SIZE,
+                    "time=%s.%03ldZ client=%s host=\"%s\" path=\"%s\" status=%d bytes=%ld "
+                    "dns_us=%ld connect_us=%ld total_us=%ld cache=%s\n",
+                    date_string, record->time.tv_nsec / 1000000L,
+                    record->client, host, path, record->status,
+                    record->bytes_relayed, record->dns_us, record->connect_us, record->total_us,
+                    record->cache != NULL ? record->cache : "-");
+}
+
+static void write_all(const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(log_fd, buffer, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: write\n");
+            return;
+        }
+        buffer += written;
+        len -= written;
+    }
+}
+
+// Move everything in the rings to the log file, returns the number of records written
+static long drain_rings(char *batch) {
+    size_t used = 0;
+    long written = 0;
+    int count = atomic_load(&num_rings);
+    if (count > MAX_LOG_RINGS)
+        count = MAX_LOG_RINGS;
+
+    for (int i = 0; i < count; i++) {
+        log_ring_t *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (ring == NULL)
+            continue;
+
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (used + MAX_LINE_SIZE > WRITE_BATCH_SIZE) {
+                write_all(batch, used);
+                used = 0;
+            }
+            int len = format_record(batch + used, &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)]);
+            if (len > 0)
+                used += len < MAX_LINE_SIZE ? (size_t) len : MAX_LINE_SIZE - 1;
+            written++;
+        }
+        // Hand the slots back to the owner
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    if (used > 0)
+        write_all(batch, used);
+    return written;
+}
+
+static void* writer_loop(void *arg) {
+    (void) arg;
+    char *batch = malloc(WRITE_BATCH_SIZE);
+    if (batch == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    struct timespec interval = { 0, ACCESS_LOG_FLUSH_INTERVAL_MS * 1000000L };
+    long reported_drops = 0;
+
+    while (atomic_load(&running)) {
+        // Sleep only when there was nothing to write
+        if (drain_rings(batch) == 0)
+            nanosleep(&interval, NULL);
+
+        // Report new drops in the log itself
+        long drops = access_log_dropped();
+        if (drops != reported_drops) {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "dropped=%ld\n", drops);
+            write_all(line, len);
+            reported_drops = drops;
+        }
+    }
+
+    // Write the records that arrived until the threads stopped
+    drain_rings(batch);
+    free(batch);
+    return NULL;
+}
+// --------------------------------------------------------------------------------------//
+
+int start_access_log(const char *path) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        perror("error: open\n");
+        return -1;
+    }
+
+    atomic_store(&running, 1);
+    if (pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0) {
+        perror("error: pthread_create\n");
+        atomic_store(&running, 0);
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void log_access(const access_record_t *record) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed))
+        return;
+
+    log_ring_t *ring = get_my_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped_no_ring, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ACCESS_LOG_RING_SIZE) {
+        // The writer is behind, drop the record instead of waiting
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring->records[head & (ACCESS_LOG_RING_SIZE - 1)] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+long access_log_dropped() {
+    long dropped = atomic_load_explicit(&dropped_no_ring, memory_order_relaxed);
+    int count = atomic_load(&num_rings);
+    if (count > MAX_LOG_RINGS)
+        count = MAX_LOG_RINGS;
+    for (int i = 0; i < count; i++) {
+        log_ring_t *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (ring != NULL)
+            dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+void stop_access_log() {
+    if (!atomic_load(&running))
+        return;
+
+    atomic_store(&running, 0);
+    pthread_join(writer_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+
+    // The worker threads are gone by now, free their rings
+    int count = atomic_load(&num_rings);
+    for (int i = 0; i < count && i < MAX_LOG_RINGS; i++)
+        free(atomic_exchange(&rings[i], NULL));
+}
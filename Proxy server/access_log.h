@@ -0,0 +1,71 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <time.h>
+#include <arpa/inet.h>
+
+/**
+ * access_log.h
+ *
+ * Structured access log of the proxy, one line per request.
+ * Every worker thread appends its records to a ring buffer of its own without
+ * taking a lock, and a background thread drains all the rings and writes the
+ * records to the log file in batches. When a ring is full the record is dropped
+ * and counted, so a slow disk never blocks a request.
+ */
+
+// records in the ring of every thread, must be a power of 2
+#define ACCESS_LOG_RING_SIZE 1024
+
+// maximum number of threads that can write to the log
+#define MAX_LOG_RINGS 256
+
+// how long the writer sleeps when all the rings are empty
+#define ACCESS_LOG_FLUSH_INTERVAL_MS 100
+
+#define LOG_HOST_SIZE 128
+#define LOG_PATH_SIZE 256
+
+
+/**
+ * One request as it appears in the log
+ */
+typedef struct access_record_st {
+    struct timespec time;           // wall clock time the request arrived
+    char client[INET_ADDRSTRLEN];   // client ip address
+    char host[LOG_HOST_SIZE];       // requested host, may be empty for bad requests
+    char path[LOG_PATH_SIZE];       // requested path, may be empty for bad requests
+    int status;                     // status code the client got
+    long bytes_relayed;             // bytes sent back to the client
+    long dns_us;                    // time spent resolving the host
+    long connect_us;                // time spent connecting to the server
+    long total_us;                  // time from the start of the request to the end
+    const char *cache;              // "hit", "stale", "revalidated" or "miss", NULL if the cache was not asked
+} access_record_t;
+
+
+/**
+ * start_access_log opens (appends to) the log file and starts the writer thread.
+ * @ return value - 0 on success, -1 on failure
+ */
+int start_access_log(const char *path);
+
+/**
+ * log_access copies the record into the ring of the calling thread.
+ * Never blocks, when the ring is full the record is dropped.
+ * Does nothing if the log was not started.
+ */
+void log_access(const access_record_t *record);
+
+/**
+ * access_log_dropped returns how many records were dropped so far.
+ */
+long access_log_dropped();
+
+/**
+ * stop_access_log writes the records that are left, stops the writer thread
+ * and closes the log file. Must be called after the worker threads exited.
+ */
+void stop_access_log();
+
+#endif //ACCESS_LOG_H
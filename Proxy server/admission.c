@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "admission.h"
+
+// slots looked at before a client is stored over an older one
+#define MAX_PROBE_LENGTH 8
+
+/**
+ * Token bucket of a client IP, only the accept thread uses them
+ */
+typedef struct client_bucket_st {
+    uint32_t ip;
+    int used;
+    double tokens;
+    long last_refill_us;
+} client_bucket_t;
+
+static client_bucket_t client_buckets[CLIENT_BUCKETS_SIZE];
+
+static long target_delay_us = 5000;
+static long interval_us = 100000;
+static int queue_limit = 0;
+static double rate_per_us = 0;
+static double burst = 0;
+
+static char *prepared_response = NULL;
+static size_t prepared_response_len = 0;
+
+// CoDel state, written by the workers and read by the accept thread
+static atomic_long first_above_time = 0;    // when the delay may stop being above the target, 0 if below
+static atomic_int overloaded = 0;
+
+static atomic_long shed_counts[SHED_CLIENT_RATE + 1];
+
+//  Private helpers //------------------------------------------------------------------//
+static unsigned int hash_ip(uint32_t ip) {
+    return (unsigned int) ((ip * 2654435769U) >> 20) & (CLIENT_BUCKETS_SIZE - 1);
+}
+
+static client_bucket_t* get_bucket(uint32_t ip, long now_us) {
+    unsigned int slot = hash_ip(ip);
+    client_bucket_t *bucket = NULL;
+    for (int i = 0; i < MAX_PROBE_LENGTH; i++) {
+        client_bucket_t *candidate = &client_buckets[(slot + i) & (CLIENT_BUCKETS_SIZE - 1)];
+        if (candidate->used && candidate->ip == ip)
+            return candidate;
+        if (!candidate->used) {
+            bucket = candidate;
+            break;
+        }
+    }
+    // A new client, or the neighbourhood is full and the home slot is taken over
+    if (bucket == NULL)
+        bucket = &client_buckets[slot];
+    bucket->ip = ip;
+    bucket->used = 1;
+    bucket->tokens = burst;
+    bucket->last_refill_us = now_us;
+    return bucket;
+}
+
+// Take a token from the client's bucket, false if it is empty
+static int take_token(uint32_t ip, long now_us) {
+    client_bucket_t *bucket = get_bucket(ip, now_us);
+    bucket->tokens += (double) (now_us - bucket->last_refill_us) * rate_per_us;
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    bucket->last_refill_us = now_us;
+
+    if (bucket->tokens < 1)
+        return 0;
+    bucket->tokens -= 1;
+    return 1;
+}
+// --------------------------------------------------------------------------------------//
+
+void init_admission(long target_us, long interval, int max_queue,
+                    double client_rate, double client_burst, const char *response_503) {
+    target_delay_us = target_us;
+    interval_us = interval;
+    queue_limit = max_queue;
+    rate_per_us = client_rate / 1e6;
+    burst = client_burst < 1 ? 1 : client_burst;
+    memset(client_buckets, 0, sizeof(client_buckets));
+
+    free(prepared_response);
+    prepared_response = strdup(response_503);
+    if (prepared_response == NULL)
+        perror("error: malloc\n");
+    prepared_response_len = prepared_response == NULL ? 0 : strlen(prepared_response);
+}
+
+admission_t admit(uint32_t client_ip, int queue_depth, long now_us) {
+    admission_t decision = ADMIT;
+
+    if (queue_limit > 0 && queue_depth >= queue_limit)
+        decision = SHED_QUEUE_FULL;
+    else if (queue_depth > 0 && atomic_load_explicit(&overloaded, memory_order_relaxed))
+        decision = SHED_OVERLOAD;
+    else if (rate_per_us > 0 && !take_token(client_ip, now_us))
+        decision = SHED_CLIENT_RATE;
+
+    if (decision != ADMIT)
+        atomic_fetch_add_explicit(&shed_counts[decision], 1, memory_order_relaxed);
+    return decision;
+}
+
+int observe_queue_delay(long delay_us, long now_us) {
+    if (delay_us < target_delay_us) {
+        // A connection went through fast enough, the queue is fine
+        if (atomic_load_explicit(&first_above_time, memory_order_relaxed) != 0)
+            atomic_store_explicit(&first_above_time, 0, memory_order_relaxed);
+        if (atomic_load_explicit(&overloaded, memory_order_relaxed))
+            atomic_store_explicit(&overloaded, 0, memory_order_relaxed);
+        return 0;
+    }
+
+    long expected = 0;
+    if (atomic_compare_exchange_strong(&first_above_time, &expected, now_us + interval_us))
+        return 0;
+
+    // Above the target for a whole interval
+    if (now_us >= expected && !atomic_load_explicit(&overloaded, memory_order_relaxed))
+        atomic_store_explicit(&overloaded, 1, memory_order_relaxed);
+
+    // Drop from the head of the queue while overloaded, like CoDel does
+    if (atomic_load_explicit(&overloaded, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&shed_counts[SHED_OVERLOAD], 1, memory_order_relaxed);
+        return 1;
+    }
+    return 0;
+}
+
+long shed_connection(int client_socket) {
+    ssize_t bytes_sent = 0;
+    if (prepared_response != NULL)
+        bytes_sent = send(client_socket, prepared_response, prepared_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+    return bytes_sent < 0 ? 0 : bytes_sent;
+}
+
+int admission_overloaded() {
+    return atomic_load_explicit(&overloaded, memory_order_relaxed);
+}
+
+long admission_shed_count(admission_t reason) {
+    return atomic_load_explicit(&shed_counts[reason], memory_order_relaxed);
+}
@@ -0,0 +1,71 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * admission.h
+ *
+ * Admission control on the accept path of the proxy.
+ *
+ * The workers report how long every connection waited in the queue. Like CoDel,
+ * when the waiting time stays above a target for a whole interval the proxy is
+ * overloaded. While it is overloaded, new connections are answered right away with
+ * a prepared 503 if the queue is not empty, and queued connections that waited
+ * longer than the target get the 503 from the worker instead of being served.
+ * The state clears as soon as a connection waited less than the target.
+ *
+ * Every client IP also has a token bucket, a client that sends faster than
+ * its rate (after using its burst) gets the 503 too.
+ */
+
+// client IPs remembered by the token buckets, must be a power of 2
+#define CLIENT_BUCKETS_SIZE 4096
+
+typedef enum {
+    ADMIT,              // queue the connection
+    SHED_OVERLOAD,      // the pool is saturated
+    SHED_QUEUE_FULL,    // the queue reached its limit
+    SHED_CLIENT_RATE    // the client used up its tokens
+} admission_t;
+
+
+/**
+ * init_admission sets the policy and prepares the 503 response.
+ * @target_us - queue delay that is acceptable
+ * @interval_us - how long the delay may stay above the target before shedding
+ * @max_queue - connections allowed to wait in the queue, 0 for no limit
+ * @client_rate - connections per second allowed per client IP, 0 to disable the buckets
+ * @client_burst - connections a client IP may make at once
+ * @response_503 - the response sent to shed connections
+ */
+void init_admission(long target_us, long interval_us, int max_queue,
+                    double client_rate, double client_burst, const char *response_503);
+
+/**
+ * admit decides what to do with a new connection. Called only from the accept thread.
+ * @client_ip - client IPv4 address in network byte order
+ * @queue_depth - connections waiting in the pool's queue
+ */
+admission_t admit(uint32_t client_ip, int queue_depth, long now_us);
+
+/**
+ * observe_queue_delay is called by a worker when it takes a connection off the queue.
+ * @ return value - 1 if the connection waited too long and should be shed, 0 otherwise
+ */
+int observe_queue_delay(long delay_us, long now_us);
+
+/**
+ * shed_connection sends the prepared 503 without blocking and closes the socket.
+ * @ return value - number of bytes sent
+ */
+long shed_connection(int client_socket);
+
+/**
+ * Counters for the statistics
+ */
+int admission_overloaded();
+long admission_shed_count(admission_t reason);
+
+#endif //ADMISSION_H
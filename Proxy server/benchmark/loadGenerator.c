@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+// Multi threaded HTTP client for benchmarking the proxy.
+// Every thread sends requests through the proxy one after the other for the given
+// duration, and the results of the run are printed as a single line of JSON.
+
+#define RESPONSE_BUFFER_SIZE (64*1024)
+#define REQUEST_BUFFER_SIZE 1024
+#define INITIAL_LATENCY_CAPACITY 4096
+
+// What every thread sends and where
+typedef struct {
+    struct sockaddr_in proxy_address;
+    char request[REQUEST_BUFFER_SIZE];
+    size_t request_len;
+    long end_time_us;
+} LoadConfig;
+
+// What every thread measured
+typedef struct {
+    pthread_t thread;
+    const LoadConfig *config;
+    long requests;
+    long errors;
+    long bytes;
+    long *latencies_us;
+    long num_latencies;
+    long latency_capacity;
+} LoadWorker;
+
+void print_usage_error_and_quit();
+void* run_worker(void *arg);
+bool send_request(const LoadConfig *config, long *bytes);
+long now_us();
+int compare_longs(const void *a, const void *b);
+long percentile(const long *sorted, long count, double fraction);
+
+int main(int argc, char *argv[]) {
+    if (argc < 5 || argc > 6)
+        print_usage_error_and_quit();
+
+    char *endptr;
+    long proxy_port = strtol(argv[1], &endptr, 10);
+    if (*endptr != '\0' || proxy_port <= 0 || proxy_port > 65535)
+        print_usage_error_and_quit();
+
+    const char *origin = argv[2];
+
+    long concurrency = strtol(argv[3], &endptr, 10);
+    if (*endptr != '\0' || concurrency <= 0)
+        print_usage_error_and_quit();
+
+    long duration_s = strtol(argv[4], &endptr, 10);
+    if (*endptr != '\0' || duration_s <= 0)
+        print_usage_error_and_quit();
+
+    const char *path = argc > 5 ? argv[5] : "/";
+
+    signal(SIGPIPE, SIG_IGN);
+
+    LoadConfig config;
+    memset(&config, 0, sizeof(config));
+    config.proxy_address.sin_family = AF_INET;
+    config.proxy_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config.proxy_address.sin_port = htons(proxy_port);
+    config.request_len = snprintf(config.request, sizeof(config.request),
+                                  "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, origin);
+
+    LoadWorker *workers = calloc(concurrency, sizeof(LoadWorker));
+    if (workers == NULL) {
+        perror("error: malloc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long start_us = now_us();
+    config.end_time_us = start_us + duration_s * 1000000L;
+
+    for (long i = 0; i < concurrency; i++) {
+        workers[i].config = &config;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("error: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Collect the results of all the threads
+    long requests = 0, errors = 0, bytes = 0, num_latencies = 0;
+    for (long i = 0; i < concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        num_latencies += workers[i].num_latencies;
+    }
+    double elapsed_s = (double) (now_us() - start_us) / 1e6;
+
+    long *latencies = malloc((num_latencies + 1) * sizeof(long));
+    if (latencies == NULL) {
+        perror("error: malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    long count = 0;
+    for (long i = 0; i < concurrency; i++) {
+        memcpy(latencies + count, workers[i].latencies_us, workers[i].num_latencies * sizeof(long));
+        count += workers[i].num_latencies;
+        free(workers[i].latencies_us);
+    }
+    qsort(latencies, count, sizeof(long), compare_longs);
+
+    printf("{\"concurrency\": %ld, \"duration_s\": %.2f, \"requests\": %ld, \"errors\": %ld, "
+           "\"requests_per_s\": %.1f, \"throughput_mb_s\": %.2f, "
+           "\"p50_us\": %ld, \"p99_us\": %ld, \"p999_us\": %ld, \"max_us\": %ld}\n",
+           concurrency, elapsed_s, requests, errors,
+           (double) requests / elapsed_s, (double) bytes / elapsed_s / (1024.0 * 1024.0),
+           percentile(latencies, count, 0.5), percentile(latencies, count, 0.99),
+           percentile(latencies, count, 0.999), count > 0 ? latencies[count - 1] : 0);
+
+    free(latencies);
+    free(workers);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Send requests until the run is over, recording the latency of the successful ones
+void* run_worker(void *arg) {
+    LoadWorker *worker = (LoadWorker *) arg;
+    worker->latency_capacity = INITIAL_LATENCY_CAPACITY;
+    worker->latencies_us = malloc(worker->latency_capacity * sizeof(long));
+    if (worker->latencies_us == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+
+    while (now_us() < worker->config->end_time_us) {
+        long bytes = 0;
+        long start_us = now_us();
+        bool ok = send_request(worker->config, &bytes);
+        long latency_us = now_us() - start_us;
+
+        worker->requests++;
+        worker->bytes += bytes;
+        if (!ok) {
+            worker->errors++;
+            continue;
+        }
+
+        if (worker->num_latencies == worker->latency_capacity) {
+            long *grown = realloc(worker->latencies_us, worker->latency_capacity * 2 * sizeof(long));
+            if (grown == NULL)
+                continue;
+            worker->latencies_us = grown;
+            worker->latency_capacity *= 2;
+        }
+        worker->latencies_us[worker->num_latencies++] = latency_us;
+    }
+    return NULL;
+}
+
+// Send one request through the proxy and read the whole response.
+// Returns true if the response was a 200.
+bool send_request(const LoadConfig *config, long *bytes) {
+    char response[RESPONSE_BUFFER_SIZE];
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+        return false;
+
+    if (connect(sockfd, (const struct sockaddr *) &config->proxy_address, sizeof(config->proxy_address)) < 0 ||
+        send(sockfd, config->request, config->request_len, MSG_NOSIGNAL) != (ssize_t) config->request_len) {
+        close(sockfd);
+        return false;
+    }
+
+    bool ok = false;
+    bool first_chunk = true;
+    while (1) {
+        ssize_t n = recv(sockfd, response, sizeof(response), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if (first_chunk) {
+            ok = n > 12 && strncmp(response + 9, "200", 3) == 0;
+            first_chunk = false;
+        }
+        *bytes += n;
+    }
+
+    close(sockfd);
+    return ok;
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+long percentile(const long *sorted, long count, double fraction) {
+    if (count == 0)
+        return 0;
+    long index = (long) (fraction * (double) count);
+    return sorted[index < count ? index : count - 1];
+}
+
+void print_usage_error_and_quit() {
+    printf("Usage: loadGenerator <proxy-port> <origin-host:port> <concurrency> <duration-seconds> [path]\n");
+    exit(EXIT_FAILURE);
+}
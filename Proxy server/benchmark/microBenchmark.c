@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../threadpool.h"
+#include "../buffer_pool.h"
+#include "../filter_image.h"
+
+// Microbenchmarks of the hot functions of the proxy and of the threadpool.
+// Links against proxyServer.c compiled with -DPROXY_SERVER_NO_MAIN (see runMicroBenchmark.sh).
+// Every benchmark prints one JSON object, the whole output is a single JSON document
+// so two versions can be compared with a diff or a script.
+
+#define DEFAULT_MAX_FILTER_SIZE 1000000
+#define DEFAULT_MIN_TIME_MS 200
+#define MAX_BENCHMARK_THREADS 200
+#define THROUGHPUT_JOBS 100000
+#define LATENCY_ROUNDS 2000
+
+// Functions of proxyServer.c
+bool validateAndParseRequest(const char *request, char *method, char *path, char* protocol, char *host);
+void set_connection_to_close(char *request);
+void generate_error_response(char *buffer, int code);
+
+// Something the compiler can't optimize away
+static volatile long sink;
+
+static long min_time_ns = DEFAULT_MIN_TIME_MS * 1000000L;
+static bool first_result = true;
+
+static const char *sample_request =
+        "GET /posts/1 HTTP/1.1\r\n"
+        "Host: jsonplaceholder.typicode.com\r\n"
+        "User-Agent: microBenchmark/1.0\r\n"
+        "Accept: */*\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+typedef void (*bench_fn)(void *arg, long iterations);
+
+long now_ns();
+void print_benchmark_usage_and_quit();
+void report(const char *name, const char *params, long iterations, double ns_per_op, const char *extra);
+void run_timed(const char *name, const char *params, bench_fn fn, void *arg);
+void make_filter(int size, const char *text_path, const char *image_path);
+void bench_threadpool(int num_threads);
+
+//  Benchmarked operations //----------------------------------------------------------//
+void bench_parse(void *arg, long iterations) {
+    (void) arg;
+    char method[128], path[512], protocol[128], host[512];
+    for (long i = 0; i < iterations; i++)
+        sink += validateAndParseRequest(sample_request, method, path, protocol, host);
+}
+
+void bench_filter_blocks(void *arg, long iterations) {
+    const filter_t *filter = (const filter_t *) arg;
+    // Addresses and host that match nothing, so every table is looked at
+    struct in_addr addresses[2];
+    inet_pton(AF_INET, "192.0.2.10", &addresses[0]);
+    inet_pton(AF_INET, "192.0.2.11", &addresses[1]);
+    for (long i = 0; i < iterations; i++)
+        sink += filter_blocks(filter, "allowed.example.org", addresses, 2);
+}
+
+// What the start of the proxy pays for its filter, a text filter is compiled and an image mapped
+void bench_load_filter(void *arg, long iterations) {
+    const char *path = (const char *) arg;
+    for (long i = 0; i < iterations; i++) {
+        filter_t *filter = load_filter(path);
+        if (filter == NULL)
+            exit(EXIT_FAILURE);
+        sink += filter_fd(filter);
+        close_filter(filter);
+    }
+}
+
+void bench_connection_to_close(void *arg, long iterations) {
+    const char *request = (const char *) arg;
+    size_t len = strlen(request);
+    char buffer[1024];
+    for (long i = 0; i < iterations; i++) {
+        memcpy(buffer, request, len + 1);
+        set_connection_to_close(buffer);
+        sink += buffer[0];
+    }
+}
+
+void bench_error_response(void *arg, long iterations) {
+    (void) arg;
+    char buffer[8 * 1024];
+    for (long i = 0; i < iterations; i++) {
+        generate_error_response(buffer, 404);
+        sink += buffer[9];
+    }
+}
+
+// What a request pays for its two buffers, compare with clearing two arrays on the stack
+void bench_buffer_checkout(void *arg, long iterations) {
+    (void) arg;
+    for (long i = 0; i < iterations; i++) {
+        char *request = checkout_buffer();
+        char *response = checkout_buffer();
+        sink += request[0] + response[0];
+        return_buffer(response);
+        return_buffer(request);
+    }
+}
+
+void bench_stack_buffers(void *arg, long iterations) {
+    (void) arg;
+    char request[8 * 1024], response[8 * 1024];
+    for (long i = 0; i < iterations; i++) {
+        memset(request, 0, sizeof(request));
+        memset(response, 0, sizeof(response));
+        // Keep the compiler from dropping the stores
+        __asm__ volatile("" : : "r"(request), "r"(response) : "memory");
+        sink += request[i & 1023] + response[i & 1023];
+    }
+}
+// --------------------------------------------------------------------------------------//
+
+int main(int argc, char *argv[]) {
+    long max_filter_size = DEFAULT_MAX_FILTER_SIZE;
+    char *endptr;
+
+    if (argc > 3)
+        print_benchmark_usage_and_quit();
+    if (argc > 1) {
+        max_filter_size = strtol(argv[1], &endptr, 10);
+        if (*endptr != '\0' || max_filter_size < 10)
+            print_benchmark_usage_and_quit();
+    }
+    if (argc > 2) {
+        long min_time_ms = strtol(argv[2], &endptr, 10);
+        if (*endptr != '\0' || min_time_ms <= 0)
+            print_benchmark_usage_and_quit();
+        min_time_ns = min_time_ms * 1000000L;
+    }
+
+    printf("{\"benchmarks\": [\n");
+
+    run_timed("validateAndParseRequest", "{}", bench_parse, NULL);
+
+    char text_path[] = "/tmp/microBenchmarkFilterXXXXXX";
+    int text_fd = mkstemp(text_path);
+    if (text_fd < 0) {
+        perror("error: mkstemp\n");
+        exit(EXIT_FAILURE);
+    }
+    close(text_fd);
+    char image_path[sizeof(text_path) + 8];
+    snprintf(image_path, sizeof(image_path), "%s.image", text_path);
+
+    for (long size = 10; size <= max_filter_size; size *= 10) {
+        make_filter((int) size, text_path, image_path);
+        char params[96];
+        snprintf(params, sizeof(params), "{\"filter_size\": %ld, \"format\": \"text\"}", size);
+        run_timed("load_filter", params, bench_load_filter, text_path);
+        snprintf(params, sizeof(params), "{\"filter_size\": %ld, \"format\": \"image\"}", size);
+        run_timed("load_filter", params, bench_load_filter, image_path);
+
+        filter_t *filter = load_filter(image_path);
+        if (filter == NULL)
+            exit(EXIT_FAILURE);
+        snprintf(params, sizeof(params), "{\"filter_size\": %ld}", size);
+        run_timed("filter_blocks", params, bench_filter_blocks, filter);
+        close_filter(filter);
+    }
+    unlink(text_path);
+    unlink(image_path);
+
+    run_timed("set_connection_to_close", "{\"header\": \"keep-alive\"}", bench_connection_to_close,
+              (void *) sample_request);
+    run_timed("set_connection_to_close", "{\"header\": \"close\"}", bench_connection_to_close,
+              (void *) "GET / HTTP/1.1\r\nHost: a.example\r\nConnection: close\r\n\r\n");
+    run_timed("set_connection_to_close", "{\"header\": \"missing\"}", bench_connection_to_close,
+              (void *) "GET / HTTP/1.1\r\nHost: a.example\r\nAccept: */*\r\n\r\n");
+
+    run_timed("generate_error_response", "{\"code\": 404}", bench_error_response, NULL);
+
+    init_buffer_pool(16 * 1024, 64, BUFFER_MEMORY_NORMAL);
+    run_timed("buffer_pool_checkout", "{\"buffers\": 2}", bench_buffer_checkout, NULL);
+    run_timed("memset_stack_buffers", "{\"buffers\": 2}", bench_stack_buffers, NULL);
+    destroy_buffer_pool();
+
+    int pool_sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, MAX_BENCHMARK_THREADS };
+    for (size_t i = 0; i < sizeof(pool_sizes) / sizeof(pool_sizes[0]); i++)
+        bench_threadpool(pool_sizes[i]);
+
+    printf("\n]}\n");
+    return EXIT_SUCCESS;
+}
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void report(const char *name, const char *params, long iterations, double ns_per_op, const char *extra) {
+    printf("%s  {\"name\": \"%s\", \"params\": %s, \"iterations\": %ld, \"ns_per_op\": %.1f%s}",
+           first_result ? "" : ",\n", name, params, iterations, ns_per_op, extra);
+    first_result = false;
+    fflush(stdout);
+}
+
+// Run fn with a growing number of iterations until it takes at least min_time_ns
+void run_timed(const char *name, const char *params, bench_fn fn, void *arg) {
+    long iterations = 1;
+    while (1) {
+        long start = now_ns();
+        fn(arg, iterations);
+        long elapsed = now_ns() - start;
+
+        if (elapsed >= min_time_ns) {
+            report(name, params, iterations, (double) elapsed / (double) iterations, "");
+            return;
+        }
+
+        // Aim a bit past the minimal time, growing at most 100 times per round
+        long next = elapsed > 0 ? (long) ((double) iterations * 1.2 * (double) min_time_ns / (double) elapsed) : iterations * 100;
+        if (next > iterations * 100)
+            next = iterations * 100;
+        iterations = next > iterations ? next : iterations + 1;
+    }
+}
+
+// Half host names, half networks, none of them matching the benchmarked request.
+// Written as a text filter and compiled into an image.
+void make_filter(int size, const char *text_path, const char *image_path) {
+    FILE *file = fopen(text_path, "w");
+    if (file == NULL) {
+        perror("error: open\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < size; i++) {
+        if (i % 2 == 0)
+            fprintf(file, "blocked-%d.example\n", i);
+        else
+            fprintf(file, "10.%d.%d.0/24\n", (i >> 8) & 0xFF, i & 0xFF);
+    }
+    fclose(file);
+
+    size_t image_size;
+    void *image = compile_filter(text_path, &image_size, NULL);
+    if (image == NULL || write_filter_image(image, image_size, image_path) != 0)
+        exit(EXIT_FAILURE);
+    free(image);
+}
+
+//  Threadpool round trips //----------------------------------------------------------//
+static atomic_long jobs_done;
+static sem_t job_finished;
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+int count_job(void *arg) {
+    (void) arg;
+    atomic_fetch_add_explicit(&jobs_done, 1, memory_order_relaxed);
+    return 0;
+}
+
+int signal_job(void *arg) {
+    (void) arg;
+    sem_post(&job_finished);
+    return 0;
+}
+
+// Latency of a single dispatch until the job ran, and throughput of many small jobs
+void bench_threadpool(int num_threads) {
+    threadpool *tp = create_threadpool(num_threads);
+    if (tp == NULL) {
+        fprintf(stderr, "error: create_threadpool\n");
+        exit(EXIT_FAILURE);
+    }
+    sem_init(&job_finished, 0, 0);
+
+    // Round trip: dispatch one job and wait for it
+    long *latencies = malloc(LATENCY_ROUNDS * sizeof(long));
+    if (latencies == NULL) {
+        perror("error: malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    long total = 0;
+    for (int i = 0; i < LATENCY_ROUNDS; i++) {
+        long start = now_ns();
+        dispatch(tp, signal_job, NULL);
+        sem_wait(&job_finished);
+        latencies[i] = now_ns() - start;
+        total += latencies[i];
+    }
+    qsort(latencies, LATENCY_ROUNDS, sizeof(long), compare_longs);
+    long p50 = latencies[LATENCY_ROUNDS / 2];
+    long p99 = latencies[LATENCY_ROUNDS * 99 / 100];
+    free(latencies);
+
+    char params[64], extra[96];
+    snprintf(params, sizeof(params), "{\"threads\": %d}", num_threads);
+    snprintf(extra, sizeof(extra), ", \"p50_ns\": %ld, \"p99_ns\": %ld", p50, p99);
+    report("dispatch_round_trip", params, LATENCY_ROUNDS, (double) total / LATENCY_ROUNDS, extra);
+
+    // Throughput: dispatch many jobs and wait for all of them to run
+    atomic_store(&jobs_done, 0);
+    long start = now_ns();
+    for (int i = 0; i < THROUGHPUT_JOBS; i++)
+        dispatch(tp, count_job, NULL);
+    while (atomic_load(&jobs_done) < THROUGHPUT_JOBS)
+        sched_yield();
+    long elapsed = now_ns() - start;
+
+    snprintf(extra, sizeof(extra), ", \"jobs_per_s\": %.0f", (double) THROUGHPUT_JOBS * 1e9 / (double) elapsed);
+    report("dispatch_throughput", params, THROUGHPUT_JOBS, (double) elapsed / THROUGHPUT_JOBS, extra);
+
+    destroy_threadpool(tp);
+    sem_destroy(&job_finished);
+}
+// --------------------------------------------------------------------------------------//
+
+void print_benchmark_usage_and_quit() {
+    printf("Usage: microBenchmark [max-filter-size] [min-time-ms]\n");
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+// A local origin server for benchmarking the proxy.
+// Every request gets a 200 response with a body of the requested size after the requested delay.
+// The object is chosen by the query string: GET /anything?size=<bytes>&delay=<ms>
+// Without a query string the defaults from the command line are used.
+
+#define REQUEST_BUFFER_SIZE (8*1024)
+#define CHUNK_SIZE (64*1024)
+
+static long default_size = 1024;
+static long default_delay_ms = 0;
+
+// Body bytes, every response is sent from here
+static char body_chunk[CHUNK_SIZE];
+
+void print_usage_error_and_quit();
+void* serve_connection(void *arg);
+long query_value(const char *request, const char *name, long default_value);
+bool send_all(int sockfd, const char *buffer, size_t len);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4)
+        print_usage_error_and_quit();
+
+    char *endptr;
+    long port = strtol(argv[1], &endptr, 10);
+    if (*endptr != '\0' || port <= 0 || port > 65535)
+        print_usage_error_and_quit();
+
+    if (argc > 2) {
+        default_size = strtol(argv[2], &endptr, 10);
+        if (*endptr != '\0' || default_size < 0)
+            print_usage_error_and_quit();
+    }
+    if (argc > 3) {
+        default_delay_ms = strtol(argv[3], &endptr, 10);
+        if (*endptr != '\0' || default_delay_ms < 0)
+            print_usage_error_and_quit();
+    }
+
+    memset(body_chunk, 'x', CHUNK_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("error: socket\n");
+        exit(EXIT_FAILURE);
+    }
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("error: bind\n");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("error: listen\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Thread per connection, the delay of one request must not hold the others
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+
+    while (1) {
+        int client_socket = accept(server_fd, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("error: accept\n");
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection, (void *) (long) client_socket) != 0) {
+            perror("error: pthread_create\n");
+            close(client_socket);
+        }
+    }
+
+    close(server_fd);
+    return EXIT_SUCCESS;
+}
+
+// Answer a single request and close the connection
+void* serve_connection(void *arg) {
+    int client_socket = (int) (long) arg;
+    char request[REQUEST_BUFFER_SIZE];
+    size_t received = 0;
+
+    // Read until the end of the headers
+    while (received < sizeof(request) - 1) {
+        ssize_t n = recv(client_socket, request + received, sizeof(request) - 1 - received, 0);
+        if (n <= 0)
+            break;
+        received += n;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL)
+            break;
+    }
+    request[received] = '\0';
+    if (received == 0) {
+        close(client_socket);
+        return NULL;
+    }
+
+    // Only look at the request line for the query
+    char *end_of_line = strstr(request, "\r\n");
+    if (end_of_line != NULL)
+        *end_of_line = '\0';
+    long size = query_value(request, "size=", default_size);
+    long delay_ms = query_value(request, "delay=", default_delay_ms);
+
+    if (delay_ms > 0) {
+        struct timespec delay = { delay_ms / 1000, (delay_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+
+    char headers[256];
+    int len = snprintf(headers, sizeof(headers),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: %ld\r\n"
+                       "Connection: close\r\n"
+                       "\r\n",
+                       size);
+
+    if (send_all(client_socket, headers, len)) {
+        while (size > 0) {
+            size_t chunk = size < CHUNK_SIZE ? (size_t) size : CHUNK_SIZE;
+            if (!send_all(client_socket, body_chunk, chunk))
+                break;
+            size -= (long) chunk;
+        }
+    }
+
+    close(client_socket);
+    return NULL;
+}
+
+// Get a number from the query string of the request line
+long query_value(const char *request, const char *name, long default_value) {
+    const char *query = strchr(request, '?');
+    if (query == NULL)
+        return default_value;
+
+    const char *found = strstr(query, name);
+    if (found == NULL)
+        return default_value;
+
+    char *endptr;
+    long value = strtol(found + strlen(name), &endptr, 10);
+    if (endptr == found + strlen(name) || value < 0)
+        return default_value;
+    return value;
+}
+
+bool send_all(int sockfd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sockfd, buffer, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+void print_usage_error_and_quit() {
+    printf("Usage: originStub <port> [default-size] [default-delay-ms]\n");
+    exit(EXIT_FAILURE);
+}
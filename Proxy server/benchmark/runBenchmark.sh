@@ -0,0 +1,99 @@
+#!/bin/bash
+# End to end benchmark of the proxy, runs without network access.
+# Starts a local origin server, then for every pool size starts the proxy with a
+# generated filter file and runs the load generator at every concurrency level.
+# Every run prints one line of JSON with its pool size, requests/s, throughput and latencies.
+#
+# Settings (environment variables):
+#   POOL_SIZES        proxy thread pool sizes                (default "4 16 64")
+#   CONCURRENCY       client threads of the load generator   (default "1 16 64")
+#   DURATION          seconds per run                        (default 5)
+#   OBJECT_SIZE       bytes in every response body           (default 16384)
+#   ORIGIN_DELAY_MS   delay of the origin before answering   (default 0)
+#   FILTER_SIZE       lines in the generated filter file     (default 1000)
+#   FILTER_FORMAT     text, or image to compile the filter   (default text)
+#                     with tools/filterCompiler.c first
+#   PROXY_OPTIONS     extra options passed to the proxy      (default none)
+#                     e.g. "--engine=uring" to compare the engines
+#   PROXY_PORT, ORIGIN_PORT                                  (default 18080, 18081)
+
+set -u
+
+POOL_SIZES=${POOL_SIZES:-"4 16 64"}
+CONCURRENCY=${CONCURRENCY:-"1 16 64"}
+DURATION=${DURATION:-5}
+OBJECT_SIZE=${OBJECT_SIZE:-16384}
+ORIGIN_DELAY_MS=${ORIGIN_DELAY_MS:-0}
+FILTER_SIZE=${FILTER_SIZE:-1000}
+FILTER_FORMAT=${FILTER_FORMAT:-text}
+PROXY_OPTIONS=${PROXY_OPTIONS:-}
+PROXY_PORT=${PROXY_PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-18081}
+
+BENCHMARK_DIR=$(cd "$(dirname "$0")" && pwd)
+PROXY_DIR=$(dirname "$BENCHMARK_DIR")
+BUILD_DIR=$(mktemp -d)
+ORIGIN_PID=""
+PROXY_PID=""
+
+cleanup() {
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$BUILD_DIR"
+}
+trap cleanup EXIT
+
+# Wait until something listens on a local port, without connecting to it
+wait_for_port() {
+    local port_hex
+    port_hex=$(printf ":%04X " "$1")
+    for _ in $(seq 1 100); do
+        grep -q "$port_hex[0-9A-F:]* 0A " /proc/net/tcp && return 0
+        sleep 0.05
+    done
+    echo "error: nothing listens on port $1" >&2
+    return 1
+}
+
+# Build everything with the same flags
+CFLAGS="-O2 -Wall -pthread"
+gcc $CFLAGS -o "$BUILD_DIR/proxyServer" "$PROXY_DIR"/*.c || exit 1
+gcc $CFLAGS -o "$BUILD_DIR/originStub" "$BENCHMARK_DIR/originStub.c" || exit 1
+gcc $CFLAGS -o "$BUILD_DIR/loadGenerator" "$BENCHMARK_DIR/loadGenerator.c" || exit 1
+gcc $CFLAGS -o "$BUILD_DIR/filterCompiler" "$PROXY_DIR/tools/filterCompiler.c" "$PROXY_DIR/filter_image.c" || exit 1
+
+# Filter of host names and networks that never match the origin on 127.0.0.1
+FILTER_FILE="$BUILD_DIR/filter.txt"
+for i in $(seq 1 "$FILTER_SIZE"); do
+    if (( i % 2 )); then
+        echo "blocked-$i.example"
+    else
+        echo "10.$(( i / 256 % 256 )).$(( i % 256 )).0/24"
+    fi
+done > "$FILTER_FILE"
+if [ "$FILTER_FORMAT" = "image" ]; then
+    "$BUILD_DIR/filterCompiler" "$FILTER_FILE" "$BUILD_DIR/filter.image" >&2 || exit 1
+    FILTER_FILE="$BUILD_DIR/filter.image"
+fi
+
+"$BUILD_DIR/originStub" "$ORIGIN_PORT" "$OBJECT_SIZE" "$ORIGIN_DELAY_MS" &
+ORIGIN_PID=$!
+wait_for_port "$ORIGIN_PORT" || exit 1
+
+for pool_size in $POOL_SIZES; do
+    # The proxy serves until it is killed
+    # shellcheck disable=SC2086
+    "$BUILD_DIR/proxyServer" "$PROXY_PORT" "$pool_size" 0 "$FILTER_FILE" $PROXY_OPTIONS &
+    PROXY_PID=$!
+    wait_for_port "$PROXY_PORT" || exit 1
+
+    for concurrency in $CONCURRENCY; do
+        "$BUILD_DIR/loadGenerator" "$PROXY_PORT" "127.0.0.1:$ORIGIN_PORT" "$concurrency" "$DURATION" "/object" \
+            | sed "s/^{/{\"pool_size\": $pool_size, \"object_size\": $OBJECT_SIZE, \"origin_delay_ms\": $ORIGIN_DELAY_MS, /"
+    done
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+    PROXY_PID=""
+done
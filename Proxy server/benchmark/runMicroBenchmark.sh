@@ -0,0 +1,13 @@
+#!/bin/bash
+# Builds and runs the microbenchmarks of the proxy, the JSON result goes to stdout.
+# Usage: runMicroBenchmark.sh [max-filter-size] [min-time-ms]
+
+BENCHMARK_DIR=$(cd "$(dirname "$0")" && pwd)
+PROXY_DIR=$(dirname "$BENCHMARK_DIR")
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+gcc -O2 -Wall -pthread -DPROXY_SERVER_NO_MAIN -o "$BUILD_DIR/microBenchmark" \
+    "$BENCHMARK_DIR/microBenchmark.c" "$PROXY_DIR"/*.c || exit 1
+
+"$BUILD_DIR/microBenchmark" "$@"
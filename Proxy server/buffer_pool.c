@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "buffer_pool.h"
+
+// size of the huge pages the slab is rounded up to
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static char *slab = NULL;
+static size_t slab_size = 0;
+static size_t buffer_size = 0;
+static int total_buffers = 0;
+static const char *slab_memory = "normal";
+
+// Stack of the free buffers of the slab
+static char **free_buffers = NULL;
+static int num_free = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_long in_use = 0;
+static atomic_long peak_in_use = 0;
+static atomic_long misses = 0;
+
+//  Private helpers //------------------------------------------------------------------//
+static bool in_slab(const char *buffer) {
+    return slab != NULL && buffer >= slab && buffer < slab + slab_size;
+}
+
+static void count_checkout() {
+    long now_in_use = atomic_fetch_add_explicit(&in_use, 1, memory_order_relaxed) + 1;
+    long peak = atomic_load_explicit(&peak_in_use, memory_order_relaxed);
+    while (now_in_use > peak &&
+           !atomic_compare_exchange_weak_explicit(&peak_in_use, &peak, now_in_use,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// Map the slab, with huge pages when asked and available
+static char* map_slab(size_t size, buffer_memory_t memory) {
+    char *memory_ptr = MAP_FAILED;
+    if (memory == BUFFER_MEMORY_HUGE) {
+        memory_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory_ptr != MAP_FAILED) {
+            slab_memory = "hugetlb";
+            return memory_ptr;
+        }
+    }
+
+    memory_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory_ptr == MAP_FAILED)
+        return NULL;
+
+    // No reserved huge pages, let the kernel back the slab with transparent ones
+    slab_memory = "normal";
+    if (memory == BUFFER_MEMORY_HUGE && madvise(memory_ptr, size, MADV_HUGEPAGE) == 0)
+        slab_memory = "thp";
+    return memory_ptr;
+}
+// --------------------------------------------------------------------------------------//
+
+int init_buffer_pool(size_t size, int count, buffer_memory_t memory) {
+    buffer_size = (size + BUFFER_ALIGNMENT - 1) & ~((size_t) BUFFER_ALIGNMENT - 1);
+    total_buffers = count;
+
+    slab_size = buffer_size * (size_t) count;
+    if (memory == BUFFER_MEMORY_HUGE)
+        slab_size = (slab_size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+
+    free_buffers = malloc((count > 0 ? count : 1) * sizeof(char*));
+    if (free_buffers == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+    slab = count > 0 ? map_slab(slab_size, memory) : NULL;
+    if (count > 0 && slab == NULL) {
+        perror("error: mmap\n");
+        free(free_buffers);
+        free_buffers = NULL;
+        return -1;
+    }
+
+    // The first buffers are handed out first, the rest of the slab stays untouched until needed
+    num_free = 0;
+    for (int i = count - 1; i >= 0; i--)
+        free_buffers[num_free++] = slab + (size_t) i * buffer_size;
+    return 0;
+}
+
+char* checkout_buffer() {
+    char *buffer = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (num_free > 0)
+        buffer = free_buffers[--num_free];
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buffer == NULL) {
+        // The slab is empty, allocate one that is freed when it comes back
+        atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+        buffer = aligned_alloc(BUFFER_ALIGNMENT, buffer_size);
+        if (buffer == NULL) {
+            perror("error: malloc\n");
+            return NULL;
+        }
+    }
+    count_checkout();
+    return buffer;
+}
+
+void return_buffer(char *buffer) {
+    if (buffer == NULL)
+        return;
+    atomic_fetch_sub_explicit(&in_use, 1, memory_order_relaxed);
+
+    if (!in_slab(buffer)) {
+        free(buffer);
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    free_buffers[num_free++] = buffer;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+size_t buffer_pool_buffer_size() {
+    return buffer_size;
+}
+
+void buffer_pool_usage(buffer_pool_usage_t *usage) {
+    usage->buffer_size = buffer_size;
+    usage->total = total_buffers;
+    usage->in_use = atomic_load_explicit(&in_use, memory_order_relaxed);
+    usage->peak_in_use = atomic_load_explicit(&peak_in_use, memory_order_relaxed);
+    usage->misses = atomic_load_explicit(&misses, memory_order_relaxed);
+    usage->memory = slab_memory;
+}
+
+void destroy_buffer_pool() {
+    if (slab != NULL)
+        munmap(slab, slab_size);
+    free(free_buffers);
+    slab = NULL;
+    free_buffers = NULL;
+    num_free = 0;
+    total_buffers = 0;
+}
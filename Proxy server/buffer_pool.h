@@ -0,0 +1,70 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * buffer_pool.h
+ *
+ * A slab of equally sized buffers that the worker threads check out for a
+ * request and return when it is done, instead of zeroing big arrays on the stack
+ * for every request. Buffers are aligned to cache lines and are not cleared
+ * between uses. The slab can be backed by huge pages.
+ *
+ * When every buffer is checked out the pool falls back to malloc and counts a miss,
+ * so a miss costs an allocation but never fails a request.
+ */
+
+#define BUFFER_ALIGNMENT 64
+
+typedef enum {
+    BUFFER_MEMORY_NORMAL,   // regular pages
+    BUFFER_MEMORY_HUGE      // huge pages if the system has them, else transparent huge pages
+} buffer_memory_t;
+
+/**
+ * Usage of the pool for the statistics
+ */
+typedef struct buffer_pool_usage_st {
+    size_t buffer_size;
+    int total;              // buffers in the slab
+    long in_use;            // buffers checked out now, including the fallback ones
+    long peak_in_use;
+    long misses;            // checkouts that had to allocate
+    const char *memory;     // "normal", "hugetlb" or "thp"
+} buffer_pool_usage_t;
+
+
+/**
+ * init_buffer_pool allocates the slab.
+ * @buffer_size - size of every buffer, rounded up to BUFFER_ALIGNMENT
+ * @count - buffers in the slab
+ * @ return value - 0 on success, -1 if the slab could not be allocated
+ */
+int init_buffer_pool(size_t buffer_size, int count, buffer_memory_t memory);
+
+/**
+ * checkout_buffer takes a buffer, its content is whatever the last user left.
+ * @ return value - the buffer, NULL only if the fallback allocation failed
+ */
+char* checkout_buffer();
+
+/**
+ * return_buffer gives a buffer from checkout_buffer back to the pool.
+ */
+void return_buffer(char *buffer);
+
+/**
+ * buffer_pool_buffer_size is the usable size of every buffer.
+ */
+size_t buffer_pool_buffer_size();
+
+void buffer_pool_usage(buffer_pool_usage_t *usage);
+
+/**
+ * destroy_buffer_pool frees the slab, every buffer must have been returned.
+ */
+void destroy_buffer_pool();
+
+#endif //BUFFER_POOL_H
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "coalesce.h"
+#include "proxy_stats.h"
+
+// first allocation of the response of a flight, it doubles from there
+#define INITIAL_FLIGHT_CAPACITY (64*1024)
+
+// seconds the leader waits for a follower that holds the buffer at its limit, then the follower is cut off
+#define FOLLOWER_STALL_TIMEOUT 10
+
+// Where a follower is in the response, on the stack of follow_flight
+typedef struct follower_st {
+    size_t offset;
+    bool cut_off;               // too slow, it ends with what it sent and is no longer in the list
+    struct follower_st *next;
+} follower_t;
+
+struct flight_st {
+    char key[MAX_FLIGHT_KEY];
+    struct flight_st *next;     // chain of the bucket
+
+    // Guarded by table_lock
+    int refs;                   // the leader and the attached followers
+    int attached;               // followers that ever attached, final once the flight left the table
+    bool in_table;              // new followers can still join
+
+    // Guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t grown;       // signalled when data arrives and when the flight finishes
+    pthread_cond_t drained;     // signalled when a follower moves on or detaches
+    char *data;                 // the response from offset start on
+    size_t start, size, capacity;
+    follower_t *followers;      // followers that are reading
+    int started;                // followers that ever started reading
+    bool late_cut_off;          // followers that start reading now are cut off, the start of the response is gone
+    bool storing;               // false once no follower can need the rest of the response
+    bool done;
+    int status;
+};
+
+// Flights in progress, chained per bucket
+static flight_t *flight_table[FLIGHT_TABLE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_flights = 0;
+
+static size_t max_flight_bytes = 64 * 1024 * 1024;
+static atomic_long followers_served = 0;
+
+//  Private helpers //------------------------------------------------------------------//
+static unsigned int hash_key(const char *key) {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (; *key != '\0'; key++)
+        hash = (hash ^ (unsigned char) *key) * 16777619U;
+    return hash & (FLIGHT_TABLE_SIZE - 1);
+}
+
+// Take the flight out of the table so no new follower finds it. Called with table_lock held.
+static void unlink_flight(flight_t *flight) {
+    if (!flight->in_table)
+        return;
+    flight_t **link = &flight_table[hash_key(flight->key)];
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+    flight->in_table = false;
+    num_flights--;
+}
+
+// Drop a reference, the last one frees the flight
+static void leave_flight(flight_t *flight) {
+    pthread_mutex_lock(&table_lock);
+    bool last = --flight->refs == 0;
+    pthread_mutex_unlock(&table_lock);
+    if (!last)
+        return;
+
+    pthread_mutex_destroy(&flight->lock);
+    pthread_cond_destroy(&flight->grown);
+    pthread_cond_destroy(&flight->drained);
+    free(flight->data);
+    free(flight);
+}
+
+// Attach a follower to the flight of a key in the table. Called with table_lock held.
+static flight_t* attach_follower(const char *key, unsigned int bucket) {
+    for (flight_t *flight = flight_table[bucket]; flight != NULL; flight = flight->next) {
+        if (strcmp(flight->key, key) == 0) {
+            flight->refs++;
+            flight->attached++;
+            atomic_fetch_add_explicit(&followers_served, 1, memory_order_relaxed);
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+// Drop the bytes every follower already sent, once no new follower can join. The leader
+// calls it before appending len bytes and the flight is no longer in the table, so attached
+// does not change. Called with lock held.
+static void trim_flight(flight_t *flight, size_t len) {
+    if (flight->started < flight->attached)
+        return;
+    size_t slowest = flight->size;
+    for (follower_t *follower = flight->followers; follower != NULL; follower = follower->next) {
+        if (follower->offset < slowest)
+            slowest = follower->offset;
+    }
+
+    // Moved when at least half of the buffer goes, so every byte is moved at most once on average,
+    // or when the new bytes need the room
+    size_t trimmed = slowest - flight->start;
+    size_t kept = flight->size - slowest;
+    if (trimmed == 0 || (trimmed < kept && flight->size - flight->start + len <= max_flight_bytes))
+        return;
+    memmove(flight->data, flight->data + trimmed, kept);
+    flight->start = slowest;
+}
+
+// Cut off the followers that keep len new bytes from fitting in the limit, and those that did
+// not start reading yet. Called with lock held by the leader, after it waited for them too long.
+static void cut_off_followers(flight_t *flight, size_t len) {
+    size_t needed_start = flight->size + len - max_flight_bytes;
+    for (follower_t **link = &flight->followers; *link != NULL; ) {
+        follower_t *follower = *link;
+        if (follower->offset < needed_start) {
+            follower->cut_off = true;
+            *link = follower->next;
+        } else {
+            link = &follower->next;
+        }
+    }
+    flight->late_cut_off = true;
+    flight->attached = flight->started;
+}
+
+// Check for a header name at the start of a line, ignoring case
+static bool has_header(const char *request, const char *name) {
+    const char *end_of_headers = strstr(request, "\r\n\r\n");
+    const char *found = strcasestr(request, name);
+    return found != NULL && (end_of_headers == NULL || found < end_of_headers);
+}
+// --------------------------------------------------------------------------------------//
+
+void init_coalescing(size_t max_bytes) {
+    max_flight_bytes = max_bytes;
+}
+
+bool can_coalesce(const char *request) {
+    return !has_header(request, "\r\nCookie:") && !has_header(request, "\r\nAuthorization:") &&
+           !has_header(request, "\r\nRange:") && !has_header(request, "\r\nIf-None-Match:") &&
+           !has_header(request, "\r\nIf-Modified-Since:");
+}
+
+flight_t* join_flight(const char *key, bool *is_leader) {
+    unsigned int bucket = hash_key(key);
+
+    pthread_mutex_lock(&table_lock);
+    flight_t *existing = attach_follower(key, bucket);
+    if (existing != NULL) {
+        pthread_mutex_unlock(&table_lock);
+        *is_leader = false;
+        return existing;
+    }
+
+    // Nobody fetches the key, the caller leads a new flight
+    flight_t *flight = calloc(1, sizeof(flight_t));
+    if (flight == NULL) {
+        pthread_mutex_unlock(&table_lock);
+        perror("error: malloc\n");
+        return NULL;
+    }
+    snprintf(flight->key, sizeof(flight->key), "%s", key);
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->grown, NULL);
+    pthread_cond_init(&flight->drained, NULL);
+    flight->refs = 1;
+    flight->in_table = true;
+    flight->storing = true;
+    flight->status = 200;
+    flight->next = flight_table[bucket];
+    flight_table[bucket] = flight;
+    num_flights++;
+    pthread_mutex_unlock(&table_lock);
+
+    *is_leader = true;
+    return flight;
+}
+
+flight_t* join_flight_in_progress(const char *key) {
+    pthread_mutex_lock(&table_lock);
+    flight_t *flight = attach_follower(key, hash_key(key));
+    pthread_mutex_unlock(&table_lock);
+    return flight;
+}
+
+void flight_append(flight_t *flight, const char *data, size_t len) {
+    // A long response closes the flight, the followers that are attached still get all of it
+    if (flight->size + len > max_flight_bytes && flight->in_table) {
+        pthread_mutex_lock(&table_lock);
+        unlink_flight(flight);
+        bool has_followers = flight->refs > 1;
+        pthread_mutex_unlock(&table_lock);
+        if (!has_followers) {
+            pthread_mutex_lock(&flight->lock);
+            flight->storing = false;
+            pthread_mutex_unlock(&flight->lock);
+        }
+    }
+    if (!flight->storing)
+        return;
+
+    pthread_mutex_lock(&flight->lock);
+    // Out of the table only the followers that are attached need the response, it is kept
+    // from the slowest one on and the leader waits for it rather than going over the limit.
+    // A follower whose client stops reading must not hold the leader, it is cut off after a while
+    if (!flight->in_table) {
+        trim_flight(flight, len);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FOLLOWER_STALL_TIMEOUT;
+        while (flight->size > flight->start && flight->size - flight->start + len > max_flight_bytes &&
+               (flight->followers != NULL || flight->started < flight->attached)) {
+            if (pthread_cond_timedwait(&flight->drained, &flight->lock, &deadline) == ETIMEDOUT) {
+                cut_off_followers(flight, len);
+                pthread_cond_broadcast(&flight->grown);
+            }
+            trim_flight(flight, len);
+        }
+    }
+    size_t buffered = flight->size - flight->start;
+    if (buffered + len > flight->capacity) {
+        size_t capacity = flight->capacity == 0 ? INITIAL_FLIGHT_CAPACITY : flight->capacity;
+        while (capacity < buffered + len)
+            capacity *= 2;
+        char *data_copy = realloc(flight->data, capacity);
+        if (data_copy == NULL) {
+            // The followers get a cut off response rather than the leader failing
+            perror("error: malloc\n");
+            flight->storing = false;
+            flight->done = true;
+            pthread_cond_broadcast(&flight->grown);
+            pthread_mutex_unlock(&flight->lock);
+            return;
+        }
+        flight->data = data_copy;
+        flight->capacity = capacity;
+    }
+    memcpy(flight->data + buffered, data, len);
+    flight->size += len;
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+bool flight_keep_fetching(flight_t *flight) {
+    // Decided under the table lock, so no follower can join after the answer is no
+    pthread_mutex_lock(&table_lock);
+    bool has_followers = flight->refs > 1;
+    if (!has_followers)
+        unlink_flight(flight);
+    pthread_mutex_unlock(&table_lock);
+    return has_followers;
+}
+
+void finish_flight(flight_t *flight, int status) {
+    pthread_mutex_lock(&table_lock);
+    unlink_flight(flight);
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&flight->lock);
+    flight->done = true;
+    flight->status = status;
+    pthread_cond_broadcast(&flight->grown);
+    pthread_mutex_unlock(&flight->lock);
+
+    leave_flight(flight);
+}
+
+int follow_flight(flight_t *flight, int client_socket, char *buffer, size_t buffer_size, long *bytes_sent) {
+    follower_t self = { 0, false, NULL };
+    *bytes_sent = 0;
+
+    // The flight keeps the response from the slowest reading follower on
+    pthread_mutex_lock(&flight->lock);
+    if (flight->late_cut_off) {
+        self.cut_off = true;
+    } else {
+        self.next = flight->followers;
+        flight->followers = &self;
+        flight->started++;
+        pthread_cond_signal(&flight->drained);
+    }
+    while (!self.cut_off) {
+        while (self.offset == flight->size && !flight->done && !self.cut_off)
+            pthread_cond_wait(&flight->grown, &flight->lock);
+        if (self.offset == flight->size || self.cut_off)
+            break;
+
+        // Copy the next chunk and send it without holding the lock
+        size_t len = flight->size - self.offset < buffer_size ? flight->size - self.offset : buffer_size;
+        memcpy(buffer, flight->data + (self.offset - flight->start), len);
+        pthread_mutex_unlock(&flight->lock);
+
+        stats_syscalls(1);
+        ssize_t sent = send(client_socket, buffer, len, MSG_NOSIGNAL);
+        pthread_mutex_lock(&flight->lock);
+        if (sent <= 0 || self.cut_off)
+            break;
+        self.offset += (size_t) sent;
+        *bytes_sent += sent;
+        pthread_cond_signal(&flight->drained);
+    }
+    // Nothing arrived, the follower answers the status of the leader, or 500 if it was cut off
+    int status = 200;
+    if (self.offset == 0 && self.cut_off)
+        status = 500;
+    else if (self.offset == 0 && flight->done && flight->status != 200)
+        status = flight->status;
+    if (!self.cut_off) {
+        follower_t **link = &flight->followers;
+        while (*link != &self)
+            link = &(*link)->next;
+        *link = self.next;
+        pthread_cond_signal(&flight->drained);
+    }
+    pthread_mutex_unlock(&flight->lock);
+
+    leave_flight(flight);
+    return status;
+}
+
+long coalesced_requests() {
+    return atomic_load_explicit(&followers_served, memory_order_relaxed);
+}
+
+int flights_in_progress() {
+    pthread_mutex_lock(&table_lock);
+    int count = num_flights;
+    pthread_mutex_unlock(&table_lock);
+    return count;
+}
@@ -0,0 +1,100 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * coalesce.h
+ *
+ * Collapsed forwarding: concurrent GET requests for the same host and path share
+ * one fetch from the server.
+ *
+ * The first request becomes the leader of a flight. It connects to the server as
+ * usual and appends every chunk it receives to the flight. Requests for the same
+ * key that arrive while the flight is in progress become followers: they get the
+ * bytes received so far and then every new chunk as it arrives, until the leader
+ * finishes. If the client of the leader goes away, the leader keeps fetching as
+ * long as followers are attached. A follower that goes away only detaches.
+ *
+ * The flight is removed from the table when the leader finishes, so requests
+ * that come later fetch again. Once a flight left the table it keeps only the part
+ * of the response the slowest follower has not sent yet, at most max_bytes of it,
+ * and the leader waits for the followers beyond that. A follower still behind after
+ * FOLLOWER_STALL_TIMEOUT seconds is cut off and ends with what it sent. Only the thread
+ * engine coalesces.
+ */
+
+// buckets of the flight table, must be a power of 2
+#define FLIGHT_TABLE_SIZE 1024
+
+// longest key, host with port and path
+#define MAX_FLIGHT_KEY 1024
+
+typedef struct flight_st flight_t;
+
+
+/**
+ * init_coalescing sets how much of a response a flight keeps for its followers.
+ * @max_bytes - once a response is longer, no new followers can join the flight,
+ *   and the flight keeps at most that much of it for the followers that are attached
+ */
+void init_coalescing(size_t max_bytes);
+
+/**
+ * can_coalesce checks that the response to a request does not depend on the client,
+ * requests with Cookie, Authorization, Range or conditional headers are fetched on their own.
+ */
+bool can_coalesce(const char *request);
+
+/**
+ * join_flight attaches to the flight of a key, or starts one.
+ * @is_leader - set to true if the caller started the flight and must fetch
+ * @ return value - the flight, NULL if it could not be allocated
+ */
+flight_t* join_flight(const char *key, bool *is_leader);
+
+/**
+ * join_flight_in_progress attaches to the flight of a key as a follower, it never starts one.
+ * @ return value - the flight, NULL if nobody fetches the key
+ */
+flight_t* join_flight_in_progress(const char *key);
+
+/**
+ * flight_append passes a chunk of the response from the leader to the followers.
+ */
+void flight_append(flight_t *flight, const char *data, size_t len);
+
+/**
+ * flight_keep_fetching is asked by a leader whose client went away.
+ * @ return value - true if followers still wait for the response, false if the flight
+ *   was closed to new followers and the leader can stop
+ */
+bool flight_keep_fetching(flight_t *flight);
+
+/**
+ * finish_flight ends the fetch and detaches the leader. The followers of a fetch that
+ * was cut off get the bytes that arrived and are closed.
+ * @status - status of the fetch, the followers answer it themselves if no byte arrived
+ */
+void finish_flight(flight_t *flight, int status);
+
+/**
+ * follow_flight sends the response of the flight to a follower's client and detaches it.
+ * @buffer - buffer of the follower, the chunks are copied into it before sending
+ * @bytes_sent - bytes sent to the client
+ * @ return value - status of the flight, if it is not 200 nothing was sent
+ */
+int follow_flight(flight_t *flight, int client_socket, char *buffer, size_t buffer_size, long *bytes_sent);
+
+/**
+ * coalesced_requests counts the requests that were served as followers.
+ */
+long coalesced_requests();
+
+/**
+ * flights_in_progress counts the flights whose leader is still fetching.
+ */
+int flights_in_progress();
+
+#endif //COALESCE_H
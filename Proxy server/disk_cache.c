@@ -0,0 +1,818 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "disk_cache.h"
+#include "proxy_stats.h"
+
+#define INDEX_MAGIC 0x50434348
+#define INDEX_VERSION 2
+
+// entries compared when the cache is full, the least recently used one is evicted
+#define EVICTION_SAMPLES 16
+
+// part of max_bytes a single object may take
+#define MAX_OBJECT_SHARE 8
+
+// a background revalidation that did not finish in time is started again
+#define REVALIDATE_TIMEOUT 30
+
+// header names longer than this are never replaced by a 304
+#define MAX_HEADER_NAME 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t unused;
+    uint64_t next_file_id;
+    int64_t objects;
+    int64_t bytes;
+    char reserved[512 - 40];    // the entries start on their own cache lines
+} index_header_t;
+
+// What the headers of a response say about storing it
+typedef struct {
+    int64_t size;
+    int32_t header_len;
+    long ttl;                   // seconds it is fresh
+    long stale;                 // seconds after that it may be sent while it is revalidated
+    char etag[CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+} object_info_t;
+
+// Where a chunked body is, its end is the empty line after the last chunk of size 0
+typedef enum {
+    CHUNK_SIZE,                 // hex digits of the size
+    CHUNK_SIZE_LINE,            // extensions after the size, up to the end of the line
+    CHUNK_DATA,
+    CHUNK_DATA_END,             // the line end after the data
+    CHUNK_TRAILER,              // lines after the last chunk, up to an empty one
+    CHUNK_DONE
+} chunk_state_t;
+
+struct cache_writer_st {
+    int fd;                     // unnamed file, -1 until the headers were checked
+    uint64_t hash;
+    object_info_t info;
+    bool parsed;                // the headers of the first chunk were checked
+    int64_t body_expected;      // bytes of the body from Content-Length, -1 if it has none
+    int64_t body_received;
+    bool chunked;               // the body ends with its last chunk instead
+    chunk_state_t chunk_state;
+    int64_t chunk_left;         // bytes of the size, data or trailer line seen so far
+    bool skip;                  // the response is not stored
+    bool revalidating;          // the request carried the validators of stale_object
+    bool not_modified;          // the server answered the revalidation with 304
+    cache_validators_t stale_object;
+    int stale_fd;               // file of stale_object, opened when the revalidation started
+    int64_t stale_size;
+    size_t stale_header_len;
+    char *not_modified_headers; // headers of the 304
+    size_t not_modified_len;
+    char *merged_headers;       // stored headers refreshed by the 304
+    size_t merged_len;
+    char key[CACHE_KEY_SIZE];
+};
+
+static int dir_fd = -1;
+static int index_fd = -1;
+static index_header_t *header = NULL;
+static cache_entry_t *entries = NULL;
+static size_t index_size = 0;
+static long max_cache_bytes = 0;
+static long fresh_for = 0;
+static long stale_for = 0;
+
+// Threads take the mutex, processes sharing the directory the flock of the index
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_long hits = 0;
+static atomic_long misses = 0;
+static atomic_long stores = 0;
+static atomic_long evictions = 0;
+static atomic_long stale_hits = 0;
+static atomic_long revalidations = 0;
+static atomic_long not_modified = 0;
+static atomic_uint eviction_cursor = 0;
+
+//  Private helpers //------------------------------------------------------------------//
+static void lock_index() {
+    pthread_mutex_lock(&index_lock);
+    flock(index_fd, LOCK_EX);
+    stats_syscalls(1);
+}
+
+static void unlock_index() {
+    flock(index_fd, LOCK_UN);
+    stats_syscalls(1);
+    pthread_mutex_unlock(&index_lock);
+}
+
+static uint64_t hash_key(const char *key) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key != '\0'; key++)
+        hash = (hash ^ (unsigned char) *key) * 1099511628211ULL;
+    return hash;
+}
+
+static void object_name(uint64_t file_id, char *name, size_t size) {
+    snprintf(name, size, "%016llx", (unsigned long long) file_id);
+}
+
+// Find the entry of a key, NULL if it is not cached. Called with the lock held.
+static cache_entry_t* find_entry(const char *key, uint64_t hash) {
+    for (uint32_t i = 0; i < CACHE_PROBE_LENGTH; i++) {
+        cache_entry_t *entry = &entries[(hash + i) % header->capacity];
+        if (entry->file_id != 0 && entry->hash == hash && strcmp(entry->key, key) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Remove an entry and its file. Called with the lock held.
+static void remove_entry(cache_entry_t *entry) {
+    char name[32];
+    object_name(entry->file_id, name, sizeof(name));
+    unlinkat(dir_fd, name, 0);
+    header->objects--;
+    header->bytes -= entry->size;
+    entry->file_id = 0;
+}
+
+static void evict_entry(cache_entry_t *entry) {
+    remove_entry(entry);
+    atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+}
+
+// Evict the least recently used of a few entries from a rotating place. Called with the lock held.
+static bool evict_sampled() {
+    uint32_t start = atomic_fetch_add_explicit(&eviction_cursor, 2654435761U, memory_order_relaxed) % header->capacity;
+    cache_entry_t *victim = NULL;
+    int sampled = 0;
+    for (uint32_t i = 0; i < header->capacity && sampled < EVICTION_SAMPLES; i++) {
+        cache_entry_t *entry = &entries[(start + i) % header->capacity];
+        if (entry->file_id == 0)
+            continue;
+        sampled++;
+        if (victim == NULL || entry->last_used < victim->last_used)
+            victim = entry;
+    }
+    if (victim == NULL)
+        return false;
+    evict_entry(victim);
+    return true;
+}
+
+// Find the slot for a new object of a key, evicting what it replaces. Called with the lock held.
+static cache_entry_t* claim_entry(const char *key, uint64_t hash) {
+    cache_entry_t *entry = find_entry(key, hash);
+    if (entry != NULL) {
+        remove_entry(entry);
+        return entry;
+    }
+    cache_entry_t *oldest = NULL;
+    for (uint32_t i = 0; i < CACHE_PROBE_LENGTH; i++) {
+        entry = &entries[(hash + i) % header->capacity];
+        if (entry->file_id == 0)
+            return entry;
+        if (oldest == NULL || entry->last_used < oldest->last_used)
+            oldest = entry;
+    }
+    // The neighbourhood is full, forget its least recently used object
+    evict_entry(oldest);
+    return oldest;
+}
+
+// Find a header of the response, the value is not terminated
+static const char* find_header(const char *headers, size_t len, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    const char *end = headers + len;
+    const char *line = memchr(headers, '\n', len);
+    while (line != NULL && ++line < end) {
+        const char *line_end = memchr(line, '\r', end - line);
+        if (line_end == NULL)
+            line_end = end;
+        if ((size_t) (line_end - line) > name_len && strncasecmp(line, name, name_len) == 0) {
+            const char *value = line + name_len;
+            while (value < line_end && *value == ' ')
+                value++;
+            *value_len = line_end - value;
+            return value;
+        }
+        line = memchr(line, '\n', end - line);
+    }
+    return NULL;
+}
+
+// Read a "name=<seconds>" directive of Cache-Control, -1 if it is missing
+static long directive_seconds(const char *cache_control, const char *name) {
+    const char *found = strcasestr(cache_control, name);
+    if (found == NULL || (found != cache_control && found[-1] != ' ' && found[-1] != ','))
+        return -1;
+    return strtol(found + strlen(name), NULL, 10);
+}
+
+// Copy the value of a header, empty if it is missing or does not fit
+static void copy_header(const char *headers, size_t len, const char *name, char *dest, size_t dest_size) {
+    size_t value_len;
+    const char *value = find_header(headers, len, name, &value_len);
+    if (value == NULL || value_len >= dest_size)
+        value_len = 0;
+    if (value_len > 0)
+        memcpy(dest, value, value_len);
+    dest[value_len] = '\0';
+}
+
+// Status code of a response, 0 if the status line is not complete
+static int response_status(const char *data, size_t len) {
+    if (len < 12 || memcmp(data, "HTTP/1.", 7) != 0 || data[8] != ' ')
+        return 0;
+    return atoi(data + 9);
+}
+
+// Read from the headers of a response if it may be shared, how long it stays fresh and its validators
+static bool read_object_info(const char *headers, size_t headers_len, object_info_t *info) {
+    // Responses for one client, or that differ by request headers the key ignores
+    size_t value_len;
+    if (find_header(headers, headers_len, "Set-Cookie:", &value_len) != NULL ||
+        find_header(headers, headers_len, "Vary:", &value_len) != NULL)
+        return false;
+
+    info->header_len = (int32_t) headers_len;
+    info->ttl = fresh_for;
+    info->stale = stale_for;
+    const char *value = find_header(headers, headers_len, "Cache-Control:", &value_len);
+    if (value != NULL) {
+        char cache_control[256];
+        snprintf(cache_control, sizeof(cache_control), "%.*s", (int) value_len, value);
+        if (strcasestr(cache_control, "no-store") != NULL || strcasestr(cache_control, "private") != NULL ||
+            strcasestr(cache_control, "no-cache") != NULL)
+            return false;
+        long max_age = directive_seconds(cache_control, "s-maxage=");
+        if (max_age < 0)
+            max_age = directive_seconds(cache_control, "max-age=");
+        if (max_age >= 0)
+            info->ttl = max_age;
+        long stale = directive_seconds(cache_control, "stale-while-revalidate=");
+        if (stale >= 0)
+            info->stale = stale;
+        if (strcasestr(cache_control, "must-revalidate") != NULL)
+            info->stale = 0;
+    }
+    copy_header(headers, headers_len, "ETag:", info->etag, sizeof(info->etag));
+    copy_header(headers, headers_len, "Last-Modified:", info->last_modified, sizeof(info->last_modified));
+    return info->ttl > 0;
+}
+
+// Next line of a header block, the line is not terminated
+static const char* next_line(const char *line, const char *end, size_t *line_len) {
+    const char *line_end = memmem(line, end - line, "\r\n", 2);
+    if (line_end == NULL)
+        line_end = end;
+    *line_len = line_end - line;
+    return line_end + 2 <= end ? line_end + 2 : end;
+}
+
+// Headers that describe the stored body keep their stored value
+static bool updatable_header(const char *line) {
+    return strncasecmp(line, "Content-Length:", 15) != 0 && strncasecmp(line, "Transfer-Encoding:", 18) != 0 &&
+           strncasecmp(line, "Content-Encoding:", 17) != 0 && strncasecmp(line, "Connection:", 11) != 0 &&
+           strncasecmp(line, "Keep-Alive:", 11) != 0;
+}
+
+// Replace the stored headers with those of a 304, merged must hold stored_len + update_len bytes
+static size_t merge_headers(const char *stored, size_t stored_len, const char *update, size_t update_len, char *merged) {
+    const char *stored_end = stored + stored_len, *update_end = update + update_len;
+    size_t len = 0, line_len;
+
+    // The status line of the stored response stays
+    const char *line = stored;
+    const char *next = next_line(line, stored_end, &line_len);
+    memcpy(merged, line, line_len);
+    len += line_len;
+    memcpy(merged + len, "\r\n", 2);
+    len += 2;
+
+    for (line = next; line < stored_end; line = next) {
+        next = next_line(line, stored_end, &line_len);
+        if (line_len == 0)
+            break;
+
+        // Leave out a stored header the 304 replaces
+        const char *colon = memchr(line, ':', line_len);
+        char name[MAX_HEADER_NAME + 2];
+        size_t value_len;
+        if (colon != NULL && colon - line <= MAX_HEADER_NAME && updatable_header(line)) {
+            snprintf(name, sizeof(name), "%.*s", (int) (colon - line + 1), line);
+            if (find_header(update, update_len, name, &value_len) != NULL)
+                continue;
+        }
+        memcpy(merged + len, line, line_len);
+        len += line_len;
+        memcpy(merged + len, "\r\n", 2);
+        len += 2;
+    }
+
+    // Add the headers of the 304, after its status line
+    for (line = next_line(update, update_end, &line_len); line < update_end; line = next) {
+        next = next_line(line, update_end, &line_len);
+        if (line_len == 0)
+            break;
+        if (!updatable_header(line))
+            continue;
+        memcpy(merged + len, line, line_len);
+        len += line_len;
+        memcpy(merged + len, "\r\n", 2);
+        len += 2;
+    }
+    memcpy(merged + len, "\r\n", 2);
+    return len + 2;
+}
+
+// Name an unnamed file and make it the object of a key. A refresh only replaces
+// the object it was made from, another request may have stored a new one meanwhile.
+static bool publish_object(int fd, const char *key, uint64_t hash, const object_info_t *info, uint64_t replaces) {
+    int64_t now = time(NULL);
+    char name[32], fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    bool published = false;
+
+    lock_index();
+    cache_entry_t *entry = find_entry(key, hash);
+    if (replaces == 0 || (entry != NULL && entry->file_id == replaces)) {
+        uint64_t file_id = header->next_file_id++;
+        object_name(file_id, name, sizeof(name));
+
+        // Give the file its name, it becomes visible only through the entry below
+        if (linkat(AT_FDCWD, fd_path, dir_fd, name, AT_SYMLINK_FOLLOW) != 0) {
+            perror("error: linkat\n");
+        } else {
+            while (header->bytes + info->size > max_cache_bytes && evict_sampled())
+                ;
+            entry = claim_entry(key, hash);
+            entry->hash = hash;
+            entry->size = info->size;
+            entry->header_len = info->header_len;
+            entry->stored_at = now;
+            entry->expires_at = now + info->ttl;
+            entry->stale_until = entry->expires_at + info->stale;
+            entry->revalidating_until = 0;
+            entry->last_used = now;
+            snprintf(entry->etag, sizeof(entry->etag), "%s", info->etag);
+            snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", info->last_modified);
+            snprintf(entry->key, sizeof(entry->key), "%s", key);
+            // The file id makes the entry valid, it is written last
+            entry->file_id = file_id;
+            header->objects++;
+            header->bytes += info->size;
+            published = true;
+        }
+    }
+    unlock_index();
+    stats_syscalls(1);
+    return published;
+}
+
+// Copy bytes between files inside the kernel
+static bool copy_file(int from_fd, off_t offset, int to_fd, size_t len) {
+    while (len > 0) {
+        stats_syscalls(1);
+        ssize_t copied = copy_file_range(from_fd, &offset, to_fd, NULL, len, 0);
+        // Older kernels and some file systems can't, sendfile copies in the kernel too
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            copied = sendfile(to_fd, from_fd, &offset, len);
+        if (copied <= 0)
+            return false;
+        len -= (size_t) copied;
+    }
+    return true;
+}
+
+// Merge the stored headers of the stale object with those of the 304, once
+static bool merge_stale_headers(cache_writer_t *writer) {
+    if (writer->merged_headers != NULL)
+        return true;
+    char *stored_headers = malloc(writer->stale_header_len);
+    writer->merged_headers = malloc(writer->stale_header_len + writer->not_modified_len);
+    bool merged = stored_headers != NULL && writer->merged_headers != NULL &&
+                  pread(writer->stale_fd, stored_headers, writer->stale_header_len, 0) == (ssize_t) writer->stale_header_len;
+    stats_syscalls(1);
+    if (merged) {
+        writer->merged_len = merge_headers(stored_headers, writer->stale_header_len, writer->not_modified_headers,
+                                           writer->not_modified_len, writer->merged_headers);
+    } else {
+        free(writer->merged_headers);
+        writer->merged_headers = NULL;
+    }
+    free(stored_headers);
+    return merged;
+}
+
+// Make a new object from the stored body and the headers refreshed by a 304.
+// The stale file was opened when the revalidation started, so its body is there even
+// if the object was evicted or replaced meanwhile, then only the new object is not published.
+static void refresh_object(cache_writer_t *writer) {
+    if (!merge_stale_headers(writer))
+        return;
+
+    // The 304 may change whether and for how long the object can be shared
+    object_info_t info;
+    memset(&info, 0, sizeof(info));
+    size_t body_len = (size_t) writer->stale_size - writer->stale_header_len;
+    if (!read_object_info(writer->merged_headers, writer->merged_len, &info))
+        return;
+    info.size = (int64_t) (writer->merged_len + body_len);
+    int fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd >= 0 && write(fd, writer->merged_headers, writer->merged_len) == (ssize_t) writer->merged_len &&
+        copy_file(writer->stale_fd, (off_t) writer->stale_header_len, fd, body_len))
+        publish_object(fd, writer->key, writer->hash, &info, writer->stale_object.file_id);
+    stats_syscalls(2);
+    if (fd >= 0)
+        close(fd);
+}
+// Read how the server marks the end of the body, without either header it ends with the connection
+static void read_body_length(cache_writer_t *writer, const char *headers, size_t headers_len) {
+    size_t value_len;
+    writer->body_expected = -1;
+    const char *value = find_header(headers, headers_len, "Transfer-Encoding:", &value_len);
+    if (value != NULL && memmem(value, value_len, "chunked", 7) != NULL) {
+        writer->chunked = true;
+        writer->chunk_state = CHUNK_SIZE;
+        return;
+    }
+    value = find_header(headers, headers_len, "Content-Length:", &value_len);
+    if (value != NULL)
+        writer->body_expected = strtoll(value, NULL, 10);
+}
+
+// Follow a chunked body up to its last chunk, only the sizes and line ends are looked at
+static void follow_chunks(cache_writer_t *writer, const char *data, size_t len) {
+    for (size_t i = 0; i < len && writer->chunk_state != CHUNK_DONE; i++) {
+        char c = data[i];
+        switch (writer->chunk_state) {
+            case CHUNK_SIZE:
+                if (isxdigit((unsigned char) c)) {
+                    int digit = isdigit((unsigned char) c) ? c - '0' : tolower((unsigned char) c) - 'a' + 10;
+                    writer->chunk_left = writer->chunk_left * 16 + digit;
+                    break;
+                }
+                writer->chunk_state = CHUNK_SIZE_LINE;
+                // fall through
+            case CHUNK_SIZE_LINE:
+                if (c != '\n')
+                    break;
+                writer->chunk_state = writer->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+            case CHUNK_DATA: {
+                size_t taken = len - i < (size_t) writer->chunk_left ? len - i : (size_t) writer->chunk_left;
+                writer->chunk_left -= (int64_t) taken;
+                i += taken - 1;
+                if (writer->chunk_left == 0)
+                    writer->chunk_state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (c == '\n')
+                    writer->chunk_state = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER:
+                // chunk_left counts the bytes of the trailer line before its line end
+                if (c == '\n') {
+                    if (writer->chunk_left == 0)
+                        writer->chunk_state = CHUNK_DONE;
+                    writer->chunk_left = 0;
+                } else if (c != '\r') {
+                    writer->chunk_left++;
+                }
+                break;
+            case CHUNK_DONE:
+                break;
+        }
+    }
+}
+
+// The body arrived up to the end the server declared
+static bool body_complete(const cache_writer_t *writer) {
+    if (writer->chunked)
+        return writer->chunk_state == CHUNK_DONE;
+    return writer->body_expected < 0 || writer->body_received == writer->body_expected;
+}
+// --------------------------------------------------------------------------------------//
+
+int init_disk_cache(const char *dir, int num_entries, long max_bytes, long default_ttl, long default_stale) {
+    max_cache_bytes = max_bytes;
+    fresh_for = default_ttl;
+    stale_for = default_stale;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        perror("error: mkdir\n");
+        return -1;
+    }
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        perror("error: open\n");
+        return -1;
+    }
+    index_fd = openat(dir_fd, "index", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (index_fd < 0) {
+        perror("error: open\n");
+        close_disk_cache();
+        return -1;
+    }
+
+    // A process serving from the directory must not see the index change size
+    flock(index_fd, LOCK_EX);
+    index_size = sizeof(index_header_t) + (size_t) num_entries * sizeof(cache_entry_t);
+    struct stat index_stat;
+    bool reset = fstat(index_fd, &index_stat) != 0 || (size_t) index_stat.st_size != index_size;
+    if (reset && (ftruncate(index_fd, 0) != 0 || ftruncate(index_fd, (off_t) index_size) != 0)) {
+        perror("error: ftruncate\n");
+        flock(index_fd, LOCK_UN);
+        close_disk_cache();
+        return -1;
+    }
+    void *mapped = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror("error: mmap\n");
+        flock(index_fd, LOCK_UN);
+        close_disk_cache();
+        return -1;
+    }
+    header = mapped;
+    entries = (cache_entry_t *) (header + 1);
+
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || header->capacity != (uint32_t) num_entries) {
+        // New or foreign index, the object files it named are orphans now
+        memset(mapped, 0, index_size);
+        header->magic = INDEX_MAGIC;
+        header->version = INDEX_VERSION;
+        header->capacity = (uint32_t) num_entries;
+        header->next_file_id = 1;
+    }
+
+    // Count what the last run left, only the index is read
+    header->objects = 0;
+    header->bytes = 0;
+    for (int i = 0; i < num_entries; i++) {
+        if (entries[i].file_id != 0) {
+            header->objects++;
+            header->bytes += entries[i].size;
+        }
+    }
+    flock(index_fd, LOCK_UN);
+
+    printf("disk cache: %ld objects, %ld bytes in %s\n", (long) header->objects, (long) header->bytes, dir);
+    return 0;
+}
+
+bool disk_cache_enabled() {
+    return header != NULL;
+}
+
+cache_result_t cache_serve(const char *key, int client_socket, long *bytes_sent, cache_validators_t *validators) {
+    uint64_t hash = hash_key(key);
+    int64_t size = 0;
+    int64_t now = time(NULL);
+    cache_result_t result = CACHE_MISS;
+    *bytes_sent = 0;
+
+    lock_index();
+    cache_entry_t *entry = find_entry(key, hash);
+    if (entry != NULL) {
+        if (now < entry->expires_at) {
+            result = CACHE_HIT;
+        } else if (now < entry->stale_until) {
+            // The first request after the object went stale revalidates it for the others
+            result = now < entry->revalidating_until ? CACHE_STALE : CACHE_REVALIDATE;
+            if (result == CACHE_REVALIDATE)
+                entry->revalidating_until = now + REVALIDATE_TIMEOUT;
+        } else if (entry->etag[0] != '\0' || entry->last_modified[0] != '\0') {
+            result = CACHE_EXPIRED;
+        }
+    }
+    if (result != CACHE_MISS) {
+        validators->file_id = entry->file_id;
+        snprintf(validators->etag, sizeof(validators->etag), "%s", entry->etag);
+        snprintf(validators->last_modified, sizeof(validators->last_modified), "%s", entry->last_modified);
+        size = entry->size;
+        entry->last_used = now;
+    }
+    unlock_index();
+
+    // An object evicted since the lookup can't be opened, that is a miss too
+    char name[32];
+    object_name(validators->file_id, name, sizeof(name));
+    int fd = result != CACHE_MISS && result != CACHE_EXPIRED ? openat(dir_fd, name, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+        return result == CACHE_EXPIRED ? CACHE_EXPIRED : CACHE_MISS;
+    }
+    atomic_fetch_add_explicit(result == CACHE_HIT ? &hits : &stale_hits, 1, memory_order_relaxed);
+
+    // The kernel copies the response from the page cache to the socket
+    off_t offset = 0;
+    long syscalls = 2;
+    while (offset < size) {
+        syscalls++;
+        if (sendfile(client_socket, fd, &offset, (size_t) (size - offset)) <= 0)
+            break;
+    }
+    close(fd);
+    stats_syscalls(syscalls);
+    *bytes_sent = (long) offset;
+    return result;
+}
+
+cache_writer_t* cache_begin(const char *key, const cache_validators_t *revalidating) {
+    if (strlen(key) >= CACHE_KEY_SIZE)
+        return NULL;
+    cache_writer_t *writer = calloc(1, sizeof(cache_writer_t));
+    if (writer == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    writer->fd = -1;
+    writer->stale_fd = -1;
+    writer->hash = hash_key(key);
+    snprintf(writer->key, sizeof(writer->key), "%s", key);
+    if (revalidating == NULL)
+        return writer;
+
+    // Keep the stale file open, a 304 is answered from it whatever happens to the object.
+    // It is opened under the lock, an object is only unlinked with the lock held
+    writer->stale_object = *revalidating;
+    lock_index();
+    cache_entry_t *entry = find_entry(key, writer->hash);
+    if (entry != NULL && entry->file_id == revalidating->file_id) {
+        char name[32];
+        object_name(entry->file_id, name, sizeof(name));
+        writer->stale_fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+        writer->stale_size = entry->size;
+        writer->stale_header_len = (size_t) entry->header_len;
+    }
+    unlock_index();
+    stats_syscalls(1);
+    writer->revalidating = writer->stale_fd >= 0;
+    return writer;
+}
+
+void cache_write(cache_writer_t *writer, const char *data, size_t len) {
+    if (writer->skip)
+        return;
+
+    // The file is only created for a response that may be stored
+    if (!writer->parsed) {
+        writer->parsed = true;
+        const char *end_of_headers = memmem(data, len, "\r\n\r\n", 4);
+        int status = end_of_headers != NULL ? response_status(data, len) : 0;
+
+        // A 304 keeps its headers to refresh the stale object when it is complete
+        if (writer->revalidating && status == 304) {
+            writer->not_modified_len = end_of_headers + 4 - data;
+            writer->not_modified_headers = malloc(writer->not_modified_len);
+            writer->not_modified = writer->not_modified_headers != NULL;
+            if (writer->not_modified)
+                memcpy(writer->not_modified_headers, data, writer->not_modified_len);
+            writer->skip = true;
+            return;
+        }
+        if (status != 200 || !read_object_info(data, end_of_headers + 4 - data, &writer->info)) {
+            writer->skip = true;
+            return;
+        }
+        writer->fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+        stats_syscalls(1);
+        if (writer->fd < 0) {
+            perror("error: open\n");
+            writer->skip = true;
+            return;
+        }
+        read_body_length(writer, data, end_of_headers + 4 - data);
+        writer->body_received = -(int64_t) (end_of_headers + 4 - data);
+    }
+
+    // A body cut off by the server must not be stored, its end is followed as it arrives
+    const char *body = writer->body_received < 0 ? data - writer->body_received : data;
+    writer->body_received += (int64_t) len;
+    if (writer->chunked)
+        follow_chunks(writer, body, len - (size_t) (body - data));
+
+    // Too big for the cache, the unnamed file goes away when it is closed
+    writer->info.size += (int64_t) len;
+    if (writer->info.size > max_cache_bytes / MAX_OBJECT_SHARE) {
+        writer->skip = true;
+        return;
+    }
+    while (len > 0) {
+        stats_syscalls(1);
+        ssize_t written = write(writer->fd, data, len);
+        if (written < 0) {
+            perror("error: write\n");
+            writer->skip = true;
+            return;
+        }
+        data += written;
+        len -= (size_t) written;
+    }
+}
+
+bool cache_storing(const cache_writer_t *writer) {
+    return writer != NULL && !writer->skip;
+}
+
+bool cache_not_modified(const cache_writer_t *writer) {
+    return writer != NULL && writer->not_modified;
+}
+
+bool cache_revalidating(const cache_writer_t *writer) {
+    return writer != NULL && writer->revalidating;
+}
+
+bool cache_send_not_modified(cache_writer_t *writer, int client_socket, long *bytes_sent) {
+    *bytes_sent = 0;
+    if (!cache_not_modified(writer) || !merge_stale_headers(writer))
+        return false;
+
+    // The refreshed headers, then the stored body from the page cache to the socket
+    size_t sent = 0;
+    long syscalls = 0;
+    while (sent < writer->merged_len) {
+        syscalls++;
+        ssize_t result = send(client_socket, writer->merged_headers + sent, writer->merged_len - sent, MSG_NOSIGNAL);
+        if (result <= 0)
+            break;
+        sent += (size_t) result;
+    }
+    off_t offset = (off_t) writer->stale_header_len;
+    while (sent == writer->merged_len && offset < writer->stale_size) {
+        syscalls++;
+        if (sendfile(client_socket, writer->stale_fd, &offset, (size_t) (writer->stale_size - offset)) <= 0)
+            break;
+    }
+    stats_syscalls(syscalls);
+    *bytes_sent = (long) sent + (long) (offset - (off_t) writer->stale_header_len);
+    return true;
+}
+
+void cache_finish(cache_writer_t *writer, bool complete) {
+    if (writer == NULL)
+        return;
+
+    if (complete && writer->revalidating)
+        atomic_fetch_add_explicit(&revalidations, 1, memory_order_relaxed);
+    if (complete && writer->not_modified) {
+        atomic_fetch_add_explicit(&not_modified, 1, memory_order_relaxed);
+        refresh_object(writer);
+    } else if (complete && !writer->skip && writer->fd >= 0 && body_complete(writer) &&
+               publish_object(writer->fd, writer->key, writer->hash, &writer->info, 0)) {
+        atomic_fetch_add_explicit(&stores, 1, memory_order_relaxed);
+    }
+
+    if (writer->fd >= 0)
+        close(writer->fd);
+    if (writer->stale_fd >= 0)
+        close(writer->stale_fd);
+    free(writer->not_modified_headers);
+    free(writer->merged_headers);
+    free(writer);
+}
+
+void cache_usage(cache_usage_t *usage) {
+    usage->hits = atomic_load_explicit(&hits, memory_order_relaxed);
+    usage->misses = atomic_load_explicit(&misses, memory_order_relaxed);
+    usage->stores = atomic_load_explicit(&stores, memory_order_relaxed);
+    usage->evictions = atomic_load_explicit(&evictions, memory_order_relaxed);
+    usage->stale_hits = atomic_load_explicit(&stale_hits, memory_order_relaxed);
+    usage->revalidations = atomic_load_explicit(&revalidations, memory_order_relaxed);
+    usage->not_modified = atomic_load_explicit(&not_modified, memory_order_relaxed);
+    usage->objects = header != NULL ? (long) header->objects : 0;
+    usage->bytes = header != NULL ? (long) header->bytes : 0;
+}
+
+void close_disk_cache() {
+    if (header != NULL)
+        munmap(header, index_size);
+    if (index_fd >= 0)
+        close(index_fd);
+    if (dir_fd >= 0)
+        close(dir_fd);
+    header = NULL;
+    entries = NULL;
+    index_fd = -1;
+    dir_fd = -1;
+}
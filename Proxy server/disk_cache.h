@@ -0,0 +1,172 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * disk_cache.h
+ *
+ * Cache of responses on the local disk, one file per object.
+ *
+ * The file of an object holds the whole response as the server sent it, so a hit is
+ * sent to the client with sendfile and the body never passes through user space.
+ * The index is a hash table in the file "index" of the cache directory, mapped
+ * with mmap and shared by the threads and by the old and new process of a handoff.
+ * A proxy started on an existing directory maps the index again and serves hits
+ * right away, no object file is read.
+ *
+ * A response is written to an unnamed file while it is relayed and becomes an
+ * object only when it arrived completely, a crash never leaves half objects behind.
+ *
+ * An object that is no longer fresh is revalidated with If-None-Match or
+ * If-Modified-Since. While it is inside its stale-while-revalidate window the
+ * stale copy is sent right away and one request revalidates it in the background,
+ * after the window the request waits for the revalidation. A 304 from the server
+ * refreshes the headers and the freshness of the object, its body is copied
+ * inside the kernel. The stale file is opened when the revalidation starts, so the
+ * client that waited gets it with the refreshed headers even when the refreshed
+ * object is not stored.
+ */
+
+// entries looked at for a key, a full neighbourhood evicts its least recently used entry
+#define CACHE_PROBE_LENGTH 16
+
+// longest key that can be cached, host with port and path
+#define CACHE_KEY_SIZE 304
+
+// longest validators kept for revalidation
+#define CACHE_ETAG_SIZE 96
+#define CACHE_DATE_SIZE 40
+
+typedef struct cache_writer_st cache_writer_t;
+
+/**
+ * Entry of the index, file_id 0 is an empty slot
+ */
+typedef struct cache_entry_st {
+    uint64_t hash;
+    uint64_t file_id;       // name of the object file in hex
+    int64_t size;           // bytes of the response
+    int64_t stored_at;      // wall clock seconds, they survive a restart
+    int64_t expires_at;
+    int64_t last_used;
+    int64_t stale_until;            // the stale copy may be sent while it is revalidated
+    int64_t revalidating_until;     // a request revalidates the object in the background
+    int32_t header_len;             // bytes of the status line and headers
+    int32_t unused;
+    char etag[CACHE_ETAG_SIZE];     // empty if the server sent none
+    char last_modified[CACHE_DATE_SIZE];
+    char key[CACHE_KEY_SIZE];
+} cache_entry_t;
+
+/**
+ * Validators of a stale object, added to the request that revalidates it
+ */
+typedef struct cache_validators_st {
+    uint64_t file_id;
+    char etag[CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+} cache_validators_t;
+
+typedef enum {
+    CACHE_MISS,         // nothing was sent, fetch as usual
+    CACHE_HIT,          // a fresh copy was sent
+    CACHE_STALE,        // a stale copy was sent, another request revalidates it
+    CACHE_REVALIDATE,   // a stale copy was sent, the caller must revalidate it in the background
+    CACHE_EXPIRED       // nothing was sent, fetch with the validators before answering
+} cache_result_t;
+
+/**
+ * Usage of the cache for the statistics
+ */
+typedef struct cache_usage_st {
+    long hits;
+    long misses;
+    long stores;
+    long evictions;
+    long stale_hits;        // stale copies sent while they were revalidated
+    long revalidations;     // conditional requests that got an answer
+    long not_modified;      // revalidations answered with 304
+    long objects;
+    long bytes;
+} cache_usage_t;
+
+
+/**
+ * init_disk_cache opens or creates the cache directory and maps its index.
+ * @dir - cache directory, created if missing
+ * @entries - slots of the index, an existing index with another size is cleared
+ * @max_bytes - objects are evicted when the cache grows past it
+ * @default_ttl - seconds a response without max-age stays fresh, 0 to cache only responses with max-age
+ * @default_stale - seconds a stale copy may be sent while it is revalidated, when the
+ *   response has no stale-while-revalidate
+ * @ return value - 0 on success, -1 on failure
+ */
+int init_disk_cache(const char *dir, int entries, long max_bytes, long default_ttl, long default_stale);
+
+bool disk_cache_enabled();
+
+/**
+ * cache_serve sends the cached response of a key to the client if it may be used.
+ * @bytes_sent - bytes sent to the client
+ * @validators - set for CACHE_REVALIDATE and CACHE_EXPIRED
+ */
+cache_result_t cache_serve(const char *key, int client_socket, long *bytes_sent, cache_validators_t *validators);
+
+/**
+ * cache_begin starts writing the response of a key while it is relayed.
+ * @revalidating - validators of the stale object the request revalidates, NULL for a plain fetch
+ * @ return value - the writer, NULL if the key can't be cached
+ */
+cache_writer_t* cache_begin(const char *key, const cache_validators_t *revalidating);
+
+/**
+ * cache_write adds a chunk of the response. The headers must be in the first chunk,
+ * a response that is not cacheable is dropped and later chunks are ignored.
+ */
+void cache_write(cache_writer_t *writer, const char *data, size_t len);
+
+/**
+ * cache_storing tells if the response is still being written, a relay whose client went away
+ * keeps fetching only for it.
+ */
+bool cache_storing(const cache_writer_t *writer);
+
+/**
+ * cache_not_modified tells if the server answered a revalidation with 304. The 304
+ * refreshes the stale object and must not be relayed to a client that did not ask for it.
+ */
+bool cache_not_modified(const cache_writer_t *writer);
+
+/**
+ * cache_revalidating tells if a revalidation can be answered from the stale object. Its file
+ * is kept open from cache_begin on, the request must carry the validators only if it is.
+ */
+bool cache_revalidating(const cache_writer_t *writer);
+
+/**
+ * cache_send_not_modified sends the stale object with the headers refreshed by the 304 to the
+ * client that asked for it, whether or not the refreshed object can be stored.
+ * @bytes_sent - bytes sent to the client
+ * @ return value - false if the server did not answer 304 or the object could not be read, nothing was sent
+ */
+bool cache_send_not_modified(cache_writer_t *writer, int client_socket, long *bytes_sent);
+
+/**
+ * cache_finish stores the response as an object if it arrived completely, or refreshes
+ * the stale object after a 304, and frees the writer. A body with a Content-Length or
+ * chunked encoding is complete only when all of it or its last chunk arrived, the end of
+ * the connection is not enough.
+ */
+void cache_finish(cache_writer_t *writer, bool complete);
+
+void cache_usage(cache_usage_t *usage);
+
+/**
+ * close_disk_cache unmaps the index, the objects stay for the next start.
+ */
+void close_disk_cache();
+
+#endif //DISK_CACHE_H
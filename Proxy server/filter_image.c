@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "filter_image.h"
+
+// the root table has an entry for every value of the first ROOT_BITS bits of an address
+#define ROOT_BITS 16
+#define ROOT_ENTRIES (1 << ROOT_BITS)
+
+// sections of the image start on their own cache lines
+#define SECTION_ALIGN 64
+
+// longer host names are only checked by their addresses
+#define MAX_FILTER_NAME 512
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              // bytes of the whole image
+    uint32_t num_ranges;
+    uint32_t host_slots;        // power of 2
+    uint32_t suffix_slots;      // power of 2
+    uint32_t unused;
+    uint64_t roots_offset;      // ROOT_ENTRIES + 1 indexes of the first range of each root
+    uint64_t ranges_offset;
+    uint64_t hosts_offset;
+    uint64_t suffixes_offset;
+    uint64_t strings_offset;
+    uint64_t strings_bytes;
+    int64_t networks;
+    int64_t hosts;
+    int64_t suffixes;
+    int64_t skipped;
+} image_header_t;
+
+// Addresses in host byte order, both ends are blocked
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} address_range_t;
+
+// Slot of a name table, name is the offset of the name in the strings, 0 for an empty slot
+typedef struct {
+    uint32_t hash;
+    uint32_t name;
+} name_slot_t;
+
+struct filter_st {
+    int fd;
+    char *data;
+    size_t size;
+    const image_header_t *header;
+    const uint32_t *roots;
+    const address_range_t *ranges;
+    const name_slot_t *hosts;
+    const name_slot_t *suffixes;
+    const char *strings;
+};
+
+// What the text filter holds while it is compiled
+typedef struct {
+    address_range_t *ranges;
+    size_t num_ranges, ranges_capacity;
+    uint32_t *hosts;            // offsets of the names in strings
+    size_t num_hosts, hosts_capacity;
+    uint32_t *suffixes;
+    size_t num_suffixes, suffixes_capacity;
+    char *strings;
+    size_t strings_bytes, strings_capacity;
+    long networks, skipped;
+} filter_builder_t;
+
+//  Private helpers //------------------------------------------------------------------//
+static uint32_t hash_name(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619U;
+    return hash;
+}
+
+static size_t align_section(size_t offset) {
+    return (offset + SECTION_ALIGN - 1) & ~((size_t) SECTION_ALIGN - 1);
+}
+
+// Slots for a table of count names, at most half of them are used
+static uint32_t table_slots(size_t count) {
+    uint32_t slots = 1;
+    while (slots < 2 * count)
+        slots *= 2;
+    return slots;
+}
+
+// Make room for one more item of an array that doubles
+static bool grow(void **array, size_t *capacity, size_t count, size_t item_size) {
+    if (count < *capacity)
+        return true;
+    size_t new_capacity = *capacity == 0 ? 1024 : *capacity * 2;
+    void *new_array = realloc(*array, new_capacity * item_size);
+    if (new_array == NULL) {
+        perror("error: malloc\n");
+        return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Parse "a.b.c.d" or "a.b.c.d/n" into the range of addresses it covers
+static bool parse_network(const char *line, address_range_t *range) {
+    char address[INET_ADDRSTRLEN];
+    const char *slash = strchr(line, '/');
+    size_t len = slash != NULL ? (size_t) (slash - line) : strlen(line);
+    if (len >= sizeof(address))
+        return false;
+    memcpy(address, line, len);
+    address[len] = '\0';
+
+    struct in_addr ip;
+    if (inet_pton(AF_INET, address, &ip) != 1)
+        return false;
+
+    long prefix_bits = 32;
+    if (slash != NULL) {
+        char *end;
+        prefix_bits = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || prefix_bits < 0 || prefix_bits > 32)
+            return false;
+    }
+    uint32_t mask = prefix_bits == 0 ? 0 : 0xFFFFFFFFU << (32 - prefix_bits);
+    range->first = ntohl(ip.s_addr) & mask;
+    range->last = range->first | ~mask;
+    return true;
+}
+
+// Add a name to the strings in lower case, its offset goes to names
+static bool add_name(filter_builder_t *builder, const char *name, uint32_t **names, size_t *count, size_t *capacity) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= MAX_FILTER_NAME)
+        return false;
+    while (builder->strings_bytes + len + 1 > builder->strings_capacity) {
+        size_t new_capacity = builder->strings_capacity == 0 ? 64 * 1024 : builder->strings_capacity * 2;
+        char *strings = realloc(builder->strings, new_capacity);
+        if (strings == NULL) {
+            perror("error: malloc\n");
+            return false;
+        }
+        builder->strings = strings;
+        builder->strings_capacity = new_capacity;
+    }
+    if (builder->strings_bytes + len + 1 > UINT32_MAX || !grow((void **) names, capacity, *count, sizeof(uint32_t)))
+        return false;
+
+    char *copy = builder->strings + builder->strings_bytes;
+    for (size_t i = 0; i <= len; i++)
+        copy[i] = (char) tolower((unsigned char) name[i]);
+    // "example.com." is the same host as "example.com"
+    if (len > 1 && copy[len - 1] == '.')
+        copy[len - 1] = '\0';
+    (*names)[(*count)++] = (uint32_t) builder->strings_bytes;
+    builder->strings_bytes += len + 1;
+    return true;
+}
+
+// Sort one line of the text filter into the builder, false if it is not valid
+static bool add_line(filter_builder_t *builder, const char *line) {
+    // Same assumption as the original filter: host names do not start with a digit
+    if (isdigit((unsigned char) line[0])) {
+        address_range_t range;
+        if (!parse_network(line, &range) ||
+            !grow((void **) &builder->ranges, &builder->ranges_capacity, builder->num_ranges, sizeof(range)))
+            return false;
+        builder->ranges[builder->num_ranges++] = range;
+        builder->networks++;
+        return true;
+    }
+    if (strncmp(line, "*.", 2) == 0)
+        return add_name(builder, line + 2, &builder->suffixes, &builder->num_suffixes, &builder->suffixes_capacity);
+    if (line[0] == '.')
+        return add_name(builder, line + 1, &builder->suffixes, &builder->num_suffixes, &builder->suffixes_capacity);
+    return add_name(builder, line, &builder->hosts, &builder->num_hosts, &builder->hosts_capacity);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const address_range_t *x = a, *y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+// Sort the ranges and merge the ones that overlap or touch
+static size_t merge_ranges(address_range_t *ranges, size_t count) {
+    if (count == 0)
+        return 0;
+    qsort(ranges, count, sizeof(address_range_t), compare_ranges);
+    size_t merged = 0;
+    for (size_t i = 1; i < count; i++) {
+        address_range_t *last = &ranges[merged];
+        if (last->last == UINT32_MAX || ranges[i].first <= last->last + 1) {
+            if (ranges[i].last > last->last)
+                last->last = ranges[i].last;
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    return merged + 1;
+}
+
+// Put a name in a table, a name that is already there is not added again
+static void insert_name(name_slot_t *slots, uint32_t num_slots, const char *strings, uint32_t name) {
+    uint32_t hash = hash_name(strings + name);
+    for (uint32_t i = hash & (num_slots - 1);; i = (i + 1) & (num_slots - 1)) {
+        if (slots[i].name == 0) {
+            slots[i].hash = hash;
+            slots[i].name = name;
+            return;
+        }
+        if (slots[i].hash == hash && strcmp(strings + slots[i].name, strings + name) == 0)
+            return;
+    }
+}
+
+static bool find_name(const filter_t *filter, const name_slot_t *slots, uint32_t num_slots, const char *name) {
+    uint32_t hash = hash_name(name);
+    uint32_t i = hash & (num_slots - 1);
+    // Bounded, a damaged image may have no empty slot
+    for (uint32_t probes = 0; probes < num_slots && slots[i].name != 0; probes++, i = (i + 1) & (num_slots - 1)) {
+        if (slots[i].hash == hash && slots[i].name < filter->header->strings_bytes &&
+            strcmp(filter->strings + slots[i].name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool address_blocked(const filter_t *filter, uint32_t address) {
+    uint32_t num_ranges = filter->header->num_ranges;
+    uint32_t root = address >> (32 - ROOT_BITS);
+    uint32_t low = filter->roots[root];
+    uint32_t high = filter->roots[root + 1] < num_ranges ? filter->roots[root + 1] : num_ranges;
+
+    // The first range that ends at or after the address is between the ranges of this root and the next
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (filter->ranges[middle].last < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < num_ranges && filter->ranges[low].first <= address;
+}
+
+// A section of count items must lie inside the image
+static bool section_fits(uint64_t offset, uint64_t count, size_t item_size, size_t size) {
+    return offset % sizeof(uint32_t) == 0 && offset <= size && count <= (size - offset) / item_size;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *cursor = data;
+    while (size > 0) {
+        ssize_t written = write(fd, cursor, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        cursor += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+// --------------------------------------------------------------------------------------//
+
+void* compile_filter(const char *text_path, size_t *size, filter_info_t *info) {
+    FILE *file = fopen(text_path, "r");
+    if (file == NULL) {
+        perror("error: open\n");
+        return NULL;
+    }
+
+    // Offset 0 of the strings is the empty slot
+    filter_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    long line_number = 0;
+    bool failed = !grow((void **) &builder.strings, &builder.strings_capacity, 0, 1);
+    if (!failed)
+        builder.strings[builder.strings_bytes++] = '\0';
+
+    while (!failed && (len = getline(&line, &line_capacity, file)) >= 0) {
+        line_number++;
+        // Trim the line, a file written on Windows ends its lines with "\r\n"
+        while (len > 0 && isspace((unsigned char) line[len - 1]))
+            line[--len] = '\0';
+        char *start = line;
+        while (isspace((unsigned char) *start))
+            start++;
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (!add_line(&builder, start)) {
+            fprintf(stderr, "error: filter line %ld is not valid, skipped: %s\n", line_number, start);
+            builder.skipped++;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    size_t num_ranges = merge_ranges(builder.ranges, builder.num_ranges);
+    uint32_t host_slots = table_slots(builder.num_hosts);
+    uint32_t suffix_slots = table_slots(builder.num_suffixes);
+
+    // Lay the sections out one after the other
+    image_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FILTER_MAGIC;
+    header.version = FILTER_VERSION;
+    header.num_ranges = (uint32_t) num_ranges;
+    header.host_slots = host_slots;
+    header.suffix_slots = suffix_slots;
+    header.roots_offset = align_section(sizeof(header));
+    header.ranges_offset = align_section(header.roots_offset + (ROOT_ENTRIES + 1) * sizeof(uint32_t));
+    header.hosts_offset = align_section(header.ranges_offset + num_ranges * sizeof(address_range_t));
+    header.suffixes_offset = align_section(header.hosts_offset + host_slots * sizeof(name_slot_t));
+    header.strings_offset = align_section(header.suffixes_offset + suffix_slots * sizeof(name_slot_t));
+    header.strings_bytes = builder.strings_bytes;
+    header.size = header.strings_offset + builder.strings_bytes;
+    header.networks = builder.networks;
+    header.hosts = (int64_t) builder.num_hosts;
+    header.suffixes = (int64_t) builder.num_suffixes;
+    header.skipped = builder.skipped;
+
+    char *image = failed || num_ranges > UINT32_MAX ? NULL : calloc(1, header.size);
+    if (image != NULL) {
+        memcpy(image, &header, sizeof(header));
+
+        // The first range of every root, the one after the last root is the end of the ranges
+        uint32_t *roots = (uint32_t *) (image + header.roots_offset);
+        size_t range = 0;
+        for (uint32_t root = 0; root < ROOT_ENTRIES; root++) {
+            while (range < num_ranges && builder.ranges[range].last < (root << (32 - ROOT_BITS)))
+                range++;
+            roots[root] = (uint32_t) range;
+        }
+        roots[ROOT_ENTRIES] = (uint32_t) num_ranges;
+        if (num_ranges > 0)
+            memcpy(image + header.ranges_offset, builder.ranges, num_ranges * sizeof(address_range_t));
+
+        memcpy(image + header.strings_offset, builder.strings, builder.strings_bytes);
+        for (size_t i = 0; i < builder.num_hosts; i++)
+            insert_name((name_slot_t *) (image + header.hosts_offset), host_slots, builder.strings, builder.hosts[i]);
+        for (size_t i = 0; i < builder.num_suffixes; i++)
+            insert_name((name_slot_t *) (image + header.suffixes_offset), suffix_slots, builder.strings,
+                        builder.suffixes[i]);
+    } else if (!failed) {
+        perror("error: malloc\n");
+    }
+
+    free(builder.ranges);
+    free(builder.hosts);
+    free(builder.suffixes);
+    free(builder.strings);
+    if (image == NULL)
+        return NULL;
+
+    *size = header.size;
+    if (info != NULL) {
+        info->networks = header.networks;
+        info->ranges = (long) num_ranges;
+        info->hosts = header.hosts;
+        info->suffixes = header.suffixes;
+        info->skipped = header.skipped;
+        info->bytes = header.size;
+    }
+    return image;
+}
+
+int write_filter_image(const void *image, size_t size, const char *path) {
+    // A proxy may have the old image mapped, it must never see it change
+    char temp_path[4096];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int) getpid()) >= (int) sizeof(temp_path)) {
+        fprintf(stderr, "error: filter image path is too long\n");
+        return -1;
+    }
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("error: open\n");
+        return -1;
+    }
+    if (!write_all(fd, image, size) || fsync(fd) < 0) {
+        perror("error: write\n");
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    close(fd);
+    if (rename(temp_path, path) < 0) {
+        perror("error: rename\n");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+filter_t* load_filter(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("error: open\n");
+        return NULL;
+    }
+
+    // An image is mapped as it is
+    uint32_t magic = 0;
+    if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == FILTER_MAGIC) {
+        filter_t *filter = load_filter_fd(fd);
+        if (filter == NULL)
+            close(fd);
+        return filter;
+    }
+    close(fd);
+
+    // A text filter is compiled into a sealed memfd, the next process of a handoff can map it too
+    size_t size;
+    void *image = compile_filter(path, &size, NULL);
+    if (image == NULL)
+        return NULL;
+    fd = memfd_create("proxy-filter", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || !write_all(fd, image, size)) {
+        perror("error: memfd\n");
+        if (fd >= 0)
+            close(fd);
+        free(image);
+        return NULL;
+    }
+    free(image);
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    filter_t *filter = load_filter_fd(fd);
+    if (filter == NULL)
+        close(fd);
+    return filter;
+}
+
+filter_t* load_filter_fd(int fd) {
+    struct stat file_info;
+    if (fstat(fd, &file_info) < 0 || (size_t) file_info.st_size < sizeof(image_header_t)) {
+        fprintf(stderr, "error: the filter image is truncated\n");
+        return NULL;
+    }
+    size_t size = (size_t) file_info.st_size;
+
+    // Pages are read when a lookup touches them, nothing is read before serving
+    char *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("error: mmap\n");
+        return NULL;
+    }
+
+    const image_header_t *header = (const image_header_t *) data;
+    bool valid = header->magic == FILTER_MAGIC && header->version == FILTER_VERSION && header->size == size &&
+                 header->host_slots != 0 && (header->host_slots & (header->host_slots - 1)) == 0 &&
+                 header->suffix_slots != 0 && (header->suffix_slots & (header->suffix_slots - 1)) == 0 &&
+                 section_fits(header->roots_offset, ROOT_ENTRIES + 1, sizeof(uint32_t), size) &&
+                 section_fits(header->ranges_offset, header->num_ranges, sizeof(address_range_t), size) &&
+                 section_fits(header->hosts_offset, header->host_slots, sizeof(name_slot_t), size) &&
+                 section_fits(header->suffixes_offset, header->suffix_slots, sizeof(name_slot_t), size) &&
+                 section_fits(header->strings_offset, header->strings_bytes, 1, size) &&
+                 header->strings_bytes > 0 && data[header->strings_offset + header->strings_bytes - 1] == '\0';
+    if (!valid) {
+        fprintf(stderr, "error: the filter image is not valid\n");
+        munmap(data, size);
+        return NULL;
+    }
+
+    filter_t *filter = malloc(sizeof(filter_t));
+    if (filter == NULL) {
+        perror("error: malloc\n");
+        munmap(data, size);
+        return NULL;
+    }
+    filter->fd = fd;
+    filter->data = data;
+    filter->size = size;
+    filter->header = header;
+    filter->roots = (const uint32_t *) (data + header->roots_offset);
+    filter->ranges = (const address_range_t *) (data + header->ranges_offset);
+    filter->hosts = (const name_slot_t *) (data + header->hosts_offset);
+    filter->suffixes = (const name_slot_t *) (data + header->suffixes_offset);
+    filter->strings = data + header->strings_offset;
+    return filter;
+}
+
+int filter_fd(const filter_t *filter) {
+    return filter->fd;
+}
+
+bool filter_blocks(const filter_t *filter, const char *hostname, const struct in_addr *addresses, int num_addresses) {
+    for (int i = 0; i < num_addresses; i++) {
+        if (address_blocked(filter, ntohl(addresses[i].s_addr)))
+            return true;
+    }
+
+    // The names are stored in lower case
+    char name[MAX_FILTER_NAME];
+    size_t len = strlen(hostname);
+    if (len == 0 || len >= sizeof(name))
+        return false;
+    for (size_t i = 0; i <= len; i++)
+        name[i] = (char) tolower((unsigned char) hostname[i]);
+    if (len > 1 && name[len - 1] == '.')
+        name[len - 1] = '\0';
+
+    if (find_name(filter, filter->hosts, filter->header->host_slots, name))
+        return true;
+
+    // "a.b.example.com" is under the suffixes "a.b.example.com", "b.example.com", "example.com" and "com"
+    for (const char *suffix = name; suffix != NULL; suffix = strchr(suffix, '.')) {
+        if (*suffix == '.')
+            suffix++;
+        if (find_name(filter, filter->suffixes, filter->header->suffix_slots, suffix))
+            return true;
+    }
+    return false;
+}
+
+void get_filter_info(const filter_t *filter, filter_info_t *info) {
+    info->networks = filter->header->networks;
+    info->ranges = filter->header->num_ranges;
+    info->hosts = filter->header->hosts;
+    info->suffixes = filter->header->suffixes;
+    info->skipped = filter->header->skipped;
+    info->bytes = filter->size;
+}
+
+void close_filter(filter_t *filter) {
+    if (filter == NULL)
+        return;
+    munmap(filter->data, filter->size);
+    close(filter->fd);
+    free(filter);
+}
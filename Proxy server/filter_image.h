@@ -0,0 +1,97 @@
+#ifndef FILTER_IMAGE_H
+#define FILTER_IMAGE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+/**
+ * filter_image.h
+ *
+ * The filter as a compact binary image that is used where it lies in memory.
+ *
+ * The image holds the networks as sorted, merged address ranges under a root
+ * table indexed by the first 16 bits of the address, and the host names in two
+ * hash tables: exact names and domain suffixes. A lookup never allocates and
+ * never compares more than a few strings, whatever the size of the filter.
+ *
+ * tools/filterCompiler.c compiles a text filter into an image file once. The proxy
+ * maps the image read only and serves right away, processes that map the same
+ * file share its pages in the page cache. A text filter given to the proxy is
+ * compiled at start into a memfd, so both go through the same lookup and the
+ * filter can be handed to the next process as a descriptor.
+ *
+ * Lines of the text filter:
+ *   10.0.0.0/8, 192.0.2.1       a network, an address without a mask is a /32
+ *   example.com                 exactly this host
+ *   .example.com, *.example.com this host and every host under it
+ * Empty lines and lines starting with '#' are skipped, names are not case sensitive.
+ */
+
+#define FILTER_MAGIC 0x544c4650     // "PFLT"
+#define FILTER_VERSION 1
+
+typedef struct filter_st filter_t;
+
+/**
+ * Content of a filter, for the compiler and the start of the proxy
+ */
+typedef struct filter_info_st {
+    long networks;      // network lines
+    long ranges;        // address ranges left after merging them
+    long hosts;
+    long suffixes;
+    long skipped;       // lines that are not valid
+    size_t bytes;       // size of the image
+} filter_info_t;
+
+
+/**
+ * compile_filter reads a text filter and builds its image in memory.
+ * @size - set to the bytes of the image
+ * @info - counts of what was compiled, may be NULL
+ * @ return value - the image, free it with free, NULL on failure
+ */
+void* compile_filter(const char *text_path, size_t *size, filter_info_t *info);
+
+/**
+ * write_filter_image writes an image to a new file and renames it to path, processes
+ * that mapped the old file keep using it.
+ * @ return value - 0 on success, -1 on failure
+ */
+int write_filter_image(const void *image, size_t size, const char *path);
+
+/**
+ * load_filter maps the filter of a path, an image file as it is, a text filter after
+ * compiling it.
+ * @ return value - the filter, NULL on failure
+ */
+filter_t* load_filter(const char *path);
+
+/**
+ * load_filter_fd maps an image from a descriptor, it is kept open for filter_fd.
+ * @ return value - the filter, NULL if the image is not valid
+ */
+filter_t* load_filter_fd(int fd);
+
+/**
+ * filter_fd is the descriptor of the mapped image, to pass the filter to another process.
+ */
+int filter_fd(const filter_t *filter);
+
+/**
+ * filter_blocks checks a host and its resolved addresses against the filter.
+ * @hostname - host name without the port
+ * @addresses, num_addresses - the resolved addresses
+ * @ return value - true if the host or one of the addresses is blocked
+ */
+bool filter_blocks(const filter_t *filter, const char *hostname, const struct in_addr *addresses, int num_addresses);
+
+void get_filter_info(const filter_t *filter, filter_info_t *info);
+
+/**
+ * close_filter unmaps the image and closes its descriptor.
+ */
+void close_filter(filter_t *filter);
+
+#endif //FILTER_IMAGE_H
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "upstream_health.h"
+
+// how long the new process waits for the old one to answer
+#define HANDOFF_TIMEOUT_MS 5000
+
+/**
+ * First message, sent by the new process
+ */
+typedef struct handoff_request_st {
+    uint32_t magic;
+    uint32_t version;
+    int32_t want_state;
+} handoff_request_t;
+
+/**
+ * Answer of the old process, the listening socket (and the state memfd and the
+ * filter image) come with it
+ */
+typedef struct handoff_reply_st {
+    uint32_t magic;
+    uint32_t version;
+    int32_t has_state;
+} handoff_reply_t;
+
+/**
+ * Start of the state memfd, followed by num_health entries
+ */
+typedef struct handoff_state_header_st {
+    uint32_t magic;
+    uint32_t version;
+    int32_t num_health;
+    int32_t unused;
+} handoff_state_header_t;
+
+//  Private helpers //------------------------------------------------------------------//
+static int fill_unix_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "error: handoff socket path is too long\n");
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+static void set_timeouts(int fd) {
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Write the health table to a memfd, -1 on failure
+static int write_state() {
+    health_entry_t *health = malloc(HEALTH_TABLE_SIZE * sizeof(health_entry_t));
+    if (health == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+
+    handoff_state_header_t header = { HANDOFF_MAGIC, HANDOFF_VERSION, 0, 0 };
+    header.num_health = export_upstream_health(health, HEALTH_TABLE_SIZE);
+
+    size_t health_bytes = (size_t) header.num_health * sizeof(health_entry_t);
+    size_t size = sizeof(header) + health_bytes;
+
+    int fd = memfd_create("proxy-handoff-state", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, (off_t) size) < 0) {
+        perror("error: memfd\n");
+        if (fd >= 0)
+            close(fd);
+        free(health);
+        return -1;
+    }
+    char *state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED) {
+        perror("error: mmap\n");
+        close(fd);
+        free(health);
+        return -1;
+    }
+
+    memcpy(state, &header, sizeof(header));
+    memcpy(state + sizeof(header), health, health_bytes);
+
+    munmap(state, size);
+    free(health);
+    return fd;
+}
+
+// Load the health table from the memfd of the old process
+static int read_state(int fd, handoff_state_t *state) {
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(handoff_state_header_t)) {
+        fprintf(stderr, "error: handoff state is truncated\n");
+        return -1;
+    }
+    size_t size = (size_t) info.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("error: mmap\n");
+        return -1;
+    }
+
+    handoff_state_header_t header;
+    memcpy(&header, data, sizeof(header));
+    size_t health_bytes = (size_t) header.num_health * sizeof(health_entry_t);
+    if (header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION ||
+        header.num_health < 0 || sizeof(header) + health_bytes > size) {
+        fprintf(stderr, "error: handoff state is not valid\n");
+        munmap(data, size);
+        return -1;
+    }
+
+    // Copy the table out of the mapping, its entries may not be aligned for direct use
+    health_entry_t *health = malloc(health_bytes > 0 ? health_bytes : 1);
+    if (health != NULL) {
+        memcpy(health, data + sizeof(header), health_bytes);
+        import_upstream_health(health, header.num_health);
+        free(health);
+    }
+
+    munmap(data, size);
+    state->has_state = 1;
+    return 0;
+}
+// --------------------------------------------------------------------------------------//
+
+int handoff_receive(const char *path, int want_state, handoff_state_t *state) {
+    struct sockaddr_un address;
+    memset(state, 0, sizeof(*state));
+    if (fill_unix_address(path, &address) < 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    // Nobody listening, this is the first process
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    set_timeouts(fd);
+
+    handoff_request_t request = { HANDOFF_MAGIC, HANDOFF_VERSION, want_state };
+    if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        perror("error: handoff send\n");
+        close(fd);
+        return -1;
+    }
+
+    // Receive the reply with the descriptors
+    handoff_reply_t reply;
+    struct iovec iov = { &reply, sizeof(reply) };
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    close(fd);
+    if (received != sizeof(reply) || reply.magic != HANDOFF_MAGIC || reply.version != HANDOFF_VERSION) {
+        fprintf(stderr, "error: no valid answer on the handoff socket\n");
+        return -1;
+    }
+
+    int fds[3] = { -1, -1, -1 };
+    int num_fds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        num_fds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+    if (num_fds < 1) {
+        fprintf(stderr, "error: the handoff answer has no socket\n");
+        return -1;
+    }
+
+    // The state is optional, a broken one just means starting cold
+    if (reply.has_state && num_fds > 2) {
+        if (read_state(fds[1], state) < 0)
+            memset(state, 0, sizeof(*state));
+        close(fds[1]);
+
+        // The new process maps the same image, its pages are already in memory
+        state->filter = load_filter_fd(fds[2]);
+        if (state->filter == NULL)
+            close(fds[2]);
+    }
+    return fds[0];
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un address;
+    if (fill_unix_address(path, &address) < 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+
+    // The file belongs to the old process (or a crashed one), the new socket takes the path
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, 4) < 0) {
+        perror("error: bind handoff socket\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send(int handoff_fd, int listen_fd, const filter_t *filter) {
+    int connection = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (connection < 0)
+        return -1;
+    set_timeouts(connection);
+
+    // Only a process of the same version may take over
+    handoff_request_t request;
+    if (recv(connection, &request, sizeof(request), MSG_WAITALL) != sizeof(request) ||
+        request.magic != HANDOFF_MAGIC || request.version != HANDOFF_VERSION) {
+        fprintf(stderr, "error: invalid handoff request\n");
+        close(connection);
+        return -1;
+    }
+
+    int fds[3] = { listen_fd, -1, filter_fd(filter) };
+    int num_fds = 1;
+    if (request.want_state) {
+        fds[1] = write_state();
+        if (fds[1] >= 0)
+            num_fds = 3;
+    }
+
+    handoff_reply_t reply = { HANDOFF_MAGIC, HANDOFF_VERSION, num_fds > 1 };
+    struct iovec iov = { &reply, sizeof(reply) };
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    ssize_t sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    close(connection);
+    if (sent != sizeof(reply)) {
+        perror("error: handoff sendmsg\n");
+        return -1;
+    }
+    return 0;
+}
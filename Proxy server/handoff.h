@@ -0,0 +1,58 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "filter_image.h"
+
+/**
+ * handoff.h
+ *
+ * Zero downtime restarts. A running proxy listens on a Unix socket, and a new
+ * proxy process started with the same socket path connects to it and receives
+ * the listening TCP socket with SCM_RIGHTS. Connections waiting in the accept
+ * backlog are never refused because the socket itself is never closed.
+ *
+ * Optionally the old process also hands over its state: the upstream health table
+ * in a memfd and the descriptor of its filter image, so the new process starts with
+ * what the old one learned and maps the same filter pages.
+ *
+ * After the handoff the old process stops accepting, drains its pool and exits,
+ * and the new process takes the socket path for the next restart.
+ */
+
+#define HANDOFF_MAGIC 0x50524f58    // "PROX"
+#define HANDOFF_VERSION 2
+
+
+/**
+ * State received from the old process
+ */
+typedef struct handoff_state_st {
+    int has_state;          // 1 if the fields below were received
+    filter_t *filter;       // the filter of the old process, close it with close_filter
+} handoff_state_t;
+
+
+/**
+ * handoff_receive asks a running proxy listening on path for its listening socket.
+ * @want_state - 1 to also receive the health table and filter into state
+ * @ return value - the listening socket, or -1 if no proxy answered
+ */
+int handoff_receive(const char *path, int want_state, handoff_state_t *state);
+
+/**
+ * handoff_listen creates the Unix socket a future process will connect to,
+ * replacing a socket file left at path.
+ * @ return value - the socket, or -1 on failure
+ */
+int handoff_listen(const char *path);
+
+/**
+ * handoff_send accepts a new process on the handoff socket and passes it the listening socket.
+ * @handoff_fd - the socket created by handoff_listen
+ * @listen_fd - the listening TCP socket to pass on
+ * @filter - the filter, sent only if the new process asked for the state
+ * @ return value - 0 if the new process got the socket, -1 otherwise
+ */
+int handoff_send(int handoff_fd, int listen_fd, const filter_t *filter);
+
+#endif //HANDOFF_H
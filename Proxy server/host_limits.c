@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "host_limits.h"
+
+// A request waiting for a slot
+typedef struct host_waiter_st {
+    void *request;
+    long queued_us;
+    struct host_waiter_st *next;
+} host_waiter_t;
+
+typedef struct host_st {
+    char key[MAX_HOST_KEY];
+    int active;                 // fetches in progress
+    int waiting;
+    host_waiter_t *head;        // the queue, the oldest request first
+    host_waiter_t *tail;
+    struct host_st *next;       // chain of the bucket
+} host_t;
+
+// Hosts with fetches in progress or requests waiting, chained per bucket
+static host_t *host_table[HOST_TABLE_SIZE];
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int max_per_host = 0;
+static int max_waiting = 0;
+
+// Guarded by host_lock
+static int num_hosts = 0;
+static long total_waiting = 0;
+static long total_queued = 0;
+static long total_refused = 0;
+static long total_granted = 0;
+static long total_wait_us = 0;
+static long max_wait_us = 0;
+
+//  Private helpers //------------------------------------------------------------------//
+static unsigned int hash_key(const char *key) {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (; *key != '\0'; key++)
+        hash = (hash ^ (unsigned char) *key) * 16777619U;
+    return hash & (HOST_TABLE_SIZE - 1);
+}
+
+static long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Find the host of a key, creating it if asked. Called with host_lock held.
+static host_t* find_host(const char *key, bool create) {
+    unsigned int bucket = hash_key(key);
+    for (host_t *host = host_table[bucket]; host != NULL; host = host->next) {
+        if (strcmp(host->key, key) == 0)
+            return host;
+    }
+    if (!create)
+        return NULL;
+
+    host_t *host = calloc(1, sizeof(host_t));
+    if (host == NULL) {
+        perror("error: malloc\n");
+        return NULL;
+    }
+    snprintf(host->key, sizeof(host->key), "%s", key);
+    host->next = host_table[bucket];
+    host_table[bucket] = host;
+    num_hosts++;
+    return host;
+}
+
+// Forget a host that has nothing in progress. Called with host_lock held.
+static void remove_host(host_t *host) {
+    host_t **link = &host_table[hash_key(host->key)];
+    while (*link != host)
+        link = &(*link)->next;
+    *link = host->next;
+    num_hosts--;
+    free(host);
+}
+// --------------------------------------------------------------------------------------//
+
+void init_host_limits(int per_host, int queue_per_host) {
+    max_per_host = per_host;
+    max_waiting = queue_per_host;
+}
+
+bool host_limits_enabled() {
+    return max_per_host > 0;
+}
+
+host_slot_t acquire_host_slot(const char *key, void *request) {
+    pthread_mutex_lock(&host_lock);
+    host_t *host = find_host(key, true);
+    if (host == NULL) {
+        // Without memory for the table the host is not limited
+        pthread_mutex_unlock(&host_lock);
+        return HOST_SLOT_TAKEN;
+    }
+
+    // Requests that already wait go first
+    if (host->active < max_per_host && host->waiting == 0) {
+        host->active++;
+        pthread_mutex_unlock(&host_lock);
+        return HOST_SLOT_TAKEN;
+    }
+
+    host_waiter_t *waiter = NULL;
+    if (request != NULL && host->waiting < max_waiting && (waiter = malloc(sizeof(host_waiter_t))) == NULL)
+        perror("error: malloc\n");
+    if (waiter == NULL) {
+        total_refused++;
+        if (host->active == 0 && host->waiting == 0)
+            remove_host(host);
+        pthread_mutex_unlock(&host_lock);
+        return HOST_SLOT_REFUSED;
+    }
+
+    waiter->request = request;
+    waiter->queued_us = monotonic_us();
+    waiter->next = NULL;
+    if (host->tail != NULL)
+        host->tail->next = waiter;
+    else
+        host->head = waiter;
+    host->tail = waiter;
+    host->waiting++;
+    total_waiting++;
+    total_queued++;
+    pthread_mutex_unlock(&host_lock);
+    return HOST_SLOT_QUEUED;
+}
+
+void* release_host_slot(const char *key) {
+    pthread_mutex_lock(&host_lock);
+    host_t *host = find_host(key, false);
+    if (host == NULL) {
+        // The slot was given without the table
+        pthread_mutex_unlock(&host_lock);
+        return NULL;
+    }
+
+    // The slot passes to the oldest waiting request, the count of the host stays the same
+    host_waiter_t *waiter = host->head;
+    void *request = NULL;
+    if (waiter != NULL) {
+        host->head = waiter->next;
+        if (host->head == NULL)
+            host->tail = NULL;
+        host->waiting--;
+        total_waiting--;
+
+        long waited_us = monotonic_us() - waiter->queued_us;
+        total_granted++;
+        total_wait_us += waited_us;
+        if (waited_us > max_wait_us)
+            max_wait_us = waited_us;
+        request = waiter->request;
+        free(waiter);
+    } else if (--host->active == 0) {
+        remove_host(host);
+    }
+    pthread_mutex_unlock(&host_lock);
+    return request;
+}
+
+void host_limits_usage(host_limits_usage_t *usage) {
+    pthread_mutex_lock(&host_lock);
+    usage->limit = max_per_host;
+    usage->hosts = num_hosts;
+    usage->waiting = total_waiting;
+    usage->queued = total_queued;
+    usage->refused = total_refused;
+    usage->wait_avg_us = total_granted > 0 ? total_wait_us / total_granted : 0;
+    usage->wait_max_us = max_wait_us;
+    pthread_mutex_unlock(&host_lock);
+}
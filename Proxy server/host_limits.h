@@ -0,0 +1,73 @@
+#ifndef HOST_LIMITS_H
+#define HOST_LIMITS_H
+
+#include <stdbool.h>
+
+/**
+ * host_limits.h
+ *
+ * Limits the upstream fetches in progress to every server host, so a slow host
+ * can hold at most that many threads of the pool and requests to other hosts
+ * don't wait behind it.
+ *
+ * A request that finds its host at the limit waits in the queue of the host
+ * without holding a thread. When a fetch of the host finishes, its thread takes
+ * the slot over to the first request of the queue and serves it next, so every
+ * host's queue moves as fast as its own slots free up, in arrival order. A full
+ * queue refuses the request.
+ *
+ * Hosts are kept only while they have fetches in progress or requests waiting.
+ */
+
+// buckets of the host table, must be a power of 2
+#define HOST_TABLE_SIZE 1024
+
+// longest key, host with port
+#define MAX_HOST_KEY 160
+
+typedef enum {
+    HOST_SLOT_TAKEN,    // the caller may fetch, it must release the slot
+    HOST_SLOT_QUEUED,   // the request waits in the queue of the host, the caller must leave it alone
+    HOST_SLOT_REFUSED   // the host is at its limit and its queue is full
+} host_slot_t;
+
+/**
+ * Usage of the limits for the statistics
+ */
+typedef struct host_limits_usage_st {
+    int limit;              // fetches allowed per host, 0 for no limit
+    int hosts;              // hosts with fetches in progress or requests waiting
+    long waiting;           // requests waiting now
+    long queued;            // requests that had to wait
+    long refused;           // requests refused because the queue of their host was full
+    long wait_avg_us;       // average wait of the requests that got a slot from the queue
+    long wait_max_us;
+} host_limits_usage_t;
+
+
+/**
+ * init_host_limits sets the limits, nothing is limited before it is called.
+ * @per_host - fetches in progress allowed to a host, 0 for no limit
+ * @queue_per_host - requests allowed to wait for a host, 0 to refuse the requests over the limit
+ */
+void init_host_limits(int per_host, int queue_per_host);
+
+bool host_limits_enabled();
+
+/**
+ * acquire_host_slot takes a slot of a host, or queues the request if the host is at its limit.
+ * @key - host with port
+ * @request - handed back by release_host_slot when the request gets a slot, NULL to not queue it
+ */
+host_slot_t acquire_host_slot(const char *key, void *request);
+
+/**
+ * release_host_slot frees the slot of a finished fetch.
+ * @ return value - the request that waited longest for the host, the slot passes to it and the
+ *   caller must serve it, or NULL
+ */
+void* release_host_slot(const char *key);
+
+void host_limits_usage(host_limits_usage_t *usage);
+
+#endif //HOST_LIMITS_H
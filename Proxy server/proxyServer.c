@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,24 @@
 #include <stdbool.h>
 #include <netdb.h>
 #include "threadpool.h"
+#include "upstream_health.h"
+#include "access_log.h"
+#include "proxy_stats.h"
+#include "admission.h"
+#include "handoff.h"
+#include "uring_engine.h"
+#include "buffer_pool.h"
+#include "coalesce.h"
+#include "disk_cache.h"
+#include "filter_image.h"
+#include "host_limits.h"
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #define BIG_BUFFER_SIZE (8*1024)
 #define BUFFER_SIZE (1024)
@@ -17,11 +33,113 @@
 #define SMALL_BUFFER_SIZE 128
 #define number_of_arguments 4
 
+// Socket syscalls go through COUNTED so the statistics can compare the engines
+#define COUNTED(call) (stats_syscalls(1), (call))
 
+// Connection defaults, can be changed with --connect-timeout and --connect-stagger
+#define DEFAULT_CONNECT_TIMEOUT_MS 3000
+#define DEFAULT_CONNECT_STAGGER_MS 250
 
-/** PROBLEMS
- * - cononection timeout is very long, I am assuming that it is not a problem as we were instructed that adding a connection timeout is unnecessary
- * */
+// Ejection defaults, can be changed with --eject-after and --eject-time
+#define DEFAULT_EJECT_AFTER_FAILURES 3
+#define DEFAULT_EJECT_TIME_MS 10000
+
+// Admission defaults, can be changed with --queue-target, --queue-interval,
+// --max-queue, --client-rate and --client-burst
+#define DEFAULT_QUEUE_TARGET_MS 5
+#define DEFAULT_QUEUE_INTERVAL_MS 100
+#define DEFAULT_CLIENT_BURST 20
+
+// Buffer pool defaults, can be changed with --buffer-size, --buffers and --buffer-memory.
+// A request takes two buffers, the pool gets BUFFERS_PER_THREAD for every thread by default
+#define DEFAULT_BUFFER_SIZE (16*1024)
+#define BUFFERS_PER_THREAD 4
+
+// Coalescing is off by default, --coalesce=on enables it. A flight stops taking new
+// followers once its response is longer than --coalesce-max-bytes
+#define DEFAULT_COALESCE_MAX_BYTES (64*1024*1024)
+
+// Disk cache defaults, it is enabled with --cache-dir. Responses without max-age
+// stay fresh for --cache-ttl seconds
+#define DEFAULT_CACHE_SIZE (1024L*1024*1024)
+#define DEFAULT_CACHE_ENTRIES 16384
+#define DEFAULT_CACHE_TTL 60
+
+// A stale copy is only sent while it is revalidated if the server allows it with
+// stale-while-revalidate, or for --cache-stale seconds
+#define DEFAULT_CACHE_STALE 0
+
+// Per host limits are off by default, --host-limit enables them. Requests over the limit
+// wait for a slot, at most --host-queue of them per host
+#define DEFAULT_HOST_QUEUE 64
+
+// Room left after a request read into a pool buffer, for the headers set_connection_to_close
+// and add_validators may add
+#define REQUEST_HEADROOM 256
+
+// Optional settings given as "--name=value" after the positional arguments
+typedef struct {
+    long connect_timeout_ms;    // total time allowed for connecting to the server
+    long connect_stagger_ms;    // delay before racing the next resolved address
+    long eject_after_failures;  // consecutive connect failures before an IP is skipped
+    long eject_time_ms;         // how long a failing IP is skipped before it is probed
+    char *access_log_path;      // file for the access log, NULL if disabled
+    long stats_port;            // local port answering with statistics, 0 if disabled
+    long queue_target_ms;       // acceptable time for a connection to wait in the queue
+    long queue_interval_ms;     // time above the target after which connections are shed
+    long max_queue;             // connections allowed to wait in the queue, 0 for no limit
+    long client_rate;           // connections per second per client ip, 0 for no limit
+    long client_burst;          // connections a client ip may make at once
+    char *handoff_path;         // unix socket for handing the listening socket to a new process, NULL if disabled
+    bool inherit_state;         // also take the health table and filter from the old process
+    bool use_uring;             // serve with the io_uring engine instead of a thread per request
+    bool uring_splice;          // the io_uring engine relays with splice instead of provided buffers
+    long buffer_size;           // size of the pooled request and relay buffers
+    long buffers;               // buffers in the pool, 0 for BUFFERS_PER_THREAD per thread
+    bool huge_buffers;          // back the buffer pool with huge pages
+    bool coalesce;              // concurrent identical GETs share one fetch
+    long coalesce_max_bytes;    // response length after which a flight takes no new followers
+    char *cache_dir;            // directory of the disk cache, NULL if disabled
+    long cache_size;            // bytes of objects the disk cache keeps
+    long cache_entries;         // slots of the disk cache index
+    long cache_ttl;             // seconds a response without max-age is fresh, 0 to not cache it
+    long cache_stale;           // seconds a stale copy may be sent while it is revalidated
+    long host_limit;            // upstream fetches in progress per host, 0 for no limit
+    long host_queue;            // requests that may wait for a slot of a host
+} ProxyOptions;
+
+static ProxyOptions options = {
+    DEFAULT_CONNECT_TIMEOUT_MS,
+    DEFAULT_CONNECT_STAGGER_MS,
+    DEFAULT_EJECT_AFTER_FAILURES,
+    DEFAULT_EJECT_TIME_MS,
+    NULL,
+    0,
+    DEFAULT_QUEUE_TARGET_MS,
+    DEFAULT_QUEUE_INTERVAL_MS,
+    0,
+    0,
+    DEFAULT_CLIENT_BURST,
+    NULL,
+    false,
+    false,
+    false,
+    DEFAULT_BUFFER_SIZE,
+    0,
+    false,
+    false,
+    DEFAULT_COALESCE_MAX_BYTES,
+    NULL,
+    DEFAULT_CACHE_SIZE,
+    DEFAULT_CACHE_ENTRIES,
+    DEFAULT_CACHE_TTL,
+    DEFAULT_CACHE_STALE,
+    0,
+    DEFAULT_HOST_QUEUE
+};
+
+// Set by SIGTERM and SIGINT, the accept loop stops and the pool drains
+static volatile sig_atomic_t stop_requested = 0;
 
 // For testing ===================================================
 // 1. http://jsonplaceholder.typicode.com/posts/1
@@ -31,30 +149,72 @@
 // 5. http://placekitten.com/200/300
 // 6. http://www.josephwcarrillo.com/news.html
 // 7. http://www.josephwcarrillo.com/index.html
+// Without network access: benchmark/runBenchmark.sh uses a local origin
 // ================================================================
 
 // Struct to hold client socket file descriptor
 typedef struct {
     int client_socket;
-    char** filter;
-    int filter_len;
+    struct sockaddr_in client_address;
+    long accepted_us;   // when the connection was accepted, for the queue delay
+    const filter_t *filter;
+    threadpool *tp;     // runs the background revalidations
 } ClientInfo;
 
+// A stale cached object revalidated after its stale copy was sent
+typedef struct {
+    char *request;      // the client's request with the validators added
+    char key[MAX_FLIGHT_KEY];
+    cache_validators_t validators;
+    const filter_t *filter;
+} RevalidateJob;
+
+// A request waiting for a slot of its host, it holds no thread while it waits
+typedef struct {
+    ClientInfo *client_info;
+    char *request_buffer;
+    char *response;
+    access_record_t record;
+    long start_us;
+} PendingRequest;
+
 void code_to_str(int code, char* buffer, char* message_buffer);
 void generate_error_response(char *buffer, int code);
 void set_connection_to_close(char *request);
 void handle_client(void *arg);
+PendingRequest* serve_request(ClientInfo *client_info, char *request_buffer, char *response,
+                              const access_record_t *started, long start_us, bool holds_slot);
+void serve_waiting_requests(PendingRequest *next);
+void shed_client(int client_socket, const struct sockaddr_in *client_address, long accepted_us);
 int handle_client_wrapper(void *arg);
 void print_usage_error_and_quit();
+void parse_option(const char *arg);
+bool option_is(const char *arg, const char *name);
 void parse_arguments(int argc, char *argv[], long *port, long *pool_size, long *max_number_of_requests, char **filter_absolute_address);
-char** parseFile(const char* filepath, int* numLines);
-void handle_error(const char *msg, char** filter, int filter_len, int server_fd, threadpool* tp);
+void handle_error(const char *msg, filter_t *filter, int server_fd, threadpool* tp);
 void getPortFromName(const char *hostname_with_port, in_port_t *port);
 bool validateAndParseRequest(const char *request, char *method, char *path, char* protocol, char *host);
-bool compareToFilter(const char **ipArr, int ip_size, const char **filter, int filter_size, char* hostname);
+bool copy_request_token(const char **cursor, const char *line_end, bool to_line_end, char *dest, size_t dest_size);
+int check_request(const char *request_buffer, const filter_t *filter, struct hostent *server_entry,
+                  char *dns_buffer, size_t dns_buffer_size, struct hostent **server_info, in_port_t *port,
+                  access_record_t *record);
 bool is_socket_closed(int sockfd);
-bool generate_response(int status_code, char *response_buffer, char *request_buffer, struct hostent* server_info, int server_port, int client_socket);
-
+long now_ms();
+long now_us();
+void request_stop(int signal_number);
+int open_listening_socket(long port, int backlog, filter_t *filter, threadpool* tp);
+int start_connect(const char *address, int server_port, bool *connected);
+int connect_to_server(struct hostent* server_info, int server_port);
+bool generate_response(int status_code, char *response_buffer, char *request_buffer, struct hostent* server_info, int server_port, int client_socket, access_record_t *record, flight_t *flight, cache_writer_t *cache_writer);
+void follow_response(flight_t *flight, char *response_buffer, int client_socket, access_record_t *record);
+bool make_request_key(const char *request_buffer, char *key, size_t key_size);
+void add_validators(char *request, const cache_validators_t *validators);
+void revalidate_in_background(const char *request_buffer, const char *key, const cache_validators_t *validators,
+                              ClientInfo *client_info);
+int revalidate_job(void *arg);
+
+// The benchmarks link this file without its main
+#ifndef PROXY_SERVER_NO_MAIN
 int main(int argc, char* argv[]) {
 
     // Initiating variables for arguments
@@ -64,6 +224,78 @@ int main(int argc, char* argv[]) {
     // parse arguments
     parse_arguments(argc, argv, &port, &pool_size, &max_number_of_requests, &filter_absolute_address);
 
+    /* SIGTERM and SIGINT stop the accept loop. They stay blocked everywhere except
+     * while the main thread waits in ppoll, so the threads created below never take them
+     * and the loop can't miss one between checking the flag and waiting */
+    sigset_t stop_signals, serve_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &serve_mask);
+    sigdelset(&serve_mask, SIGTERM);
+    sigdelset(&serve_mask, SIGINT);
+
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigemptyset(&stop_action.sa_mask);
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+
+    // A client that goes away must not kill a proxy that runs for days
+    signal(SIGPIPE, SIG_IGN);
+
+    // Set the policy for skipping failing server addresses
+    init_upstream_health((int) options.eject_after_failures, options.eject_time_ms, options.connect_timeout_ms);
+
+    // Take the listening socket (and maybe the state) from a running proxy
+    int server_fd = -1;
+    handoff_state_t inherited;
+    memset(&inherited, 0, sizeof(inherited));
+    if (options.handoff_path != NULL) {
+        server_fd = handoff_receive(options.handoff_path, options.inherit_state, &inherited);
+
+        // The old process must have been serving the same port
+        struct sockaddr_in bound;
+        socklen_t bound_len = sizeof(bound);
+        if (server_fd >= 0 && (getsockname(server_fd, (struct sockaddr *)&bound, &bound_len) < 0 ||
+                               ntohs(bound.sin_port) != port)) {
+            fprintf(stderr, "error: the inherited socket is not listening on port %ld\n", port);
+            exit(EXIT_FAILURE);
+        }
+        if (server_fd >= 0)
+            printf("inherited the listening socket from %s%s\n", options.handoff_path,
+                   inherited.has_state ? " with its state" : "");
+    }
+
+    // Prepare the response for connections that are shed under overload
+    char response_503[BIG_BUFFER_SIZE];
+    generate_error_response(response_503, 503);
+    init_admission(options.queue_target_ms * 1000, options.queue_interval_ms * 1000, (int) options.max_queue,
+                   (double) options.client_rate, (double) options.client_burst, response_503);
+
+    // Allocate the request and relay buffers of the workers
+    if (init_buffer_pool((size_t) options.buffer_size,
+                         (int) (options.buffers != 0 ? options.buffers : pool_size * BUFFERS_PER_THREAD),
+                         options.huge_buffers ? BUFFER_MEMORY_HUGE : BUFFER_MEMORY_NORMAL) != 0)
+        exit(EXIT_FAILURE);
+
+    // Set how much of a response coalesced requests share
+    init_coalescing((size_t) options.coalesce_max_bytes);
+
+    // Limit the fetches to every host, a slow host can only hold --host-limit threads
+    init_host_limits((int) options.host_limit, (int) options.host_queue);
+
+    // Map the index of the disk cache, the objects of the last run are served right away
+    if (options.cache_dir != NULL &&
+        init_disk_cache(options.cache_dir, (int) options.cache_entries, options.cache_size, options.cache_ttl,
+                        options.cache_stale) != 0)
+        exit(EXIT_FAILURE);
+
+    // Start the access log before any request can arrive
+    if (options.access_log_path != NULL && start_access_log(options.access_log_path) != 0)
+        exit(EXIT_FAILURE);
+
     // Create a thread pool with 4 threads
     threadpool *tp = create_threadpool((int) pool_size);
 
@@ -73,128 +305,374 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // parse filter file into array
-    int filter_len;
-    char **filter = parseFile(filter_absolute_address, &filter_len);
+    // Map the filter image, or compile a text filter, unless the old process handed its filter over
+    filter_t *filter = inherited.filter != NULL ? inherited.filter : load_filter(filter_absolute_address);
 
-    // check if filter parsing was correct
+    // check if filter loading was correct
     if (filter == NULL) {
         destroy_threadpool(tp);
         exit(EXIT_FAILURE);
     }
 
-    // Initiating variables for socket info
-    int server_fd, client_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-
-    // Creating socket file descriptor for IPv4, TCP connection
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == 0)
-        handle_error("error: socket\n", filter, filter_len, -1, tp);
+    // Start answering statistics requests
+    if (options.stats_port != 0 && start_stats_server((int) options.stats_port, tp) != 0)
+        handle_error("error: stats server\n", filter, server_fd, tp);
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
-        handle_error("error: setsockopt\n", filter, filter_len, server_fd, tp);
+    // A fresh start creates the socket, 0 requests means serving until stopped
+    if (server_fd < 0)
+        server_fd = open_listening_socket(port, max_number_of_requests == 0 ? SOMAXCONN : (int) max_number_of_requests,
+                                          filter, tp);
 
-    // Specify address family of Internet Protocol v4 addresses
-    address.sin_family = AF_INET;
-    // Set the IP address of the socket to indicate that the socket can accept connections
-    // from any network interface on the system.
-    address.sin_addr.s_addr = INADDR_ANY;
+    // Another process may accept from the same socket during a handoff, never block in accept
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
 
-    // Set the port number of the socket to the specified port.
-    address.sin_port = htons(port);
+    // Wait for the next process on the handoff socket
+    int handoff_fd = -1;
+    if (options.handoff_path != NULL && (handoff_fd = handoff_listen(options.handoff_path)) < 0)
+        handle_error("error: handoff socket\n", filter, server_fd, tp);
 
-    // Forcefully attaching socket to the port 8080
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
-        handle_error("error: bind\n", filter, filter_len, server_fd, tp);
+    // Initiating variables for socket info
+    int client_socket;
+    struct sockaddr_in address;
+    int addrlen = sizeof(address);
+    long accepted = 0;
+    bool handed_over = false;
+    bool served = false;
+
+    // The io_uring engine does the whole accept loop itself
+    if (options.use_uring) {
+        uring_config_t uring_config = { options.connect_timeout_ms, options.uring_splice, max_number_of_requests,
+                                        handoff_fd, &serve_mask, &stop_requested };
+        int result = run_uring_engine(server_fd, tp, filter, &uring_config);
+        if (result >= 0) {
+            served = true;
+            handed_over = result == 1;
+        } else {
+            fprintf(stderr, "error: io_uring is not available, serving with threads\n");
+        }
+    }
 
-    // Start listening to server
-    if (listen(server_fd, (int) max_number_of_requests) < 0) // Listen for a single connection
-        handle_error("error: listen\n", filter, filter_len, server_fd, tp);
+    // Dispatch tasks to the thread pool until the limit, a stop signal or a handoff
+    while (!served && !stop_requested && (max_number_of_requests == 0 || accepted < max_number_of_requests)) {
 
+        struct pollfd fds[2] = { { server_fd, POLLIN, 0 }, { handoff_fd, POLLIN, 0 } };
+        if (COUNTED(ppoll(fds, handoff_fd < 0 ? 1 : 2, NULL, &serve_mask)) < 0) {
+            if (errno == EINTR)
+                continue;
+            handle_error("error: poll\n", filter, server_fd, tp);
+        }
 
-    // Dispatch tasks to the thread pool
-    for (int i = 0; i < max_number_of_requests; i++) {
+        // A new process took the listening socket, stop accepting and drain
+        if ((fds[1].revents & POLLIN) && handoff_send(handoff_fd, server_fd, filter) == 0) {
+            handed_over = true;
+            break;
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
 
         // Create the socket for the client
-        if ((client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0)
-            handle_error("error: accept\n", filter, filter_len, server_fd, tp);
+        addrlen = sizeof(address);
+        if ((client_socket = COUNTED(accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen))) < 0) {
+            // Another process took the connection, or the client gave up
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Out of descriptors, the finishing requests free some
+            if (errno == EMFILE || errno == ENFILE) {
+                perror("error: accept\n");
+                usleep(10000);
+                continue;
+            }
+            handle_error("error: accept\n", filter, server_fd, tp);
+        }
+        accepted++;
+        long accepted_us = now_us();
+
+        // Answer right away when the pool can't take the connection
+        if (admit(address.sin_addr.s_addr, get_queue_size(tp), accepted_us) != ADMIT) {
+            shed_client(client_socket, &address, accepted_us);
+            continue;
+        }
 
         // Allocate memory for client_info
         ClientInfo *client_info = (ClientInfo *)malloc(sizeof(ClientInfo));
         if (client_info == NULL)
-            handle_error("error: malloc\n", filter, filter_len, server_fd, tp);
+            handle_error("error: malloc\n", filter, server_fd, tp);
 
-        // Add socket to client info
+        // Add socket and client address to client info
         client_info->client_socket = client_socket;
+        client_info->client_address = address;
+        client_info->accepted_us = accepted_us;
 
-        // Add filter array to the threads and the length
+        // Add the filter to the threads
         client_info->filter = filter;
-        client_info->filter_len = filter_len;
+        client_info->tp = tp;
 
         // Dispatch task to handle the client connection
         dispatch(tp, (dispatch_fn) handle_client_wrapper, client_info);
     }
 
-    // Destroy the thread pool
+    // Stop accepting: after a handoff the socket lives on in the new process
+    close(server_fd);
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+        // The path belongs to the new process after a handoff
+        if (!handed_over)
+            unlink(options.handoff_path);
+    }
+    if (handed_over || stop_requested)
+        printf("%s, draining %d queued connections\n", handed_over ? "handed over to the new process" : "stopping",
+               get_queue_size(tp));
+
+    // Stop the statistics server, it reads the pool
+    stop_stats_server();
+
+    // Destroy the thread pool, the queued connections are served first
     destroy_threadpool(tp);
 
-    // close server socket
-    close(server_fd);
-    
-    // Free allocated memory for filter
-    for (int i = 0; i < filter_len; ++i)
-        free(filter[i]);
-    free(filter);
+    // Write the rest of the access log
+    stop_access_log();
+
+    // Every worker returned its buffers
+    destroy_buffer_pool();
+    close_disk_cache();
+
+    // Unmap the filter
+    close_filter(filter);
 
     return EXIT_SUCCESS;
 }
 
+// Create, bind and listen on the server socket
+int open_listening_socket(long port, int backlog, filter_t *filter, threadpool* tp) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    // Creating socket file descriptor for IPv4, TCP connection
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        handle_error("error: socket\n", filter, -1, tp);
+
+    // Set socket options
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
+        handle_error("error: setsockopt\n", filter, server_fd, tp);
+
+    // Specify address family of Internet Protocol v4 addresses
+    address.sin_family = AF_INET;
+    // Set the IP address of the socket to indicate that the socket can accept connections
+    // from any network interface on the system.
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    // Set the port number of the socket to the specified port.
+    address.sin_port = htons(port);
+
+    // Forcefully attaching socket to the port 8080
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        handle_error("error: bind\n", filter, server_fd, tp);
+
+    // Start listening to server
+    if (listen(server_fd, backlog) < 0)
+        handle_error("error: listen\n", filter, server_fd, tp);
+
+    return server_fd;
+}
+
+// Signal handler of SIGTERM and SIGINT
+void request_stop(int signal_number) {
+    (void) signal_number;
+    stop_requested = 1;
+}
+#endif // PROXY_SERVER_NO_MAIN
+
 // Function to handle a client connection
 void handle_client(void *arg) {
 
     // Retrieve argument
     ClientInfo *client_info = (ClientInfo *)arg;
     const int client_socket = client_info->client_socket;
-    const int filter_len = client_info->filter_len;
-    const char** filter = (const char **) client_info->filter;
-
-    // Initiate variable for request buffer
-    char request_buffer[BIG_BUFFER_SIZE] = {0};
-    memset(request_buffer,0,BIG_BUFFER_SIZE);
-    ssize_t valread;
 
-    // Initiate variable for response buffer
-    char response[BIG_BUFFER_SIZE];
-    memset(response,0,BIG_BUFFER_SIZE);
+    // Shed the connection if it waited too long while the proxy is overloaded
+    long start_us = now_us();
+    if (observe_queue_delay(start_us - client_info->accepted_us, start_us)) {
+        shed_client(client_socket, &client_info->client_address, client_info->accepted_us);
+        free(client_info);
+        return;
+    }
 
-    // Receive message from client
-    valread = read(client_socket, request_buffer, BIG_BUFFER_SIZE);
+    // Start the access log record of this request
+    stats_request_started();
+    access_record_t record;
+    memset(&record, 0, sizeof(record));
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    inet_ntop(AF_INET, &client_info->client_address.sin_addr, record.client, sizeof(record.client));
+
+    // Take the request and response buffers from the pool, they are not cleared,
+    // the request is terminated after the read
+    char *request_buffer = checkout_buffer();
+    char *response = checkout_buffer();
+    ssize_t valread = 0;
+
+    // Receive message from client, checkout_buffer reported a failed allocation already
+    if (request_buffer != NULL && response != NULL) {
+        valread = COUNTED(read(client_socket, request_buffer, buffer_pool_buffer_size() - REQUEST_HEADROOM));
+        if (valread < 0)
+            perror("error: read\n");
+    }
     if (valread <= 0) {
-        perror("error: read\n");
+        stats_request_finished(0, 0, now_us() - start_us);
+        return_buffer(request_buffer);
+        return_buffer(response);
         free(client_info); // free alloc
-        close(client_socket); // Close the socket
+        COUNTED(close(client_socket)); // Close the socket
         return; // Exit the thread
     }
+    request_buffer[valread] = '\0';
+
+    // Serve the request, then the requests of its host this thread takes over after it
+    serve_waiting_requests(serve_request(client_info, request_buffer, response, &record, start_us, false));
+}
+
+// Serve a request that was read. Takes over the socket, the buffers and client_info.
+// holds_slot is true for a request that got the slot of its host from the queue.
+// Returns the next waiting request of the host if the slot passed to it, this thread must serve it.
+PendingRequest* serve_request(ClientInfo *client_info, char *request_buffer, char *response,
+                              const access_record_t *started, long start_us, bool holds_slot) {
+    const int client_socket = client_info->client_socket;
+    const filter_t *filter = client_info->filter;
+    access_record_t record = *started;
+
+    // Parse, resolve and filter the request
+    in_port_t port = 80;
+    struct hostent* server_info = NULL;
+    struct hostent server_entry;
+    char dns_buffer[BIG_BUFFER_SIZE];
+    int status_code = check_request(request_buffer, filter, &server_entry, dns_buffer, sizeof(dns_buffer),
+                                    &server_info, &port, &record);
+    char host_key[MAX_HOST_KEY];
+    snprintf(host_key, sizeof(host_key), "%s:%d", record.host, (int) port);
+
+    // Responses that don't depend on the client can come from the cache or another request's fetch
+    char request_key[MAX_FLIGHT_KEY];
+    bool shareable = status_code == 200 && (options.coalesce || disk_cache_enabled()) &&
+                     can_coalesce(request_buffer) && make_request_key(request_buffer, request_key, sizeof(request_key));
+
+    // Send a fresh copy from the disk cache, or a stale one that is revalidated meanwhile
+    cache_validators_t validators;
+    cache_result_t cached = CACHE_MISS;
+    PendingRequest *next = NULL;
+    if (shareable && disk_cache_enabled()) {
+        cached = cache_serve(request_key, client_socket, &record.bytes_relayed, &validators);
+        record.cache = cached == CACHE_HIT ? "hit" : cached == CACHE_MISS || cached == CACHE_EXPIRED ? "miss" : "stale";
+    }
+    if (cached == CACHE_HIT || cached == CACHE_STALE || cached == CACHE_REVALIDATE) {
+        record.status = 200;
+        if (cached == CACHE_REVALIDATE)
+            revalidate_in_background(request_buffer, request_key, &validators, client_info);
+    } else {
+        // Identical GETs that arrive together share one fetch, a request whose response is already
+        // being fetched follows it without a slot of the host
+        bool can_follow = shareable && options.coalesce && cached != CACHE_EXPIRED;
+        flight_t *flight = NULL;
+        bool is_leader = true;
+        if (can_follow && host_limits_enabled() && !holds_slot && (flight = join_flight_in_progress(request_key)) != NULL)
+            is_leader = false;
+
+        // A host at its limit keeps the request in its queue, the thread is free for other hosts meanwhile.
+        // The request is queued as it was read, it is parsed again when it gets the slot
+        if (status_code == 200 && host_limits_enabled() && !holds_slot && flight == NULL) {
+            PendingRequest *pending = malloc(sizeof(PendingRequest));
+            if (pending != NULL)
+                *pending = (PendingRequest) { client_info, request_buffer, response, *started, start_us };
+            else
+                perror("error: malloc\n");
+            host_slot_t slot = acquire_host_slot(host_key, pending);
+            if (slot == HOST_SLOT_QUEUED)
+                return NULL;
+            free(pending);
+            holds_slot = slot == HOST_SLOT_TAKEN;
+            if (slot == HOST_SLOT_REFUSED) {
+                status_code = 503;
+                shareable = false;
+            }
+        }
+
+        // Ask the server if an expired copy changed, a revalidation is not shared with other requests.
+        // Its writer keeps the expired copy open for a 304, the validators are sent only if it could
+        cache_writer_t *cache_writer = NULL;
+        if (shareable && cached == CACHE_EXPIRED) {
+            cache_writer = cache_begin(request_key, &validators);
+            if (cache_revalidating(cache_writer))
+                add_validators(request_buffer, &validators);
+        }
+
+        // The first one of the identical GETs fetches for the others
+        if (can_follow && shareable && flight == NULL)
+            flight = join_flight(request_key, &is_leader);
+
+        // Generate and send response based on the resulting status code, the fetching request stores it
+        if (flight != NULL && !is_leader) {
+            // A follower does not connect, the next request of the host gets its slot and is served after it
+            if (holds_slot) {
+                next = release_host_slot(host_key);
+                holds_slot = false;
+            }
+            follow_response(flight, response, client_socket, &record);
+        } else {
+            if (cache_writer == NULL && shareable && disk_cache_enabled())
+                cache_writer = cache_begin(request_key, NULL);
+            generate_response(status_code, response,request_buffer, server_info, port, client_socket, &record, flight,
+                              cache_writer);
+        }
+    }
+
+    // The oldest request waiting for the host takes the slot over
+    if (holds_slot)
+        next = release_host_slot(host_key);
+
+    // Close the socket
+    COUNTED(close(client_socket));
+    return_buffer(request_buffer);
+    return_buffer(response);
+
+    // Queue the record for the access log writer
+    record.total_us = now_us() - start_us;
+    log_access(&record);
+    stats_request_finished(record.status, record.bytes_relayed, record.total_us);
+
+    // Free memory allocated for client_info
+    free(client_info);
+    return next;
+}
+
+// Serve the requests whose host slot passed to this thread, one after the other
+void serve_waiting_requests(PendingRequest *next) {
+    while (next != NULL) {
+        PendingRequest pending = *next;
+        free(next);
+        next = serve_request(pending.client_info, pending.request_buffer, pending.response, &pending.record,
+                             pending.start_us, true);
+    }
+}
 
+// Parse the request, resolve its host and check it against the filter.
+// Returns the status code, server_info points into server_entry when it is 200.
+// Used by both engines, the io_uring engine calls it from the pool.
+int check_request(const char *request_buffer, const filter_t *filter, struct hostent *server_entry,
+                  char *dns_buffer, size_t dns_buffer_size, struct hostent **server_info, in_port_t *port,
+                  access_record_t *record) {
 
     // Initiate variables for parsing the http request
     char method[SMALL_BUFFER_SIZE], path[MEDIUM_BUFFER_SIZE], protocol[SMALL_BUFFER_SIZE], host[MEDIUM_BUFFER_SIZE];
-    in_port_t port = 80;
     int status_code = 200;
 
-    memset(method,0, SMALL_BUFFER_SIZE);
-    memset(path,0, MEDIUM_BUFFER_SIZE);
-    memset(protocol,0, SMALL_BUFFER_SIZE);
-    memset(host,0, MEDIUM_BUFFER_SIZE);
+    // The parser terminates what it fills, a request it rejects may leave some empty
+    method[0] = path[0] = protocol[0] = host[0] = '\0';
+    *server_info = NULL;
 
     // Parse for method, path, protocol, host
     bool parsing_successful = validateAndParseRequest(request_buffer, method, path, protocol, host);
 
     // Get the port
-    getPortFromName(host, &port);
+    getPortFromName(host, port);
 
     // if parsed successfully check for supported method
     if (parsing_successful) {
@@ -204,275 +682,496 @@ void handle_client(void *arg) {
         status_code = 400;
     }
 
-    struct hostent* server_info = NULL;
+    // Remove the port from the host name before resolving and filtering it
+    char *port_separator = strrchr(host, ':');
+    if (port_separator != NULL)
+        *port_separator = '\0';
+
+    snprintf(record->host, sizeof(record->host), "%.*s", (int) sizeof(record->host) - 1, host);
+    snprintf(record->path, sizeof(record->path), "%.*s", (int) sizeof(record->path) - 1, path);
+
+    int dns_error;
     if (status_code == 200) { // If status code was not changed
 
-        /* Use gethostbyname to translate host name to network byte order ip address */
-        server_info = gethostbyname(host);
+        /* Use gethostbyname_r to translate host name to network byte order ip address,
+         * the address list must stay valid while connecting so the shared static
+         * result of gethostbyname can't be used from the worker threads */
+        long dns_start_us = now_us();
+        if (gethostbyname_r(host, server_entry, dns_buffer, dns_buffer_size, server_info, &dns_error) != 0)
+            *server_info = NULL;
+        record->dns_us = now_us() - dns_start_us;
 
-        if (server_info == NULL) { // If DNS servers does not find the ip for the host
+        if (*server_info == NULL) { // If DNS servers does not find the ip for the host
             status_code = 404;
         }
         else {
 
             // Check if the host gets filtered ==========================================
 
-            // Initilize array for ip addreses
-            char* ip_addresses[SMALL_BUFFER_SIZE];
+            // Collect the resolved addresses, they are compared as numbers
+            struct in_addr addresses[SMALL_BUFFER_SIZE];
             int len = 0;
-
-            // Loop through each IP address and store it in the array
-            for (int i = 0; server_info->h_addr_list[i] != NULL && i < SMALL_BUFFER_SIZE; i++) {
-
-                ip_addresses[i] = malloc(INET_ADDRSTRLEN * sizeof(char));
-                if (ip_addresses[i] == NULL) {
-                    for (int k = i - 1 ; k >= 0 ; k--) // free previous ip addresses
-                        free(ip_addresses[i]);
-                    perror("error: malloc\n");
-                    free(client_info); // free alloc
-                    close(client_socket); // Close the socket
-                    return;   // Exit the thread
-                }
-
-                struct in_addr addr;
-
-                memcpy(&addr, server_info->h_addr_list[i], sizeof(struct in_addr));
-                inet_ntop(AF_INET, &addr, ip_addresses[i], INET_ADDRSTRLEN);
+            for (int i = 0; (*server_info)->h_addr_list[i] != NULL && i < SMALL_BUFFER_SIZE; i++) {
+                memcpy(&addresses[i], (*server_info)->h_addr_list[i], sizeof(struct in_addr));
                 len++;
             }
 
-            // Compare ip array and hostname to filter
-            bool filtered = compareToFilter((const char **) ip_addresses, len, filter, filter_len, host);
+            // Compare the addresses and hostname to the filter
+            bool filtered = filter_blocks(filter, host, addresses, len);
+            stats_filter_checked(filtered);
             if (filtered)
                 status_code = 403;
-
-
-            // Free memory allocated for IP address strings
-            for (int i = 0; i < len; i++) {
-                free(ip_addresses[i]);
-            }
             // filtering ===============================================================
         }
     }
+    return status_code;
+}
 
-    // Generate and send response based on the resulting status code
-    generate_response(status_code, response,request_buffer, server_info, port, client_socket);
-
-    // Close the socket
-    close(client_socket);
-
-    // Free memory allocated for client_info
-    free(client_info);
+// Send the prepared 503 to a connection the pool can't take
+void shed_client(int client_socket, const struct sockaddr_in *client_address, long accepted_us) {
+    access_record_t record;
+    memset(&record, 0, sizeof(record));
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    inet_ntop(AF_INET, &client_address->sin_addr, record.client, sizeof(record.client));
+
+    stats_request_started();
+    record.status = 503;
+    record.bytes_relayed = shed_connection(client_socket);
+    stats_syscalls(2);
+    record.total_us = now_us() - accepted_us;
+
+    log_access(&record);
+    stats_request_finished(record.status, record.bytes_relayed, record.total_us);
 }
 
 // Function to generate response based on status code
-bool generate_response(int status_code, char *response_buffer, char *request_buffer, struct hostent* server_info, int server_port, const int client_socket) {
+bool generate_response(int status_code, char *response_buffer, char *request_buffer, struct hostent* server_info, int server_port, const int client_socket, access_record_t *record, flight_t *flight, cache_writer_t *cache_writer) {
     long bytes_sent_to_dest, bytes_received;
-    int sockfd;
-    struct sockaddr_in server_addr;
+    int sockfd = -1;
 
     if (status_code == 200) {
-        // Create socket
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0) {
-            perror("error: socket\n");
-            return false;
-        }
-
-        // Fill in the server address structure
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(server_port);
-        memcpy(&server_addr.sin_addr.s_addr, server_info->h_addr, server_info->h_length);
-
-        // Connect to server
-        if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-            perror("error: connect\n");
-            close(sockfd);
-            return false;
-        }
+        // Connect to the first server address that answers
+        long connect_start_us = now_us();
+        sockfd = connect_to_server(server_info, server_port);
+        record->connect_us = now_us() - connect_start_us;
+
+        // No address of the server answered
+        if (sockfd < 0)
+            status_code = 500;
+    }
+    record->status = status_code;
 
+    if (status_code == 200) {
         // Set connection to closed
         set_connection_to_close(request_buffer);
 
         // Forward the request to the server
-        bytes_sent_to_dest = send(sockfd, request_buffer, strlen(request_buffer), 0);
+        bytes_sent_to_dest = COUNTED(send(sockfd, request_buffer, strlen(request_buffer), 0));
         if (bytes_sent_to_dest < 0) {
             perror("error: send\n");
-            close(sockfd);
+            COUNTED(close(sockfd));
+            if (flight != NULL)
+                finish_flight(flight, 500);
+            cache_finish(cache_writer, false);
             return false;
         }
 
-
-
-        // Transmit response back to client while there is still data left
+        // Transmit response back to client while there is still data left.
+        // A leader keeps fetching for its followers after its own client went away
+        bool complete = false, client_gone = false;
+        long total_received = 0;
         while (1) {
-            bytes_received = recv(sockfd, response_buffer, BIG_BUFFER_SIZE, 0);
+            bytes_received = COUNTED(recv(sockfd, response_buffer, buffer_pool_buffer_size(), 0));
             if (bytes_received < 0) {
                 perror("error: recv\n");
-                close(sockfd);
-                return false;
+                break;
             } else if (bytes_received == 0) {
-                close(sockfd);
-                return false;
+                complete = true;
+                break;
             }
+            total_received += bytes_received;
+            if (cache_writer != NULL)
+                cache_write(cache_writer, response_buffer, bytes_received);
 
-            if (is_socket_closed(client_socket)) {
-                close(sockfd);
-                return false;
-            }
+            // The client did not ask conditionally, a 304 refreshes the cached copy it gets instead
+            if (cache_not_modified(cache_writer))
+                continue;
+            if (flight != NULL)
+                flight_append(flight, response_buffer, bytes_received);
+
+            // A background revalidation has no client
+            if (!client_gone && (client_socket < 0 || is_socket_closed(client_socket)))
+                client_gone = true;
 
             // Send response back to client
-            ssize_t bytes_sent = send(client_socket, response_buffer, bytes_received, 0);
-            if (bytes_sent < 0) {
-                // Check for broken pipe error
-                if (errno == EPIPE) {
-                    // Handle broken pipe gracefully
-                    break;
+            if (!client_gone) {
+                ssize_t bytes_sent = COUNTED(send(client_socket, response_buffer, bytes_received, 0));
+                if (bytes_sent < 0) {
+                    // A broken pipe is the client going away
+                    if (errno != EPIPE)
+                        perror("error: send\n");
+                    client_gone = true;
                 } else {
-                    perror("error: send\n");
-                    close(sockfd);
-                    return false;
+                    record->bytes_relayed += bytes_sent;
                 }
             }
+            // A response that is being stored is fetched to the end as well
+            if (client_gone && !cache_storing(cache_writer) && (flight == NULL || !flight_keep_fetching(flight)))
+                break;
         }
 
         // Close the detination socket
-        close(sockfd);
+        COUNTED(close(sockfd));
+
+        // Followers of a fetch that got nothing answer 500 themselves
+        if (flight != NULL)
+            finish_flight(flight, total_received > 0 ? 200 : 500);
+        // The server confirmed the expired copy, the client gets it with the refreshed headers
+        if (complete && cache_not_modified(cache_writer)) {
+            record->cache = "revalidated";
+            if (client_socket >= 0 && !cache_send_not_modified(cache_writer, client_socket, &record->bytes_relayed)) {
+                cache_finish(cache_writer, complete);
+                return generate_response(500, response_buffer, NULL, NULL, 0, client_socket, record, NULL, NULL);
+            }
+        }
+        cache_finish(cache_writer, complete);
+        return complete;
     } else {
+        // The followers answer the same status
+        if (flight != NULL)
+            finish_flight(flight, status_code);
+        cache_finish(cache_writer, false);
+        if (client_socket < 0)
+            return false;
+
         generate_error_response(response_buffer, status_code);
+
+        // Send the error response to the client
+        ssize_t bytes_sent = COUNTED(send(client_socket, response_buffer, strlen(response_buffer), MSG_NOSIGNAL));
+        if (bytes_sent < 0) {
+            perror("error: send\n");
+            return false;
+        }
+        record->bytes_relayed = bytes_sent;
     }
     return true;
 }
 
-// Function to check if a socket is still open
-bool is_socket_closed(int sockfd) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    int ret = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-    if (ret != 0) {
-        // Error occurred while checking socket status
-        perror("error: getsockopt\n");
-        return true;
-    }
-    if (error != 0) {
-        // Socket is closed or has encountered an error
-        return true;
+// Send the response another request fetches, or its error status if the fetch failed
+void follow_response(flight_t *flight, char *response_buffer, int client_socket, access_record_t *record) {
+    long bytes_sent;
+    int status = follow_flight(flight, client_socket, response_buffer, buffer_pool_buffer_size(), &bytes_sent);
+    if (status != 200) {
+        generate_response(status, response_buffer, NULL, NULL, 0, client_socket, record, NULL, NULL);
+        return;
     }
-    // Socket is still open
-    return false;
+    record->status = status;
+    record->bytes_relayed = bytes_sent;
 }
 
-// Ceck if an ip address is in a given network address and subnet
-bool is_ip_in_network(const char *ip_with_mask, const char *ip_to_check) {
-    // Split IP address and mask
-    char *ip_mask_copy = strdup(ip_with_mask);
-    char *ip_str = strtok(ip_mask_copy, "/");
-    char *mask_str = strtok(NULL, "/");
-
-    // If no mask specified, assume /32
-    if (mask_str == NULL)
-        mask_str = "32";
-
-    // Convert IP address and mask to binary format
-    struct in_addr ip, network, mask;
-    if (inet_pton(AF_INET, ip_str, &ip) != 1 ||
-        inet_pton(AF_INET, "255.255.255.255", &mask) != 1) {
-        free(ip_mask_copy);
-        return false;
+// Ask the server for the response only if it differs from the cached one.
+// The request must have room for the headers, it grows by less than REQUEST_HEADROOM
+void add_validators(char *request, const cache_validators_t *validators) {
+    char *end_of_headers = strstr(request, "\r\n\r\n");
+    if (end_of_headers == NULL)
+        return;
+
+    char conditions[CACHE_ETAG_SIZE + CACHE_DATE_SIZE + 64];
+    int len = 0;
+    if (validators->etag[0] != '\0')
+        len += snprintf(conditions + len, sizeof(conditions) - len, "\r\nIf-None-Match: %s", validators->etag);
+    if (validators->last_modified[0] != '\0')
+        len += snprintf(conditions + len, sizeof(conditions) - len, "\r\nIf-Modified-Since: %s",
+                        validators->last_modified);
+    memmove(end_of_headers + len, end_of_headers, strlen(end_of_headers) + 1);
+    memcpy(end_of_headers, conditions, len);
+}
+
+// Queue the revalidation of a stale copy the client already got
+void revalidate_in_background(const char *request_buffer, const char *key, const cache_validators_t *validators,
+                              ClientInfo *client_info) {
+    RevalidateJob *job = malloc(sizeof(RevalidateJob));
+    char *request = malloc(strlen(request_buffer) + REQUEST_HEADROOM);
+    if (job == NULL || request == NULL) {
+        perror("error: malloc\n");
+        free(job);
+        free(request);
+        return;
     }
+    strcpy(request, request_buffer);
+    add_validators(request, validators);
+    job->request = request;
+    snprintf(job->key, sizeof(job->key), "%s", key);
+    job->validators = *validators;
+    job->filter = client_info->filter;
+    dispatch(client_info->tp, (dispatch_fn) revalidate_job, job);
+}
 
-    uint32_t prefix_bits = strtoul(mask_str, NULL, 10);
-    mask.s_addr = htonl((0xFFFFFFFFU << (32 - prefix_bits)));
+// Fetch a stale object with its validators, a 304 refreshes it and a 200 replaces it
+int revalidate_job(void *arg) {
+    RevalidateJob *job = (RevalidateJob *) arg;
+    access_record_t record;
+    memset(&record, 0, sizeof(record));
 
-    // Calculate network address
-    network.s_addr = ip.s_addr & mask.s_addr;
+    // The filter may have blocked the host since the object was stored
+    in_port_t port = 80;
+    struct hostent* server_info = NULL;
+    struct hostent server_entry;
+    char dns_buffer[BIG_BUFFER_SIZE];
+    int status_code = check_request(job->request, job->filter, &server_entry, dns_buffer, sizeof(dns_buffer),
+                                    &server_info, &port, &record);
+
+    // A revalidation never waits for a busy host, once the claim runs out a later request tries again
+    char host_key[MAX_HOST_KEY];
+    snprintf(host_key, sizeof(host_key), "%s:%d", record.host, (int) port);
+    bool holds_slot = false;
+    if (status_code == 200 && host_limits_enabled())
+        holds_slot = acquire_host_slot(host_key, NULL) == HOST_SLOT_TAKEN;
+
+    char *response = checkout_buffer();
+    if (status_code == 200 && response != NULL && (holds_slot || !host_limits_enabled()))
+        generate_response(status_code, response, job->request, server_info, port, -1, &record, NULL,
+                          cache_begin(job->key, &job->validators));
+    return_buffer(response);
+    free(job->request);
+    free(job);
+
+    // The oldest request waiting for the host takes the slot over
+    if (holds_slot)
+        serve_waiting_requests(release_host_slot(host_key));
+    return 0;
+}
 
-    // Convert IP address to binary format for comparison
-    struct in_addr ip_check;
-    if (inet_pton(AF_INET, ip_to_check, &ip_check) != 1) {
-        free(ip_mask_copy);
+// The key of a request for coalescing and the disk cache is its Host header and path, false if it is too long
+bool make_request_key(const char *request_buffer, char *key, size_t key_size) {
+    char method[SMALL_BUFFER_SIZE], path[MEDIUM_BUFFER_SIZE], protocol[SMALL_BUFFER_SIZE], host[MEDIUM_BUFFER_SIZE];
+    if (!validateAndParseRequest(request_buffer, method, path, protocol, host))
         return false;
-    }
+    return snprintf(key, key_size, "%s %s", host, path) < (int) key_size;
+}
 
-    // Check if IP address is in the network
-    bool result = ((ip_check.s_addr & mask.s_addr) == network.s_addr);
+// Current time of the monotonic clock in milliseconds
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
 
-    free(ip_mask_copy);
-    return result;
+// Current time of the monotonic clock in microseconds
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
 }
 
-// Check is string is an ip BASED ON ASSIGNMENT ASSUMPTION WHERE HOST NAMES DO NOT START WITH NUMBER
-bool is_ip_address(const char *str) {
-    // Check if the first character is a digit
-    if (isdigit(str[0])) {
-        return true; // First character indicates an IP address
+// Start a non-blocking connect to a single address, returns the socket or -1 on failure
+int start_connect(const char *address, int server_port, bool *connected) {
+    struct sockaddr_in server_addr;
+
+    // Create non-blocking socket
+    int sockfd = COUNTED(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0));
+    if (sockfd < 0) {
+        perror("error: socket\n");
+        return -1;
     }
-    return false;
+
+    // Fill in the server address structure
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    memcpy(&server_addr.sin_addr.s_addr, address, sizeof(struct in_addr));
+
+    *connected = false;
+    if (COUNTED(connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr))) == 0) {
+        *connected = true;
+    } else if (errno != EINPROGRESS) {
+        COUNTED(close(sockfd));
+        return -1;
+    }
+    return sockfd;
 }
 
-// Compre array of ip addresses and host to the filter file contents
-bool compareToFilter(const char **ipArr, int ip_size, const char **filter, int filter_size, char* hostname) {
-    for (int i = 0; i < ip_size; i++) {
-        for (int j = 0; j < filter_size; j++) {
+// Connect to one of the resolved addresses of the server (happy eyeballs).
+// The addresses are ordered by their health, the best one is tried right away and
+// every connect_stagger_ms another address joins the race (or immediately when an
+// attempt fails). The first connection to complete wins and the others are closed.
+// Returns a blocking socket or -1.
+int connect_to_server(struct hostent* server_info, int server_port) {
+    struct pollfd attempts[SMALL_BUFFER_SIZE];
+    char *addresses[SMALL_BUFFER_SIZE];
+    long started_at[SMALL_BUFFER_SIZE];
+    int num_resolved = 0, num_started = 0, num_pending = 0;
+    int winner = -1;
+
+    while (num_resolved < SMALL_BUFFER_SIZE && server_info->h_addr_list[num_resolved] != NULL)
+        num_resolved++;
+
+    // Skip addresses that keep failing and try the fastest ones first
+    int num_addresses = order_addresses(server_info->h_addr_list, num_resolved, addresses);
+
+    long deadline = now_ms() + options.connect_timeout_ms;
+    long next_start = 0;
+
+    while (winner < 0) {
+        long now = now_ms();
+        if (now >= deadline)
+            break;
 
-            bool result = false;
-            if (is_ip_address(filter[j])) {
-                result = is_ip_in_network(filter[j], ipArr[i]);
+        // Start the next attempt when its turn came or when nothing else is in flight
+        if (num_started < num_addresses && (num_pending == 0 || now >= next_start)) {
+            bool connected;
+            int sockfd = start_connect(addresses[num_started], server_port, &connected);
+            attempts[num_started].fd = sockfd;
+            attempts[num_started].events = POLLOUT;
+            attempts[num_started].revents = 0;
+            started_at[num_started] = now;
+            num_started++;
+            next_start = now + options.connect_stagger_ms;
+            if (connected) {
+                report_connect_success(addresses[num_started - 1], 0);
+                winner = sockfd;
+            } else if (sockfd >= 0) {
+                num_pending++;
             } else {
-                result = strcmp(hostname, filter[j]) == 0? true: false;
+                report_connect_failure(addresses[num_started - 1]);
             }
+            continue;
+        }
+
+        // Every address was tried and failed
+        if (num_pending == 0)
+            break;
+
+        // Wait for an attempt to finish, until the next attempt should start at most
+        long wake_up = (num_started < num_addresses && next_start < deadline) ? next_start : deadline;
+        int ready = COUNTED(poll(attempts, num_started, (int) (wake_up - now)));
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: poll\n");
+            break;
+        }
 
-            if (result)
-                return true;
+        for (int i = 0; i < num_started && ready > 0 && winner < 0; i++) {
+            if (attempts[i].fd < 0 || attempts[i].revents == 0)
+                continue;
+            ready--;
+
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (COUNTED(getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &len)) == 0 && error == 0) {
+                report_connect_success(addresses[i], now_ms() - started_at[i]);
+                winner = attempts[i].fd;
+            } else {
+                // This address failed, let the next one start right away
+                report_connect_failure(addresses[i]);
+                COUNTED(close(attempts[i].fd));
+                attempts[i].fd = -1;
+                num_pending--;
+                next_start = now;
+            }
+        }
+    }
 
+    // Close the sockets that lost the race, they were slower than the winner
+    // or did not connect before the deadline
+    long now = now_ms();
+    for (int i = 0; i < num_started; i++) {
+        if (attempts[i].fd >= 0 && attempts[i].fd != winner) {
+            if (winner >= 0)
+                report_connect_slow(addresses[i], now - started_at[i]);
+            else
+                report_connect_failure(addresses[i]);
+            COUNTED(close(attempts[i].fd));
         }
     }
-    return false;
-}
 
-// Function to validate and parse an HTTP request
-bool validateAndParseRequest(const char *request, char *method, char *path, char* protocol, char *host) {
-    // Initiate variables for parsing the HTTP request
-    char *token;
-    char *saveptr;
-    char *request_copy = strdup(request); // Make a copy of the request to avoid modifying the original
+    if (winner < 0) {
+        fprintf(stderr, "error: connect\n");
+        return -1;
+    }
 
-    // Extract method
-    token = strtok_r(request_copy, " ", &saveptr);
-    if (token == NULL)
-        return false;
-    strcpy(method, token);
+    // The rest of the relay uses blocking calls
+    int flags = COUNTED(fcntl(winner, F_GETFL, 0));
+    COUNTED(fcntl(winner, F_SETFL, flags & ~O_NONBLOCK));
+    return winner;
+}
 
-    // Extract path
-    token = strtok_r(NULL, " ", &saveptr);
-    if (token == NULL)
+// Function to check if a socket is still open
+bool is_socket_closed(int sockfd) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    int ret = COUNTED(getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len));
+    if (ret != 0) {
+        // Error occurred while checking socket status
+        perror("error: getsockopt\n");
+        return true;
+    }
+    if (error != 0) {
+        // Socket is closed or has encountered an error
+        return true;
+    }
+    // Socket is still open
+    return false;
+}
+
+// Copy the token of a request line or header that starts at *cursor and ends at a space or the line end,
+// fails if it is empty or does not fit
+bool copy_request_token(const char **cursor, const char *line_end, bool to_line_end, char *dest, size_t dest_size) {
+    const char *start = *cursor;
+    while (start < line_end && *start == ' ')
+        start++;
+    const char *end = to_line_end ? line_end : memchr(start, ' ', line_end - start);
+    if (end == NULL)
+        end = line_end;
+
+    size_t len = end - start;
+    if (len == 0 || len >= dest_size)
         return false;
-    strcpy(path, token);
+    memcpy(dest, start, len);
+    dest[len] = '\0';
+    *cursor = end;
+    return true;
+}
 
-    // Extract protocol
-    token = strtok_r(NULL, "\r\n", &saveptr);
-    if (token == NULL)
+// Function to validate and parse an HTTP request, method and protocol must hold SMALL_BUFFER_SIZE
+// bytes and path and host MEDIUM_BUFFER_SIZE, longer values make the request invalid
+bool validateAndParseRequest(const char *request, char *method, char *path, char* protocol, char *host) {
+    // Only the request line is split, the request itself is not copied
+    const char *line_end = strstr(request, "\r\n");
+    if (line_end == NULL)
+        line_end = request + strlen(request);
+    const char *cursor = request;
+
+    // Extract method, path and protocol
+    if (!copy_request_token(&cursor, line_end, false, method, SMALL_BUFFER_SIZE) ||
+        !copy_request_token(&cursor, line_end, false, path, MEDIUM_BUFFER_SIZE) ||
+        !copy_request_token(&cursor, line_end, true, protocol, SMALL_BUFFER_SIZE))
         return false;
-    strcpy(protocol, token);
 
     // Check if the protocol is one of the HTTP versions
     if (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0 && strcmp(protocol, "HTTP/2.0") != 0)
         return false;
 
-    // Extract host
-    token = strstr(request, "Host: ");
+    // Extract host, the whole value up to the end of its line without the trailing spaces
+    const char *token = strstr(request, "Host: ");
     if (token == NULL)
         return false;
-    sscanf(token, "Host: %s", host);
+    cursor = token + strlen("Host: ");
+    const char *host_end = strstr(cursor, "\r\n");
+    if (host_end == NULL)
+        host_end = cursor + strlen(cursor);
+    while (host_end > cursor && (host_end[-1] == ' ' || host_end[-1] == '\t'))
+        host_end--;
+    if (!copy_request_token(&cursor, host_end, true, host, MEDIUM_BUFFER_SIZE))
+        return false;
 
-    free(request_copy); // Free the allocated memory for the copy
     return true;
 }
 
 // Parse arguments from the main
 void parse_arguments(int argc, char *argv[], long *port, long *pool_size, long *max_number_of_requests, char **filter_absolute_address) {
-    if (argc != number_of_arguments + 1)
+    if (argc < number_of_arguments + 1)
         print_usage_error_and_quit();
 
     // Parse and validate port
@@ -488,78 +1187,156 @@ void parse_arguments(int argc, char *argv[], long *port, long *pool_size, long *
 
     // Parse and validate max number of requests
     *max_number_of_requests = strtol(argv[3], &endptr, 10);
-    if (*endptr != '\0' || *max_number_of_requests <= 0)
+    if (*endptr != '\0' || *max_number_of_requests < 0)
         print_usage_error_and_quit();
 
     // Assign filter absolute address
     *filter_absolute_address = argv[4];
+
+    // Parse the optional settings
+    for (int i = number_of_arguments + 1; i < argc; i++)
+        parse_option(argv[i]);
 }
 
-// Get contents from a file and return array of lines seperated by new space
-char** parseFile(const char* filepath, int* numLines) {
-    // Opening file
-    FILE* file = fopen(filepath, "r");
-    if (!file) {
-        perror("error: open\n");
-        return NULL;
-    }
-    // Creating array of lines from the filter file
-    char** lines = (char**)malloc(BUFFER_SIZE * sizeof(char*));
-    if (!lines) {
-        fclose(file);
-        perror("error: malloc\n");
-        return NULL;
-    }
+// Parse a single "--name=value" option into the global options
+void parse_option(const char *arg) {
+    const char *value = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || value == NULL)
+        print_usage_error_and_quit();
+    value++;
 
-    char buffer[BIG_BUFFER_SIZE];
-    int count = 0;
-    while (fgets(buffer, BIG_BUFFER_SIZE, file)) {
-        if (count >= BIG_BUFFER_SIZE) {
-            fprintf(stderr, "Too many lines in the file\n");
-            break;
-        }
-        // Remove the newline character from the end of the line
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len - 1] == '\n')
-            buffer[len - 1] = '\0';
-        lines[count] = strdup(buffer);
-        if (!lines[count]) {
-            perror("error: malloc\n");
-            fclose(file);
-            for (int i = 0; i < count; ++i)
-                free(lines[i]);
-            free(lines);
-            return NULL;
-        }
-        count++;
-    }
+    char *endptr;
+    long number = strtol(value, &endptr, 10);
+    bool is_positive_number = *value != '\0' && *endptr == '\0' && number > 0;
+    bool is_number = *value != '\0' && *endptr == '\0' && number >= 0;
+
+    if (option_is(arg, "--connect-timeout=") && is_positive_number)
+        options.connect_timeout_ms = number;
+    else if (option_is(arg, "--connect-stagger=") && is_positive_number)
+        options.connect_stagger_ms = number;
+    else if (option_is(arg, "--eject-after=") && is_positive_number)
+        options.eject_after_failures = number;
+    else if (option_is(arg, "--eject-time=") && is_positive_number)
+        options.eject_time_ms = number;
+    else if (option_is(arg, "--queue-target=") && is_positive_number)
+        options.queue_target_ms = number;
+    else if (option_is(arg, "--queue-interval=") && is_positive_number)
+        options.queue_interval_ms = number;
+    else if (option_is(arg, "--max-queue=") && is_positive_number)
+        options.max_queue = number;
+    else if (option_is(arg, "--client-rate=") && is_positive_number)
+        options.client_rate = number;
+    else if (option_is(arg, "--client-burst=") && is_positive_number)
+        options.client_burst = number;
+    else if (option_is(arg, "--stats-port=") && is_positive_number && number <= 65535)
+        options.stats_port = number;
+    else if (option_is(arg, "--access-log=") && *value != '\0')
+        options.access_log_path = (char *) value;
+    else if (option_is(arg, "--handoff-socket=") && *value != '\0')
+        options.handoff_path = (char *) value;
+    else if (option_is(arg, "--engine=") && (strcmp(value, "threads") == 0 || strcmp(value, "uring") == 0))
+        options.use_uring = strcmp(value, "uring") == 0;
+    else if (option_is(arg, "--uring-relay=") && (strcmp(value, "buffers") == 0 || strcmp(value, "splice") == 0))
+        options.uring_splice = strcmp(value, "splice") == 0;
+    else if (option_is(arg, "--buffer-size=") && is_positive_number && number >= BIG_BUFFER_SIZE)
+        options.buffer_size = number;
+    else if (option_is(arg, "--buffers=") && is_positive_number)
+        options.buffers = number;
+    else if (option_is(arg, "--buffer-memory=") && (strcmp(value, "normal") == 0 || strcmp(value, "huge") == 0))
+        options.huge_buffers = strcmp(value, "huge") == 0;
+    else if (option_is(arg, "--coalesce=") && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+        options.coalesce = strcmp(value, "on") == 0;
+    else if (option_is(arg, "--coalesce-max-bytes=") && is_positive_number)
+        options.coalesce_max_bytes = number;
+    else if (option_is(arg, "--cache-dir=") && *value != '\0')
+        options.cache_dir = (char *) value;
+    else if (option_is(arg, "--cache-size=") && is_positive_number)
+        options.cache_size = number;
+    else if (option_is(arg, "--cache-entries=") && is_positive_number && number >= CACHE_PROBE_LENGTH && number <= INT32_MAX)
+        options.cache_entries = number;
+    else if (option_is(arg, "--cache-ttl=") && is_number)
+        options.cache_ttl = number;
+    else if (option_is(arg, "--cache-stale=") && is_number)
+        options.cache_stale = number;
+    else if (option_is(arg, "--host-limit=") && is_number && number <= INT32_MAX)
+        options.host_limit = number;
+    else if (option_is(arg, "--host-queue=") && is_number && number <= INT32_MAX)
+        options.host_queue = number;
+    else if (option_is(arg, "--inherit=") && (strcmp(value, "listener") == 0 || strcmp(value, "state") == 0))
+        options.inherit_state = strcmp(value, "state") == 0;
+    else
+        print_usage_error_and_quit();
+}
 
-    fclose(file);
-    *numLines = count;
-    return lines;
+// Check if an argument is the option with the given "--name=" prefix
+bool option_is(const char *arg, const char *name) {
+    return strncmp(arg, name, strlen(name)) == 0;
 }
 
 // Error handling function to clean the main
-void handle_error(const char *msg, char** filter, int filter_len, int server_fd, threadpool* tp) {
+void handle_error(const char *msg, filter_t *filter, int server_fd, threadpool* tp) {
     perror(msg); // Print the system error message
     // Close the server socket if it's open
     if (server_fd != -1)
         close(server_fd);
+    // Stop the statistics server before the pool it reads is destroyed
+    stop_stats_server();
     // Destroy the thread pool if it's created
     if (tp != NULL)
         destroy_threadpool(tp);
-    // Free memory allocated for the filter
-    if (filter != NULL) {
-        for (int i = 0; i < filter_len; ++i)
-            free(filter[i]);
-        free(filter);
-    }
+    // Unmap the filter if it's loaded
+    close_filter(filter);
     exit(EXIT_FAILURE); // Exit the program with a failure status
 }
 
 // wrong usage error handler.
 void print_usage_error_and_quit() {
-    printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+    printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [options]\n"
+           "  max-number-of-request 0 serves until SIGTERM/SIGINT, then drains the queued connections\n"
+           "  filter is a text filter or an image compiled with tools/filterCompiler\n"
+           "Options:\n"
+           "  --connect-timeout=<ms>   time allowed for connecting to a server (default %d)\n"
+           "  --connect-stagger=<ms>   delay before trying the next server address (default %d)\n"
+           "  --eject-after=<n>        failed connects before an address is skipped (default %d)\n"
+           "  --eject-time=<ms>        how long a failing address is skipped (default %d)\n"
+           "  --access-log=<file>      write a line per request to the file\n"
+           "  --stats-port=<port>      answer with statistics as JSON on 127.0.0.1:<port>\n"
+           "  --queue-target=<ms>      acceptable wait in the queue (default %d)\n"
+           "  --queue-interval=<ms>    wait above the target before answering 503 (default %d)\n"
+           "  --max-queue=<n>          answer 503 when n connections wait (default no limit)\n"
+           "  --client-rate=<n>        connections per second per client ip (default no limit)\n"
+           "  --client-burst=<n>       connections a client ip may make at once (default %d)\n"
+           "  --handoff-socket=<path>  take the listening socket from the proxy on this unix socket\n"
+           "                           if one runs, then wait on it for the next process\n"
+           "  --inherit=<what>         listener, or state to also take the server health and the\n"
+           "                           filter instead of reading the filter file (default listener)\n"
+           "  --engine=<engine>        threads (a thread per request) or uring (default threads)\n"
+           "  --uring-relay=<how>      buffers (multishot recv) or splice (default buffers)\n"
+           "  --buffer-size=<bytes>    size of the pooled request and relay buffers, at least %d\n"
+           "                           (default %d)\n"
+           "  --buffers=<n>            buffers in the pool, more are allocated when it runs out\n"
+           "                           (default %d per thread)\n"
+           "  --buffer-memory=<pages>  normal, or huge to back the pool with huge pages (default normal)\n"
+           "  --coalesce=<on|off>      identical GETs without cookies share one fetch, threads engine\n"
+           "                           only (default off)\n"
+           "  --coalesce-max-bytes=<n> no new requests join a fetch whose response is longer\n"
+           "                           (default %d)\n"
+           "  --cache-dir=<dir>        keep cacheable responses in files in the directory, a restart\n"
+           "                           serves the objects the last run stored\n"
+           "  --cache-size=<bytes>     bytes of objects the disk cache keeps (default %ld)\n"
+           "  --cache-entries=<n>      objects the disk cache index can hold (default %d)\n"
+           "  --cache-ttl=<s>          freshness of responses without max-age, 0 to not cache them\n"
+           "                           (default %d)\n"
+           "  --cache-stale=<s>        send a stale copy while it is revalidated in the background, for\n"
+           "                           responses without stale-while-revalidate (default %d)\n"
+           "  --host-limit=<n>         fetches in progress per server host, the requests over it wait\n"
+           "                           without holding a thread, threads engine only (default no limit)\n"
+           "  --host-queue=<n>         requests that may wait for a host before answering 503 (default %d)\n",
+           DEFAULT_CONNECT_TIMEOUT_MS, DEFAULT_CONNECT_STAGGER_MS,
+           DEFAULT_EJECT_AFTER_FAILURES, DEFAULT_EJECT_TIME_MS,
+           DEFAULT_QUEUE_TARGET_MS, DEFAULT_QUEUE_INTERVAL_MS, DEFAULT_CLIENT_BURST,
+           BIG_BUFFER_SIZE, DEFAULT_BUFFER_SIZE, BUFFERS_PER_THREAD, DEFAULT_COALESCE_MAX_BYTES,
+           DEFAULT_CACHE_SIZE, DEFAULT_CACHE_ENTRIES, DEFAULT_CACHE_TTL, DEFAULT_CACHE_STALE, DEFAULT_HOST_QUEUE);
     exit(EXIT_FAILURE);
 }
 
@@ -611,6 +1388,10 @@ void code_to_str(int code, char* buffer, char* message_buffer) {
             sprintf(buffer, "501 Not supported");
             sprintf(message_buffer, "Method is not supported.");
             break;
+        case 503:
+            sprintf(buffer, "503 Service Unavailable");
+            sprintf(message_buffer, "Server is busy, try again later.");
+            break;
         default:
             printf("code unsupported\n");
             break;
@@ -668,14 +1449,19 @@ void set_connection_to_close(char *request) {
     if (connection_keep_alive_header) {
         // Replace "Connection: keep-alive" with "Connection: close"
         char *end_of_line = strstr(connection_keep_alive_header, "\r\n");
+        if (end_of_line == NULL)
+            return;
         strcpy(connection_keep_alive_header, "Connection: close");
         memmove(connection_keep_alive_header + strlen("Connection: close"), end_of_line, strlen(end_of_line) + 1);
     } else {
-        // Add "Connection: close" header
+        // Add "Connection: close" as the last header, the request grows by its length.
+        // Pool buffers are not cleared, so exactly the terminated request may be moved
         char *end_of_headers = strstr(request, "\r\n\r\n");
         if (end_of_headers) {
-            memmove(end_of_headers + 4 + strlen("Connection: close"), end_of_headers + 4, strlen(end_of_headers) + 1);
-            memmove(end_of_headers + 4, "Connection: close\r\n", strlen("Connection: close\r\n"));
+            const char *header = "\r\nConnection: close";
+            size_t header_len = strlen(header);
+            memmove(end_of_headers + header_len, end_of_headers, strlen(end_of_headers) + 1);
+            memcpy(end_of_headers, header, header_len);
         }
     }
 }
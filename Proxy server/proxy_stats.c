@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proxy_stats.h"
+#include "access_log.h"
+#include "admission.h"
+#include "buffer_pool.h"
+#include "coalesce.h"
+#include "disk_cache.h"
+#include "host_limits.h"
+
+// size of the JSON answer of the stats server
+#define STATS_RESPONSE_SIZE (16*1024)
+
+// how often the stats server checks if it should stop
+#define STATS_POLL_INTERVAL_MS 200
+
+static const int status_codes[NUM_STATUS_CODES] = { 200, 400, 403, 404, 500, 501, 503 };
+
+/**
+ * Counters of a single thread. Only the owning thread writes them, so updates
+ * are a relaxed load and store, and readers may see a slightly old value.
+ */
+typedef struct stats_shard_st {
+    _Alignas(64) atomic_long active_connections;
+    atomic_long requests;
+    atomic_long requests_by_status[NUM_STATUS_CODES + 1];   // the last one is "other"
+    atomic_long bytes_relayed;
+    atomic_long filter_checks;
+    atomic_long filter_hits;
+    atomic_long syscalls;
+    atomic_long latency[LATENCY_BUCKETS];
+} stats_shard_t;
+
+static stats_shard_t *_Atomic shards[MAX_STATS_SHARDS];
+static atomic_int num_shards = 0;
+static __thread stats_shard_t *my_shard = NULL;
+
+// Shared shard for threads beyond MAX_STATS_SHARDS, updated with atomic adds
+static stats_shard_t overflow_shard;
+static __thread bool uses_overflow_shard = false;
+
+static int stats_fd = -1;
+static atomic_int stats_running = 0;
+static pthread_t stats_thread;
+static threadpool *stats_pool = NULL;
+
+//  Private helpers //------------------------------------------------------------------//
+static stats_shard_t* get_my_shard() {
+    if (my_shard != NULL)
+        return my_shard;
+
+    int index = atomic_fetch_add(&num_shards, 1);
+    stats_shard_t *shard = NULL;
+    if (index < MAX_STATS_SHARDS)
+        shard = aligned_alloc(64, sizeof(stats_shard_t));
+    if (shard == NULL) {
+        uses_overflow_shard = true;
+        my_shard = &overflow_shard;
+        return my_shard;
+    }
+    memset(shard, 0, sizeof(stats_shard_t));
+    atomic_store_explicit(&shards[index], shard, memory_order_release);
+    my_shard = shard;
+    return shard;
+}
+
+static void shard_add(atomic_long *counter, long value) {
+    if (uses_overflow_shard) {
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+        return;
+    }
+    long current = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static int latency_bucket(long us) {
+    if (us < LATENCY_SUB_BUCKETS)
+        return us < 0 ? 0 : (int) us;
+    int exponent = 63 - __builtin_clzl((unsigned long) us);
+    int sub = (int) ((us >> (exponent - 2)) & (LATENCY_SUB_BUCKETS - 1));
+    int bucket = exponent * LATENCY_SUB_BUCKETS + sub;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Largest latency that falls into a bucket
+static long bucket_upper_bound(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / LATENCY_SUB_BUCKETS;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return ((long) (LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+}
+
+static int status_index(int status) {
+    for (int i = 0; i < NUM_STATUS_CODES; i++)
+        if (status_codes[i] == status)
+            return i;
+    return NUM_STATUS_CODES;
+}
+
+static long load(atomic_long *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Sum all the shards into one
+static void aggregate(stats_shard_t *total) {
+    memset(total, 0, sizeof(*total));
+    int count = atomic_load(&num_shards);
+    if (count > MAX_STATS_SHARDS)
+        count = MAX_STATS_SHARDS;
+
+    for (int i = -1; i < count; i++) {
+        stats_shard_t *shard = i < 0 ? &overflow_shard : atomic_load_explicit(&shards[i], memory_order_acquire);
+        if (shard == NULL)
+            continue;
+        total->active_connections += load(&shard->active_connections);
+        total->requests += load(&shard->requests);
+        for (int j = 0; j <= NUM_STATUS_CODES; j++)
+            total->requests_by_status[j] += load(&shard->requests_by_status[j]);
+        total->bytes_relayed += load(&shard->bytes_relayed);
+        total->filter_checks += load(&shard->filter_checks);
+        total->filter_hits += load(&shard->filter_hits);
+        total->syscalls += load(&shard->syscalls);
+        for (int j = 0; j < LATENCY_BUCKETS; j++)
+            total->latency[j] += load(&shard->latency[j]);
+    }
+}
+
+static long percentile(stats_shard_t *total, long requests, double fraction) {
+    if (requests == 0)
+        return 0;
+    long rank = (long) (fraction * (double) requests);
+    if (rank >= requests)
+        rank = requests - 1;
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += total->latency[i];
+        if (seen > rank)
+            return bucket_upper_bound(i);
+    }
+    return bucket_upper_bound(LATENCY_BUCKETS - 1);
+}
+
+static void answer_stats_request(int client_socket) {
+    char body[STATS_RESPONSE_SIZE];
+    char response[STATS_RESPONSE_SIZE + 256];
+
+    // Read (and ignore) the request so closing the socket doesn't reset it
+    char request[1024];
+    struct pollfd pfd = { client_socket, POLLIN, 0 };
+    if (poll(&pfd, 1, STATS_POLL_INTERVAL_MS) > 0)
+        (void) !recv(client_socket, request, sizeof(request), MSG_DONTWAIT);
+
+    int body_len = format_stats(body, sizeof(body), stats_pool);
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %d\r\n"
+                       "Connection: close\r\n"
+                       "\r\n"
+                       "%s",
+                       body_len, body);
+    if (send(client_socket, response, len, MSG_NOSIGNAL) < 0)
+        perror("error: send\n");
+}
+
+static void* stats_server_loop(void *arg) {
+    (void) arg;
+    struct pollfd pfd = { stats_fd, POLLIN, 0 };
+
+    while (atomic_load(&stats_running)) {
+        if (poll(&pfd, 1, STATS_POLL_INTERVAL_MS) <= 0)
+            continue;
+        int client_socket = accept(stats_fd, NULL, NULL);
+        if (client_socket < 0)
+            continue;
+        answer_stats_request(client_socket);
+        close(client_socket);
+    }
+    return NULL;
+}
+// --------------------------------------------------------------------------------------//
+
+void stats_request_started() {
+    stats_shard_t *shard = get_my_shard();
+    shard_add(&shard->active_connections, 1);
+}
+
+void stats_request_finished(int status, long bytes_relayed, long total_us) {
+    stats_shard_t *shard = get_my_shard();
+    shard_add(&shard->active_connections, -1);
+    shard_add(&shard->requests, 1);
+    shard_add(&shard->requests_by_status[status_index(status)], 1);
+    shard_add(&shard->bytes_relayed, bytes_relayed);
+    shard_add(&shard->latency[latency_bucket(total_us)], 1);
+}
+
+void stats_filter_checked(bool hit) {
+    stats_shard_t *shard = get_my_shard();
+    shard_add(&shard->filter_checks, 1);
+    if (hit)
+        shard_add(&shard->filter_hits, 1);
+}
+
+void stats_syscalls(long count) {
+    stats_shard_t *shard = get_my_shard();
+    shard_add(&shard->syscalls, count);
+}
+
+int format_stats(char *buffer, size_t size, threadpool *tp) {
+    stats_shard_t *total = malloc(sizeof(stats_shard_t));
+    if (total == NULL) {
+        perror("error: malloc\n");
+        return snprintf(buffer, size, "{}");
+    }
+    aggregate(total);
+
+    int queue_depth = 0, num_threads = 0;
+    if (tp != NULL) {
+        queue_depth = get_queue_size(tp);
+        num_threads = tp->num_threads;
+    }
+
+    buffer_pool_usage_t buffers;
+    buffer_pool_usage(&buffers);
+    cache_usage_t cache;
+    cache_usage(&cache);
+    host_limits_usage_t hosts;
+    host_limits_usage(&hosts);
+
+    long requests = total->requests;
+    size_t len = 0;
+    len += snprintf(buffer + len, size - len,
+                    "{\n"
+                    "  \"active_connections\": %ld,\n"
+                    "  \"requests\": %ld,\n"
+                    "  \"requests_by_status\": {",
+                    total->active_connections, requests);
+    for (int i = 0; i <= NUM_STATUS_CODES && len < size; i++) {
+        if (i < NUM_STATUS_CODES)
+            len += snprintf(buffer + len, size - len, "\"%d\": %ld, ", status_codes[i], total->requests_by_status[i]);
+        else
+            len += snprintf(buffer + len, size - len, "\"other\": %ld},\n", total->requests_by_status[i]);
+    }
+    if (len < size)
+        len += snprintf(buffer + len, size - len,
+                        "  \"bytes_relayed\": %ld,\n"
+                        "  \"threads\": %d,\n"
+                        "  \"queue_depth\": %d,\n"
+                        "  \"filter_checks\": %ld,\n"
+                        "  \"filter_hits\": %ld,\n"
+                        "  \"syscalls\": %ld,\n"
+                        "  \"syscalls_per_request\": %.1f,\n"
+                        "  \"access_log_dropped\": %ld,\n"
+                        "  \"overloaded\": %s,\n"
+                        "  \"shed\": {\"overload\": %ld, \"queue_full\": %ld, \"client_rate\": %ld},\n"
+                        "  \"buffers\": {\"size\": %zu, \"total\": %d, \"in_use\": %ld, \"peak_in_use\": %ld, "
+                        "\"misses\": %ld, \"memory\": \"%s\"},\n"
+                        "  \"coalesced\": {\"followers\": %ld, \"in_flight\": %d},\n"
+                        "  \"host_queues\": {\"limit\": %d, \"hosts\": %d, \"waiting\": %ld, \"queued\": %ld, "
+                        "\"refused\": %ld, \"wait_avg_us\": %ld, \"wait_max_us\": %ld},\n"
+                        "  \"disk_cache\": {\"hits\": %ld, \"stale_hits\": %ld, \"misses\": %ld, \"stores\": %ld, "
+                        "\"evictions\": %ld, \"revalidations\": %ld, \"not_modified\": %ld, "
+                        "\"objects\": %ld, \"bytes\": %ld},\n"
+                        "  \"latency_us\": {\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"p999\": %ld}\n"
+                        "}\n",
+                        total->bytes_relayed, num_threads, queue_depth,
+                        total->filter_checks, total->filter_hits, total->syscalls,
+                        requests > 0 ? (double) total->syscalls / (double) requests : 0.0, access_log_dropped(),
+                        admission_overloaded() ? "true" : "false", admission_shed_count(SHED_OVERLOAD),
+                        admission_shed_count(SHED_QUEUE_FULL), admission_shed_count(SHED_CLIENT_RATE),
+                        buffers.buffer_size, buffers.total, buffers.in_use, buffers.peak_in_use,
+                        buffers.misses, buffers.memory, coalesced_requests(), flights_in_progress(),
+                        hosts.limit, hosts.hosts, hosts.waiting, hosts.queued, hosts.refused, hosts.wait_avg_us,
+                        hosts.wait_max_us,
+                        cache.hits, cache.stale_hits, cache.misses, cache.stores, cache.evictions,
+                        cache.revalidations, cache.not_modified, cache.objects, cache.bytes,
+                        percentile(total, requests, 0.5), percentile(total, requests, 0.9),
+                        percentile(total, requests, 0.99), percentile(total, requests, 0.999));
+    free(total);
+    return len < size ? (int) len : (int) size - 1;
+}
+
+int start_stats_server(int port, threadpool *tp) {
+    struct sockaddr_in address;
+    int opt = 1;
+
+    stats_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (stats_fd < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // The old process keeps the port while it drains after a handoff
+    setsockopt(stats_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+    // Only answer local clients
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(stats_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(stats_fd, 16) < 0) {
+        perror("error: bind\n");
+        close(stats_fd);
+        stats_fd = -1;
+        return -1;
+    }
+
+    stats_pool = tp;
+    atomic_store(&stats_running, 1);
+    if (pthread_create(&stats_thread, NULL, stats_server_loop, NULL) != 0) {
+        perror("error: pthread_create\n");
+        atomic_store(&stats_running, 0);
+        close(stats_fd);
+        stats_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void stop_stats_server() {
+    if (!atomic_load(&stats_running))
+        return;
+
+    atomic_store(&stats_running, 0);
+    pthread_join(stats_thread, NULL);
+    close(stats_fd);
+    stats_fd = -1;
+    stats_pool = NULL;
+}
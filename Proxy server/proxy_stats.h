@@ -0,0 +1,71 @@
+#ifndef PROXY_STATS_H
+#define PROXY_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * proxy_stats.h
+ *
+ * Runtime counters of the proxy. Every thread counts into a shard of its own,
+ * so counting is a plain add on a cache line no other thread writes. Reading
+ * the statistics sums all the shards.
+ *
+ * When started with a port, a thread answers every connection on
+ * 127.0.0.1:<port> with the current statistics as JSON.
+ */
+
+// maximum number of threads that can count
+#define MAX_STATS_SHARDS 256
+
+// latency histogram: every power of 2 of microseconds is split into sub buckets
+#define LATENCY_SUB_BUCKETS 4
+#define LATENCY_BUCKETS (40 * LATENCY_SUB_BUCKETS)
+
+// status codes counted separately, anything else is counted as "other"
+#define NUM_STATUS_CODES 7
+
+
+/**
+ * stats_request_started counts a request a worker started handling.
+ */
+void stats_request_started();
+
+/**
+ * stats_request_finished counts a finished request with its status,
+ * the bytes sent back to the client and how long it took.
+ */
+void stats_request_finished(int status, long bytes_relayed, long total_us);
+
+/**
+ * stats_filter_checked counts a host that was checked against the filter.
+ * @hit - true if the filter blocked it
+ */
+void stats_filter_checked(bool hit);
+
+/**
+ * stats_syscalls counts socket syscalls made by the calling thread, so the
+ * engines can be compared by syscalls per request
+ */
+void stats_syscalls(long count);
+
+/**
+ * format_stats writes the current statistics as JSON.
+ * @tp - the pool whose queue depth is reported, may be NULL
+ * @ return value - number of characters written
+ */
+int format_stats(char *buffer, size_t size, threadpool *tp);
+
+/**
+ * start_stats_server starts the thread that answers on 127.0.0.1:port.
+ * @ return value - 0 on success, -1 on failure
+ */
+int start_stats_server(int port, threadpool *tp);
+
+/**
+ * stop_stats_server stops the thread and closes its socket.
+ */
+void stop_stats_server();
+
+#endif //PROXY_STATS_H
@@ -165,6 +165,14 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
     // end of critical section
 }
 
+// Number of jobs waiting for a thread
+int get_queue_size(threadpool* pool) {
+    pthread_mutex_lock(&pool->qlock);
+    int size = pool->qsize;
+    pthread_mutex_unlock(&pool->qlock);
+    return size;
+}
+
 // Function to execute tasks in the threadpool
 void* do_work(void* p) {
     (void) p;
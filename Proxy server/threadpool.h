@@ -88,6 +88,12 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 void* do_work(void* p);
 
 
+/**
+ * get_queue_size returns the number of jobs waiting in the queue.
+ */
+int get_queue_size(threadpool* pool);
+
+
 /**
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
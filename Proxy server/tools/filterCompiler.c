@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../filter_image.h"
+
+// Compiles a text filter into the binary image the proxy maps at start.
+// Build: gcc -O2 -Wall -o filterCompiler tools/filterCompiler.c filter_image.c
+// The image replaces the output file atomically, proxies already running keep the old one.
+
+void print_usage_error_and_quit();
+
+int main(int argc, char *argv[]) {
+    if (argc != 3)
+        print_usage_error_and_quit();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t size;
+    filter_info_t info;
+    void *image = compile_filter(argv[1], &size, &info);
+    if (image == NULL)
+        exit(EXIT_FAILURE);
+    if (write_filter_image(image, size, argv[2]) != 0) {
+        free(image);
+        exit(EXIT_FAILURE);
+    }
+    free(image);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("%s: %ld networks in %ld ranges, %ld hosts, %ld suffixes, %ld lines skipped, %zu bytes in %ld ms\n",
+           argv[2], info.networks, info.ranges, info.hosts, info.suffixes, info.skipped, info.bytes, elapsed_ms);
+    return EXIT_SUCCESS;
+}
+
+void print_usage_error_and_quit() {
+    printf("Usage: filterCompiler <filter.txt> <filter.image>\n");
+    exit(EXIT_FAILURE);
+}
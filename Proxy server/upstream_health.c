@@ -0,0 +1,206 @@
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "upstream_health.h"
+
+// weight of a new latency sample in the moving average
+#define EWMA_ALPHA 0.3
+
+// slots looked at before an IP is stored over an older one
+#define MAX_PROBE_LENGTH 16
+
+// Global health table, shared by all the worker threads
+static health_entry_t health_table[HEALTH_TABLE_SIZE];
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int failure_threshold = 3;
+static long first_ejection_ms = 10000;
+static long probe_timeout = 3000;
+
+//  Private helpers //------------------------------------------------------------------//
+static long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static uint32_t address_to_ip(const char *address) {
+    uint32_t ip;
+    memcpy(&ip, address, sizeof(ip));
+    return ip;
+}
+
+static unsigned int hash_ip(uint32_t ip) {
+    // Fibonacci hashing spreads consecutive addresses over the table
+    return (unsigned int) ((ip * 2654435769U) >> 20) & (HEALTH_TABLE_SIZE - 1);
+}
+
+// Find the entry of an IP, NULL if it is unknown. Called with the lock held.
+static health_entry_t* find_entry(uint32_t ip) {
+    unsigned int slot = hash_ip(ip);
+    for (int i = 0; i < MAX_PROBE_LENGTH; i++) {
+        health_entry_t *entry = &health_table[(slot + i) & (HEALTH_TABLE_SIZE - 1)];
+        if (!entry->used)
+            return NULL;
+        if (entry->ip == ip)
+            return entry;
+    }
+    return NULL;
+}
+
+// Find or create the entry of an IP. Called with the lock held.
+static health_entry_t* get_entry(uint32_t ip) {
+    unsigned int slot = hash_ip(ip);
+    for (int i = 0; i < MAX_PROBE_LENGTH; i++) {
+        health_entry_t *entry = &health_table[(slot + i) & (HEALTH_TABLE_SIZE - 1)];
+        if (entry->used && entry->ip == ip)
+            return entry;
+        if (!entry->used) {
+            memset(entry, 0, sizeof(*entry));
+            entry->ip = ip;
+            entry->used = 1;
+            return entry;
+        }
+    }
+    // The neighbourhood is full, forget the IP in the home slot
+    health_entry_t *entry = &health_table[slot];
+    memset(entry, 0, sizeof(*entry));
+    entry->ip = ip;
+    entry->used = 1;
+    return entry;
+}
+
+static void add_latency_sample(health_entry_t *entry, long latency_ms) {
+    if (entry->total_successes == 0 && entry->ewma_connect_ms == 0)
+        entry->ewma_connect_ms = (double) latency_ms;
+    else
+        entry->ewma_connect_ms = EWMA_ALPHA * (double) latency_ms + (1 - EWMA_ALPHA) * entry->ewma_connect_ms;
+}
+// --------------------------------------------------------------------------------------//
+
+void init_upstream_health(int threshold, long ejection_ms, long probe_timeout_ms) {
+    pthread_mutex_lock(&health_lock);
+    failure_threshold = threshold;
+    first_ejection_ms = ejection_ms;
+    probe_timeout = probe_timeout_ms;
+    memset(health_table, 0, sizeof(health_table));
+    pthread_mutex_unlock(&health_lock);
+}
+
+int order_addresses(char **addresses, int count, char **ordered) {
+    double latency[count];
+    int num_ordered = 0;
+    long now = monotonic_ms();
+
+    pthread_mutex_lock(&health_lock);
+    for (int i = 0; i < count; i++) {
+        health_entry_t *entry = find_entry(address_to_ip(addresses[i]));
+
+        // Unknown IPs are tried in the order the resolver gave them
+        if (entry == NULL || entry->ejected_until == 0) {
+            latency[num_ordered] = entry == NULL ? 0 : entry->ewma_connect_ms;
+            ordered[num_ordered++] = addresses[i];
+            continue;
+        }
+
+        // Still ejected, or another request is already probing it
+        if (now < entry->ejected_until || now < entry->probe_until)
+            continue;
+
+        // The ejection window is over, this request probes the IP first
+        entry->probe_until = now + probe_timeout;
+        memmove(&ordered[1], &ordered[0], num_ordered * sizeof(char*));
+        memmove(&latency[1], &latency[0], num_ordered * sizeof(double));
+        ordered[0] = addresses[i];
+        latency[0] = -1;
+        num_ordered++;
+    }
+    pthread_mutex_unlock(&health_lock);
+
+    // Every IP is ejected, try them all rather than refusing the request
+    if (num_ordered == 0) {
+        memcpy(ordered, addresses, count * sizeof(char*));
+        return count;
+    }
+
+    // Stable insertion sort by latency, the lists are a handful of addresses long
+    for (int i = 1; i < num_ordered; i++) {
+        char *address = ordered[i];
+        double key = latency[i];
+        int j = i - 1;
+        while (j >= 0 && latency[j] > key) {
+            ordered[j + 1] = ordered[j];
+            latency[j + 1] = latency[j];
+            j--;
+        }
+        ordered[j + 1] = address;
+        latency[j + 1] = key;
+    }
+    return num_ordered;
+}
+
+void report_connect_success(const char *address, long connect_ms) {
+    pthread_mutex_lock(&health_lock);
+    health_entry_t *entry = get_entry(address_to_ip(address));
+    add_latency_sample(entry, connect_ms);
+    entry->total_successes++;
+    entry->consecutive_failures = 0;
+    entry->ejected_until = 0;
+    entry->ejection_ms = 0;
+    entry->probe_until = 0;
+    pthread_mutex_unlock(&health_lock);
+}
+
+void report_connect_failure(const char *address) {
+    long now = monotonic_ms();
+
+    pthread_mutex_lock(&health_lock);
+    health_entry_t *entry = get_entry(address_to_ip(address));
+    entry->total_failures++;
+    entry->consecutive_failures++;
+
+    if (entry->ejected_until != 0) {
+        // A failed probe, eject it again for twice as long
+        entry->ejection_ms *= 2;
+        if (entry->ejection_ms > MAX_EJECTION_MS)
+            entry->ejection_ms = MAX_EJECTION_MS;
+        entry->ejected_until = now + entry->ejection_ms;
+    } else if (entry->consecutive_failures >= failure_threshold) {
+        entry->ejection_ms = first_ejection_ms;
+        entry->ejected_until = now + entry->ejection_ms;
+    }
+    entry->probe_until = 0;
+    pthread_mutex_unlock(&health_lock);
+}
+
+void report_connect_slow(const char *address, long elapsed_ms) {
+    pthread_mutex_lock(&health_lock);
+    health_entry_t *entry = get_entry(address_to_ip(address));
+    // Only let the sample push the average up, the real latency is unknown
+    if (elapsed_ms > entry->ewma_connect_ms)
+        add_latency_sample(entry, elapsed_ms);
+    pthread_mutex_unlock(&health_lock);
+}
+
+int export_upstream_health(health_entry_t *entries, int max_entries) {
+    int count = 0;
+    pthread_mutex_lock(&health_lock);
+    for (int i = 0; i < HEALTH_TABLE_SIZE && count < max_entries; i++)
+        if (health_table[i].used)
+            entries[count++] = health_table[i];
+    pthread_mutex_unlock(&health_lock);
+    return count;
+}
+
+void import_upstream_health(const health_entry_t *entries, int count) {
+    pthread_mutex_lock(&health_lock);
+    for (int i = 0; i < count; i++) {
+        if (!entries[i].used)
+            continue;
+        health_entry_t *entry = get_entry(entries[i].ip);
+        *entry = entries[i];
+        // A probe in flight belonged to the old process
+        entry->probe_until = 0;
+    }
+    pthread_mutex_unlock(&health_lock);
+}
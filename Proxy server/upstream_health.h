@@ -0,0 +1,89 @@
+#ifndef UPSTREAM_HEALTH_H
+#define UPSTREAM_HEALTH_H
+
+#include <stdint.h>
+
+/**
+ * upstream_health.h
+ *
+ * A table shared by all the worker threads that remembers how connecting
+ * to every server IP went. For each IP it keeps an EWMA of the connect latency
+ * and the failure counts. After too many consecutive failures the IP is ejected
+ * for a window, and when the window is over a single request probes it again.
+ * A successful probe brings the IP back, a failed one ejects it for twice as long.
+ *
+ * Addresses are passed the same way they appear in hostent->h_addr_list:
+ * a pointer to the 4 bytes of the IPv4 address in network byte order.
+ */
+
+// number of IPs remembered, must be a power of 2
+#define HEALTH_TABLE_SIZE 4096
+
+// the longest an IP can be ejected for
+#define MAX_EJECTION_MS (5 * 60 * 1000L)
+
+
+/**
+ * Health of one server IP
+ */
+typedef struct health_entry_st {
+    uint32_t ip;                // IPv4 address in network byte order
+    int used;                   // 1 if this slot holds an IP
+    double ewma_connect_ms;     // moving average of the connect latency
+    int consecutive_failures;   // failures since the last success
+    long total_failures;        // failures since the IP was first seen
+    long total_successes;       // successes since the IP was first seen
+    long ejection_ms;           // length of the current (or last) ejection window
+    long ejected_until;         // monotonic ms until which the IP is skipped, 0 if healthy
+    long probe_until;           // monotonic ms until which a probe is in flight
+} health_entry_t;
+
+
+/**
+ * init_upstream_health sets the ejection policy and clears the table.
+ * @failure_threshold - consecutive failures after which an IP is ejected
+ * @ejection_ms - length of the first ejection window
+ * @probe_timeout_ms - how long a probe may take before another request probes again
+ */
+void init_upstream_health(int failure_threshold, long ejection_ms, long probe_timeout_ms);
+
+/**
+ * order_addresses writes into ordered the addresses worth trying, best first.
+ * Healthy IPs come sorted by their connect latency, ejected IPs are left out,
+ * and an IP whose ejection window is over is put first as the probe.
+ * If every IP is ejected all of them are returned in their original order.
+ * @ return value - number of addresses written to ordered
+ */
+int order_addresses(char **addresses, int count, char **ordered);
+
+/**
+ * report_connect_success records a completed connect and its latency.
+ */
+void report_connect_success(const char *address, long connect_ms);
+
+/**
+ * report_connect_failure records a failed connect and ejects the IP
+ * if it failed too many times in a row.
+ */
+void report_connect_failure(const char *address);
+
+/**
+ * report_connect_slow records a connect that was still pending when
+ * another address won the race. elapsed_ms is a lower bound of its latency.
+ */
+void report_connect_slow(const char *address, long elapsed_ms);
+
+/**
+ * export_upstream_health copies the known IPs into entries, used to hand the
+ * table over to a new process. The monotonic clock is shared by all the
+ * processes of the machine so the ejection times stay valid.
+ * @ return value - number of entries written
+ */
+int export_upstream_health(health_entry_t *entries, int max_entries);
+
+/**
+ * import_upstream_health adds entries exported by another process to the table.
+ */
+void import_upstream_health(const health_entry_t *entries, int count);
+
+#endif //UPSTREAM_HEALTH_H
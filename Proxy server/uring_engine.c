@@ -0,0 +1,1042 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "uring_engine.h"
+#include "access_log.h"
+#include "proxy_stats.h"
+#include "admission.h"
+#include "upstream_health.h"
+#include "handoff.h"
+
+// resolved addresses of a server that are tried, like the threads do
+#define MAX_SERVER_ADDRESSES 128
+
+// shortest time a single connect attempt gets
+#define MIN_ATTEMPT_TIMEOUT_MS 100
+
+// Functions of proxyServer.c
+int check_request(const char *request_buffer, const filter_t *filter, struct hostent *server_entry,
+                  char *dns_buffer, size_t dns_buffer_size, struct hostent **server_info, in_port_t *port,
+                  access_record_t *record);
+void set_connection_to_close(char *request);
+void generate_error_response(char *buffer, int code);
+void shed_client(int client_socket, const struct sockaddr_in *client_address, long accepted_us);
+long now_ms();
+long now_us();
+
+/**
+ * What a completion belongs to, stored in the upper half of the user data.
+ * The lower half is the index of the connection.
+ */
+typedef enum {
+    OP_IGNORE = 1,      // close and cancel requests, nothing to do
+    OP_ACCEPT,
+    OP_HANDOFF,
+    OP_EVENTFD,
+    OP_READ_REQUEST,
+    OP_CONNECT,
+    OP_CONNECT_TIMEOUT,
+    OP_SEND_REQUEST,
+    OP_RELAY_RECV,
+    OP_RELAY_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_SEND_ERROR
+} uring_op_t;
+
+#define USER_DATA(op, index) (((uint64_t) (op) << 32) | (uint32_t) (index))
+#define USER_DATA_OP(data) ((uring_op_t) ((data) >> 32))
+#define USER_DATA_INDEX(data) ((int) ((data) & 0xFFFFFFFF))
+
+/**
+ * State of one client connection
+ */
+typedef struct uring_conn_st {
+    int index;                  // also the index of its registered buffer
+    int inflight;               // operations (and the resolve job) that did not complete yet
+    bool finishing;             // the request is over, waiting for inflight to reach 0
+    int client_fd;
+    int server_fd;              // -1 until a connect attempt started
+    char *buffer;               // registered buffer, the request and later an error response
+    int buffer_len;             // bytes to write from the buffer
+    int buffer_sent;
+    struct sockaddr_in client_address;
+    long accepted_us;
+    access_record_t record;
+
+    // Results of the resolve job
+    int status;
+    in_port_t port;
+    char raw_addresses[MAX_SERVER_ADDRESSES][sizeof(struct in_addr)];
+    char *addresses[MAX_SERVER_ADDRESSES];      // best first, point into raw_addresses
+    int num_addresses;
+    int next_address;
+    long connect_start_ms;
+    long attempt_start_ms;
+    struct sockaddr_in server_address;
+    struct __kernel_timespec attempt_timeout;
+
+    // Relay with provided buffers, the queued buffers are linked through relay_next
+    bool recv_armed;
+    bool recv_paused;           // cancelled because the client is slow
+    bool starved;               // waiting for a free relay buffer
+    bool upstream_done;
+    bool sending;
+    int queue_head, queue_tail, queued;
+    int head_offset;            // bytes of the head buffer already sent
+
+    // Relay with splice
+    int pipe_fds[2];
+    int pipe_bytes;
+
+    struct uring_conn_st *next;     // free list, resolved list or starved list
+} uring_conn_t;
+
+/**
+ * The rings shared with the kernel
+ */
+typedef struct ring_st {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;          // entries prepared, published to sq_tail on submit
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} ring_t;
+
+static ring_t ring = { .fd = -1 };
+static const uring_config_t *engine_config = NULL;
+static threadpool *engine_pool = NULL;
+static const filter_t *engine_filter = NULL;
+static int listen_fd = -1;
+
+static uring_conn_t *connections = NULL;
+static uring_conn_t *free_connections = NULL;
+static int active_connections = 0;
+static char *request_memory = NULL;
+
+static char *relay_memory = NULL;
+static struct io_uring_buf_ring *buffer_ring = NULL;
+static size_t buffer_ring_size = 0;
+static unsigned short buffer_ring_tail = 0;
+static int relay_next[URING_RELAY_BUFFERS];
+static int relay_len[URING_RELAY_BUFFERS];
+// Connections waiting for a free relay buffer, served in the order they ran out
+static uring_conn_t *starved_connections = NULL;
+static uring_conn_t **starved_tail = &starved_connections;
+
+// Connections whose resolve job finished, filled by the pool and drained by the ring thread
+static pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+static uring_conn_t *resolved_connections = NULL;
+static int event_fd = -1;
+static uint64_t event_value;
+
+static bool accepting = false;
+static bool accept_armed = false;
+static bool accept_blocked = false;     // out of descriptors, armed again when a connection closes
+static bool handoff_armed = false;
+static bool handed_over = false;
+static long accepted = 0;
+
+//  Private helpers //------------------------------------------------------------------//
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const sigset_t *mask) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, mask, mask == NULL ? 0 : _NSIG / 8);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int setup_ring(unsigned entries) {
+    struct io_uring_params params;
+
+    // Only this thread submits, so completions can run when it waits for them
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring.fd = sys_io_uring_setup(entries, &params);
+    if (ring.fd < 0 && errno == EINVAL) {
+        // An older kernel, use the defaults
+        memset(&params, 0, sizeof(params));
+        ring.fd = sys_io_uring_setup(entries, &params);
+    }
+    if (ring.fd < 0) {
+        perror("error: io_uring_setup\n");
+        return -1;
+    }
+
+    ring.sq_entries = params.sq_entries;
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size)
+            ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        perror("error: mmap\n");
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            perror("error: mmap\n");
+            return -1;
+        }
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("error: mmap\n");
+        ring.sqes = NULL;
+        return -1;
+    }
+
+    char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring.sqe_tail = *ring.sq_tail;
+    return 0;
+}
+
+static void free_ring() {
+    if (ring.sqes != NULL)
+        munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_size);
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED)
+        munmap(ring.sq_ptr, ring.sq_size);
+    if (ring.fd >= 0)
+        close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+// Hand the prepared entries to the kernel and wait for wait_for completions
+static int submit(unsigned wait_for) {
+    unsigned to_submit = ring.sqe_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_for == 0)
+        return 0;
+
+    stats_syscalls(1);
+    return sys_io_uring_enter(ring.fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0,
+                              wait_for > 0 ? engine_config->serve_mask : NULL);
+}
+
+// Make room for count entries that must be prepared without a submit between them,
+// like a request and its linked timeout
+static void reserve_sqes(unsigned count) {
+    // The queue is full, submit what is there until the kernel took enough of it.
+    // A short submit leaves the rest queued, they go with the next one
+    while (ring.sqe_tail + count - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries) {
+        if (submit(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // The entries can't be dropped and the ring can't take them
+            perror("error: io_uring_enter\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static struct io_uring_sqe* get_sqe() {
+    reserve_sqes(1);
+
+    unsigned index = ring.sqe_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.sqe_tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe* prepare(uint8_t opcode, int fd, uring_op_t op, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = USER_DATA(op, conn == NULL ? 0 : conn->index);
+    if (conn != NULL && op != OP_IGNORE)
+        conn->inflight++;
+    return sqe;
+}
+
+static void prepare_close(int fd) {
+    prepare(IORING_OP_CLOSE, fd, OP_IGNORE, NULL);
+}
+
+// Cancel every operation on a descriptor
+static void prepare_cancel_fd(int fd) {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, fd, OP_IGNORE, NULL);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+static void arm_accept() {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_ACCEPT, listen_fd, OP_ACCEPT, NULL);
+    sqe->accept_flags = SOCK_CLOEXEC;
+    // With a limit every connection is accepted on its own so no extra one is taken
+    if (engine_config->max_requests == 0)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    accept_armed = true;
+}
+
+static void arm_event_read() {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_READ, event_fd, OP_EVENTFD, NULL);
+    sqe->addr = (uint64_t) (uintptr_t) &event_value;
+    sqe->len = sizeof(event_value);
+}
+
+static void arm_handoff_poll() {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_POLL_ADD, engine_config->handoff_fd, OP_HANDOFF, NULL);
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    handoff_armed = true;
+}
+
+static void stop_accepting() {
+    if (!accepting)
+        return;
+    accepting = false;
+    if (accept_armed) {
+        struct io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, OP_IGNORE, NULL);
+        sqe->addr = USER_DATA(OP_ACCEPT, 0);
+    }
+    if (handoff_armed) {
+        struct io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, OP_IGNORE, NULL);
+        sqe->addr = USER_DATA(OP_HANDOFF, 0);
+    }
+}
+
+// Give a relay buffer to the kernel
+static void provide_relay_buffer(int bid) {
+    struct io_uring_buf *buf = &buffer_ring->bufs[buffer_ring_tail & (URING_RELAY_BUFFERS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (relay_memory + (size_t) bid * URING_RELAY_BUFFER_SIZE);
+    buf->len = URING_RELAY_BUFFER_SIZE;
+    buf->bid = (uint16_t) bid;
+    buffer_ring_tail++;
+    __atomic_store_n(&buffer_ring->tail, buffer_ring_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffers() {
+    // Registered buffers for the requests, one per connection
+    request_memory = mmap(NULL, (size_t) URING_MAX_CONNECTIONS * URING_REQUEST_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (request_memory == MAP_FAILED) {
+        request_memory = NULL;
+        perror("error: mmap\n");
+        return -1;
+    }
+    struct iovec *iovecs = malloc(URING_MAX_CONNECTIONS * sizeof(struct iovec));
+    if (iovecs == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+    for (int i = 0; i < URING_MAX_CONNECTIONS; i++) {
+        iovecs[i].iov_base = request_memory + (size_t) i * URING_REQUEST_BUFFER_SIZE;
+        iovecs[i].iov_len = URING_REQUEST_BUFFER_SIZE;
+    }
+    int result = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_MAX_CONNECTIONS);
+    free(iovecs);
+    if (result < 0) {
+        perror("error: io_uring_register buffers\n");
+        return -1;
+    }
+
+    // Ring of provided buffers that the multishot recv of the relay fills
+    if (engine_config->use_splice)
+        return 0;
+    relay_memory = mmap(NULL, (size_t) URING_RELAY_BUFFERS * URING_RELAY_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffer_ring_size = URING_RELAY_BUFFERS * sizeof(struct io_uring_buf);
+    buffer_ring = mmap(NULL, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (relay_memory == MAP_FAILED || buffer_ring == MAP_FAILED) {
+        perror("error: mmap\n");
+        if (relay_memory == MAP_FAILED)
+            relay_memory = NULL;
+        if (buffer_ring == MAP_FAILED)
+            buffer_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) buffer_ring;
+    registration.ring_entries = URING_RELAY_BUFFERS;
+    registration.bgid = 0;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        perror("error: io_uring_register buffer ring\n");
+        return -1;
+    }
+    buffer_ring_tail = 0;
+    for (int i = 0; i < URING_RELAY_BUFFERS; i++)
+        provide_relay_buffer(i);
+    return 0;
+}
+
+static void free_buffers() {
+    if (request_memory != NULL)
+        munmap(request_memory, (size_t) URING_MAX_CONNECTIONS * URING_REQUEST_BUFFER_SIZE);
+    if (relay_memory != NULL)
+        munmap(relay_memory, (size_t) URING_RELAY_BUFFERS * URING_RELAY_BUFFER_SIZE);
+    if (buffer_ring != NULL)
+        munmap(buffer_ring, buffer_ring_size);
+    request_memory = relay_memory = NULL;
+    buffer_ring = NULL;
+}
+
+static void arm_relay_recv(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_RECV, conn->server_fd, OP_RELAY_RECV, conn);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    conn->recv_armed = true;
+    conn->recv_paused = false;
+}
+
+// Arm the recv again when the client caught up and buffers are free
+static void resume_relay_recv(uring_conn_t *conn) {
+    if (conn->finishing || conn->upstream_done || conn->recv_armed || conn->starved ||
+        conn->queued >= URING_RELAY_QUEUE_LIMIT)
+        return;
+    arm_relay_recv(conn);
+}
+
+// Give a relay buffer back to the kernel, every used buffer comes back here.
+// A buffer is free, so the first starved connection that can receive again gets it,
+// the ones that are finishing or still have a full queue are only taken off the list.
+static void recycle_relay_buffer(int bid) {
+    provide_relay_buffer(bid);
+    while (starved_connections != NULL) {
+        uring_conn_t *starved = starved_connections;
+        starved_connections = starved->next;
+        if (starved_connections == NULL)
+            starved_tail = &starved_connections;
+        starved->starved = false;
+        resume_relay_recv(starved);
+        if (starved->recv_armed)
+            break;
+    }
+}
+
+static void remove_starved(uring_conn_t *conn) {
+    for (uring_conn_t **link = &starved_connections; *link != NULL; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            if (*link == NULL)
+                starved_tail = link;
+            break;
+        }
+    }
+    conn->starved = false;
+}
+
+// Give the slot back once the kernel and the pool are done with the connection
+static void release_if_idle(uring_conn_t *conn) {
+    if (!conn->finishing || conn->inflight > 0)
+        return;
+
+    prepare_close(conn->client_fd);
+    if (conn->server_fd >= 0)
+        prepare_close(conn->server_fd);
+    if (conn->pipe_fds[0] >= 0) {
+        prepare_close(conn->pipe_fds[0]);
+        prepare_close(conn->pipe_fds[1]);
+    }
+    while (conn->queued > 0) {
+        int bid = conn->queue_head;
+        conn->queue_head = relay_next[bid];
+        conn->queued--;
+        recycle_relay_buffer(bid);
+    }
+    if (conn->starved)
+        remove_starved(conn);
+
+    conn->next = free_connections;
+    free_connections = conn;
+    active_connections--;
+
+    // A descriptor is free again
+    if (accept_blocked && accepting && !accept_armed) {
+        accept_blocked = false;
+        arm_accept();
+    }
+}
+
+// The request is over: log it and cancel what is still pending on its sockets
+static void finish(uring_conn_t *conn) {
+    if (conn->finishing)
+        return;
+    conn->finishing = true;
+
+    conn->record.total_us = now_us() - conn->accepted_us;
+    log_access(&conn->record);
+    stats_request_finished(conn->record.status, conn->record.bytes_relayed, conn->record.total_us);
+
+    if (conn->inflight > 0) {
+        prepare_cancel_fd(conn->client_fd);
+        if (conn->server_fd >= 0)
+            prepare_cancel_fd(conn->server_fd);
+        if (conn->pipe_fds[0] >= 0) {
+            prepare_cancel_fd(conn->pipe_fds[0]);
+            prepare_cancel_fd(conn->pipe_fds[1]);
+        }
+    }
+    release_if_idle(conn);
+}
+
+static void write_fixed(uring_conn_t *conn, int fd, uring_op_t op) {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_WRITE_FIXED, fd, op, conn);
+    sqe->addr = (uint64_t) (uintptr_t) (conn->buffer + conn->buffer_sent);
+    sqe->len = conn->buffer_len - conn->buffer_sent;
+    sqe->buf_index = (uint16_t) conn->index;
+}
+
+static void send_error(uring_conn_t *conn, int status) {
+    conn->record.status = status;
+    generate_error_response(conn->buffer, status);
+    conn->buffer_len = (int) strlen(conn->buffer);
+    conn->buffer_sent = 0;
+    write_fixed(conn, conn->client_fd, OP_SEND_ERROR);
+}
+
+// Start connecting to the next address, with a timeout linked to the connect
+static void connect_next(uring_conn_t *conn) {
+    while (conn->next_address < conn->num_addresses) {
+        const char *address = conn->addresses[conn->next_address];
+        stats_syscalls(1);
+        conn->server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (conn->server_fd < 0) {
+            perror("error: socket\n");
+            break;
+        }
+
+        memset(&conn->server_address, 0, sizeof(conn->server_address));
+        conn->server_address.sin_family = AF_INET;
+        conn->server_address.sin_port = htons(conn->port);
+        memcpy(&conn->server_address.sin_addr.s_addr, address, sizeof(struct in_addr));
+
+        // The connect timeout is shared by all the addresses
+        long timeout_ms = engine_config->connect_timeout_ms / conn->num_addresses;
+        if (timeout_ms < MIN_ATTEMPT_TIMEOUT_MS)
+            timeout_ms = MIN_ATTEMPT_TIMEOUT_MS;
+        conn->attempt_timeout.tv_sec = timeout_ms / 1000;
+        conn->attempt_timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        conn->attempt_start_ms = now_ms();
+
+        // Both entries go in one submit, or the link is broken
+        reserve_sqes(2);
+        struct io_uring_sqe *sqe = prepare(IORING_OP_CONNECT, conn->server_fd, OP_CONNECT, conn);
+        sqe->addr = (uint64_t) (uintptr_t) &conn->server_address;
+        sqe->off = sizeof(conn->server_address);
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = prepare(IORING_OP_LINK_TIMEOUT, -1, OP_CONNECT_TIMEOUT, conn);
+        sqe->addr = (uint64_t) (uintptr_t) &conn->attempt_timeout;
+        sqe->len = 1;
+        return;
+    }
+
+    // No address of the server answered
+    conn->record.connect_us = (now_ms() - conn->connect_start_ms) * 1000;
+    send_error(conn, 500);
+}
+
+static void send_relay_head(uring_conn_t *conn) {
+    int bid = conn->queue_head;
+    struct io_uring_sqe *sqe = prepare(IORING_OP_SEND, conn->client_fd, OP_RELAY_SEND, conn);
+    sqe->addr = (uint64_t) (uintptr_t) (relay_memory + (size_t) bid * URING_RELAY_BUFFER_SIZE + conn->head_offset);
+    sqe->len = relay_len[bid] - conn->head_offset;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->sending = true;
+}
+
+static void splice_in(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_SPLICE, conn->pipe_fds[1], OP_SPLICE_IN, conn);
+    sqe->splice_fd_in = conn->server_fd;
+    sqe->splice_off_in = (uint64_t) -1;
+    sqe->off = (uint64_t) -1;
+    sqe->len = URING_SPLICE_SIZE;
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+static void splice_out(uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = prepare(IORING_OP_SPLICE, conn->client_fd, OP_SPLICE_OUT, conn);
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = (uint64_t) -1;
+    sqe->off = (uint64_t) -1;
+    sqe->len = conn->pipe_bytes;
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+static void start_relay(uring_conn_t *conn) {
+    if (engine_config->use_splice) {
+        stats_syscalls(1);
+        if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+            perror("error: pipe\n");
+            conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+            finish(conn);
+            return;
+        }
+        splice_in(conn);
+    } else {
+        arm_relay_recv(conn);
+    }
+}
+
+// Runs in the pool: parse, resolve and filter, then wake up the ring thread
+static int resolve_job(void *arg) {
+    uring_conn_t *conn = (uring_conn_t *) arg;
+
+    long start_us = now_us();
+    if (observe_queue_delay(start_us - conn->accepted_us, start_us)) {
+        conn->status = 503;
+    } else {
+        struct hostent server_entry, *server_info = NULL;
+        char dns_buffer[URING_REQUEST_BUFFER_SIZE];
+        conn->port = 80;
+        conn->status = check_request(conn->buffer, engine_filter, &server_entry,
+                                     dns_buffer, sizeof(dns_buffer), &server_info, &conn->port, &conn->record);
+
+        if (conn->status == 200) {
+            char *resolved[MAX_SERVER_ADDRESSES];
+            int num_resolved = 0;
+            while (num_resolved < MAX_SERVER_ADDRESSES && server_info->h_addr_list[num_resolved] != NULL) {
+                memcpy(conn->raw_addresses[num_resolved], server_info->h_addr_list[num_resolved], sizeof(struct in_addr));
+                resolved[num_resolved] = conn->raw_addresses[num_resolved];
+                num_resolved++;
+            }
+            // Skip addresses that keep failing and try the fastest ones first
+            conn->num_addresses = order_addresses(resolved, num_resolved, conn->addresses);
+            set_connection_to_close(conn->buffer);
+        }
+    }
+
+    pthread_mutex_lock(&resolved_lock);
+    conn->next = resolved_connections;
+    resolved_connections = conn;
+    pthread_mutex_unlock(&resolved_lock);
+
+    uint64_t one = 1;
+    stats_syscalls(1);
+    if (write(event_fd, &one, sizeof(one)) < 0)
+        perror("error: write eventfd\n");
+    return 0;
+}
+
+static void on_accept(int client_fd) {
+    accepted++;
+    long accepted_us = now_us();
+
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    stats_syscalls(1);
+    if (getpeername(client_fd, (struct sockaddr *) &address, &address_len) < 0)
+        memset(&address, 0, sizeof(address));
+
+    // Answer right away when there is no slot or the pool can't take the request
+    if (free_connections == NULL ||
+        admit(address.sin_addr.s_addr, get_queue_size(engine_pool), accepted_us) != ADMIT) {
+        shed_client(client_fd, &address, accepted_us);
+        return;
+    }
+
+    uring_conn_t *conn = free_connections;
+    free_connections = conn->next;
+    active_connections++;
+
+    int index = conn->index;
+    char *buffer = conn->buffer;
+    memset(conn, 0, sizeof(*conn));
+    conn->index = index;
+    conn->buffer = buffer;
+    conn->client_fd = client_fd;
+    conn->server_fd = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->client_address = address;
+    conn->accepted_us = accepted_us;
+
+    stats_request_started();
+    clock_gettime(CLOCK_REALTIME, &conn->record.time);
+    inet_ntop(AF_INET, &address.sin_addr, conn->record.client, sizeof(conn->record.client));
+
+    // Read the request into the registered buffer, leaving room for the terminator and the
+    // header added in place before it is forwarded
+    struct io_uring_sqe *sqe = prepare(IORING_OP_READ_FIXED, client_fd, OP_READ_REQUEST, conn);
+    sqe->addr = (uint64_t) (uintptr_t) conn->buffer;
+    sqe->len = URING_REQUEST_BUFFER_SIZE - URING_REQUEST_HEADROOM;
+    sqe->buf_index = (uint16_t) conn->index;
+}
+
+static void on_resolved(uring_conn_t *conn) {
+    conn->inflight--;
+    if (conn->status != 200) {
+        send_error(conn, conn->status);
+        return;
+    }
+    conn->connect_start_ms = now_ms();
+    connect_next(conn);
+}
+
+static void on_connect(uring_conn_t *conn, int result) {
+    const char *address = conn->addresses[conn->next_address];
+    if (result == 0) {
+        long now = now_ms();
+        report_connect_success(address, now - conn->attempt_start_ms);
+        conn->record.connect_us = (now - conn->connect_start_ms) * 1000;
+        conn->record.status = 200;
+
+        // Forward the request from the registered buffer
+        conn->buffer_len = (int) strlen(conn->buffer);
+        conn->buffer_sent = 0;
+        write_fixed(conn, conn->server_fd, OP_SEND_REQUEST);
+        return;
+    }
+
+    // Failed or timed out, move on to the next address
+    report_connect_failure(address);
+    prepare_close(conn->server_fd);
+    conn->server_fd = -1;
+    conn->next_address++;
+    connect_next(conn);
+}
+
+static void on_relay_recv(uring_conn_t *conn, struct io_uring_cqe *cqe) {
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn->inflight--;
+        conn->recv_armed = false;
+    }
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        int bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (conn->finishing) {
+            recycle_relay_buffer(bid);
+        } else {
+            // Queue the buffer for the client
+            relay_len[bid] = cqe->res;
+            relay_next[bid] = -1;
+            if (conn->queued == 0)
+                conn->queue_head = bid;
+            else
+                relay_next[conn->queue_tail] = bid;
+            conn->queue_tail = bid;
+            conn->queued++;
+            if (!conn->sending)
+                send_relay_head(conn);
+
+            // The client is slower than the server, pause the recv
+            if (more && conn->queued >= URING_RELAY_QUEUE_LIMIT && !conn->recv_paused) {
+                struct io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, OP_IGNORE, NULL);
+                sqe->addr = USER_DATA(OP_RELAY_RECV, conn->index);
+                conn->recv_paused = true;
+            }
+        }
+    } else if (cqe->res == -ENOBUFS) {
+        // Every relay buffer is taken, wait for one to come back even with buffers queued,
+        // arming the recv again right away would only fail again
+        if (!conn->finishing && !conn->starved) {
+            conn->starved = true;
+            conn->next = NULL;
+            *starved_tail = conn;
+            starved_tail = &conn->next;
+        }
+    } else if (cqe->res != -ECANCELED || !conn->recv_paused) {
+        // End of the answer, or the server failed
+        conn->upstream_done = true;
+    }
+
+    if (conn->finishing) {
+        release_if_idle(conn);
+        return;
+    }
+    if (conn->upstream_done && conn->queued == 0) {
+        finish(conn);
+        return;
+    }
+    if (!more)
+        resume_relay_recv(conn);
+}
+
+static void on_relay_send(uring_conn_t *conn, int result) {
+    conn->inflight--;
+    conn->sending = false;
+    if (conn->finishing) {
+        release_if_idle(conn);
+        return;
+    }
+    // The client went away
+    if (result < 0) {
+        finish(conn);
+        return;
+    }
+
+    conn->record.bytes_relayed += result;
+    conn->head_offset += result;
+    int bid = conn->queue_head;
+    if (conn->head_offset >= relay_len[bid]) {
+        conn->queue_head = relay_next[bid];
+        conn->queued--;
+        conn->head_offset = 0;
+        recycle_relay_buffer(bid);
+    }
+
+    if (conn->queued > 0)
+        send_relay_head(conn);
+    else if (conn->upstream_done)
+        finish(conn);
+    if (!conn->finishing)
+        resume_relay_recv(conn);
+}
+
+static void on_conn_completion(uring_conn_t *conn, uring_op_t op, struct io_uring_cqe *cqe) {
+    int result = cqe->res;
+
+    if (op == OP_RELAY_RECV) {
+        on_relay_recv(conn, cqe);
+        return;
+    }
+    if (op == OP_RELAY_SEND) {
+        on_relay_send(conn, result);
+        return;
+    }
+
+    conn->inflight--;
+    if (conn->finishing) {
+        release_if_idle(conn);
+        return;
+    }
+
+    switch (op) {
+        case OP_READ_REQUEST:
+            if (result <= 0) {
+                finish(conn);
+                break;
+            }
+            conn->buffer[result] = '\0';
+            conn->inflight++;
+            dispatch(engine_pool, resolve_job, conn);
+            break;
+        case OP_CONNECT:
+            on_connect(conn, result);
+            break;
+        case OP_CONNECT_TIMEOUT:
+            break;
+        case OP_SEND_REQUEST:
+        case OP_SEND_ERROR:
+            if (result <= 0) {
+                finish(conn);
+                break;
+            }
+            conn->buffer_sent += result;
+            if (op == OP_SEND_ERROR)
+                conn->record.bytes_relayed += result;
+            if (conn->buffer_sent < conn->buffer_len)
+                write_fixed(conn, op == OP_SEND_ERROR ? conn->client_fd : conn->server_fd, op);
+            else if (op == OP_SEND_ERROR)
+                finish(conn);
+            else
+                start_relay(conn);
+            break;
+        case OP_SPLICE_IN:
+            if (result <= 0) {
+                finish(conn);
+                break;
+            }
+            conn->pipe_bytes = result;
+            splice_out(conn);
+            break;
+        case OP_SPLICE_OUT:
+            if (result <= 0) {
+                finish(conn);
+                break;
+            }
+            conn->record.bytes_relayed += result;
+            conn->pipe_bytes -= result;
+            if (conn->pipe_bytes > 0)
+                splice_out(conn);
+            else
+                splice_in(conn);
+            break;
+        default:
+            break;
+    }
+}
+
+static void on_completion(struct io_uring_cqe *cqe) {
+    uring_op_t op = USER_DATA_OP(cqe->user_data);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case OP_IGNORE:
+            break;
+        case OP_ACCEPT:
+            if (!more)
+                accept_armed = false;
+            if (cqe->res >= 0) {
+                if (accepting)
+                    on_accept(cqe->res);
+                else
+                    close(cqe->res);
+            } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+                // Out of descriptors, wait until a connection closes
+                accept_blocked = true;
+                break;
+            }
+            if (accepting && engine_config->max_requests > 0 && accepted >= engine_config->max_requests)
+                stop_accepting();
+            if (accepting && !accept_armed)
+                arm_accept();
+            break;
+        case OP_HANDOFF:
+            if (!more)
+                handoff_armed = false;
+            // A new process took the listening socket, stop accepting and drain
+            if (cqe->res > 0 && accepting &&
+                handoff_send(engine_config->handoff_fd, listen_fd, engine_filter) == 0) {
+                handed_over = true;
+                stop_accepting();
+            } else if (accepting && !handoff_armed) {
+                arm_handoff_poll();
+            }
+            break;
+        case OP_EVENTFD: {
+            pthread_mutex_lock(&resolved_lock);
+            uring_conn_t *conn = resolved_connections;
+            resolved_connections = NULL;
+            pthread_mutex_unlock(&resolved_lock);
+            while (conn != NULL) {
+                uring_conn_t *next = conn->next;
+                on_resolved(conn);
+                conn = next;
+            }
+            arm_event_read();
+            break;
+        }
+        default:
+            on_conn_completion(&connections[USER_DATA_INDEX(cqe->user_data)], op, cqe);
+            break;
+    }
+}
+
+static void reap_completions() {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        // Copy the entry and free its slot first, the handlers prepare new requests
+        struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        on_completion(&cqe);
+        if (head == tail)
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void cleanup() {
+    free_ring();
+    free_buffers();
+    free(connections);
+    connections = NULL;
+    free_connections = NULL;
+    starved_connections = NULL;
+    starved_tail = &starved_connections;
+    if (event_fd >= 0)
+        close(event_fd);
+    event_fd = -1;
+}
+// --------------------------------------------------------------------------------------//
+
+int run_uring_engine(int server_fd, threadpool *tp, const filter_t *filter, const uring_config_t *config) {
+    engine_config = config;
+    engine_pool = tp;
+    engine_filter = filter;
+    listen_fd = server_fd;
+
+    connections = calloc(URING_MAX_CONNECTIONS, sizeof(uring_conn_t));
+    if (connections == NULL) {
+        perror("error: malloc\n");
+        return -1;
+    }
+    if (setup_ring(URING_QUEUE_DEPTH) < 0 || setup_buffers() < 0) {
+        cleanup();
+        return -1;
+    }
+    event_fd = eventfd(0, EFD_CLOEXEC);
+    if (event_fd < 0) {
+        perror("error: eventfd\n");
+        cleanup();
+        return -1;
+    }
+
+    for (int i = URING_MAX_CONNECTIONS - 1; i >= 0; i--) {
+        connections[i].index = i;
+        connections[i].buffer = request_memory + (size_t) i * URING_REQUEST_BUFFER_SIZE;
+        connections[i].next = free_connections;
+        free_connections = &connections[i];
+    }
+
+    // The ring waits for readiness itself, the accept must not fail with EAGAIN
+    int flags = fcntl(server_fd, F_GETFL);
+    fcntl(server_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    active_connections = 0;
+    accepted = 0;
+    handed_over = false;
+    accept_blocked = false;
+    accepting = true;
+    arm_accept();
+    arm_event_read();
+    if (config->handoff_fd >= 0)
+        arm_handoff_poll();
+
+    // Serve until told to stop, then until the connections in flight are done
+    while (accepting || active_connections > 0) {
+        if (accepting && *config->stop_requested)
+            stop_accepting();
+
+        if (submit(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("error: io_uring_enter\n");
+            break;
+        }
+        reap_completions();
+    }
+
+    // Put the flag back for the other processes sharing the socket
+    fcntl(server_fd, F_SETFL, flags);
+
+    // Submit the last closes before the ring goes away
+    submit(0);
+    cleanup();
+    return handed_over ? 1 : 0;
+}
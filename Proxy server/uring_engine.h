@@ -0,0 +1,70 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <signal.h>
+#include "threadpool.h"
+#include "filter_image.h"
+
+/**
+ * uring_engine.h
+ *
+ * An io_uring engine, selected with --engine=uring instead of the thread per request path.
+ *
+ * A single thread owns the ring and runs every connection as a state machine:
+ * multishot accept, a read of the request into the connection's registered buffer,
+ * connect with a linked timeout, a write of the request from the registered buffer,
+ * and the relay of the answer. The relay uses either a multishot recv into a ring
+ * of provided buffers followed by a send of every buffer, or splice through a pipe
+ * so the body never reaches user space. Many operations go to the kernel in one
+ * io_uring_enter instead of one syscall each.
+ *
+ * Parsing, DNS and the filter can block, they still run in the threadpool,
+ * and the results come back to the ring through an eventfd.
+ *
+ * The ring is set up with raw syscalls, liburing is not needed.
+ */
+
+// submission queue entries of the ring
+#define URING_QUEUE_DEPTH 4096
+
+// connections in flight, each one has a registered buffer for its request
+#define URING_MAX_CONNECTIONS 1024
+#define URING_REQUEST_BUFFER_SIZE (8*1024)
+
+// room left after the request read into its registered buffer, for the header set_connection_to_close adds
+#define URING_REQUEST_HEADROOM 256
+
+// provided buffers for the relay, the count must be a power of 2
+#define URING_RELAY_BUFFERS 512
+#define URING_RELAY_BUFFER_SIZE (16*1024)
+
+// relay buffers a connection may hold before its upstream recv pauses
+#define URING_RELAY_QUEUE_LIMIT 8
+
+// bytes moved by a single splice
+#define URING_SPLICE_SIZE (64*1024)
+
+
+/**
+ * Settings of the engine, filled by main from the options
+ */
+typedef struct uring_config_st {
+    long connect_timeout_ms;                // total time for connecting to a server
+    int use_splice;                         // relay with splice instead of provided buffers
+    long max_requests;                      // connections to accept, 0 for no limit
+    int handoff_fd;                         // unix socket for the next process, -1 if disabled
+    const sigset_t *serve_mask;             // signal mask while waiting, lets the stop signals in
+    volatile sig_atomic_t *stop_requested;  // set by the stop signals
+} uring_config_t;
+
+
+/**
+ * run_uring_engine serves connections from server_fd until the limit, a stop
+ * signal or a handoff, then waits for the connections in flight to finish.
+ * @tp - threadpool that parses, resolves and filters the requests
+ * @ return value - 1 if the listening socket was handed over, 0 if it stopped,
+ *                  -1 if io_uring can't be used (nothing was accepted)
+ */
+int run_uring_engine(int server_fd, threadpool *tp, const filter_t *filter, const uring_config_t *config);
+
+#endif //URING_ENGINE_H